@@ -0,0 +1,193 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+
+#include <matekbd-counters.h>
+
+#define MATEKBD_COUNTERS_ENV "MATEKBD_COUNTERS"
+
+static const gchar *counter_names[MATEKBD_COUNTER_LAST] = {
+	"full redraws",
+	"partial redraws",
+	"labels shaped",
+	"X round trips",
+	"config reloads",
+	"reinit_ui calls",
+	"pixbufs loaded",
+	"surfaces allocated",
+};
+
+static const gchar *phase_names[MATEKBD_PHASE_LAST] = {
+	"init_keys_and_doodads",
+	"init_colors",
+	"draw_keyboard",
+	"status rendering",
+	"registry lookups",
+};
+
+/* 64 bit everywhere, so there are no atomics for them on 32 bit systems:
+ * the counters share the lock of the phases */
+G_LOCK_DEFINE_STATIC (phases);
+static guint64 counters[MATEKBD_COUNTER_LAST];
+static guint64 phase_times[MATEKBD_PHASE_LAST];
+static guint64 phase_calls[MATEKBD_PHASE_LAST];
+
+static void
+matekbd_counters_print_at_exit (void)
+{
+	matekbd_counters_print ();
+}
+
+/* arranges for the counters to be printed on exit when asked for in the
+ * environment, the first time anything is counted */
+static void
+matekbd_counters_init (void)
+{
+	static gsize initialized = 0;
+
+	if (g_once_init_enter (&initialized)) {
+		if (g_getenv (MATEKBD_COUNTERS_ENV) != NULL)
+			atexit (matekbd_counters_print_at_exit);
+		g_once_init_leave (&initialized, 1);
+	}
+}
+
+void
+matekbd_counters_add (MatekbdCounter counter, guint value)
+{
+	g_return_if_fail (counter < MATEKBD_COUNTER_LAST);
+
+	matekbd_counters_init ();
+	G_LOCK (phases);
+	counters[counter] += value;
+	G_UNLOCK (phases);
+}
+
+guint64
+matekbd_counters_get (MatekbdCounter counter)
+{
+	guint64 count;
+
+	g_return_val_if_fail (counter < MATEKBD_COUNTER_LAST, 0);
+
+	G_LOCK (phases);
+	count = counters[counter];
+	G_UNLOCK (phases);
+
+	return count;
+}
+
+const gchar *
+matekbd_counters_get_name (MatekbdCounter counter)
+{
+	g_return_val_if_fail (counter < MATEKBD_COUNTER_LAST, NULL);
+
+	return counter_names[counter];
+}
+
+gint64
+matekbd_counters_phase_begin (void)
+{
+	return g_get_monotonic_time ();
+}
+
+void
+matekbd_counters_phase_end (MatekbdPhase phase, gint64 start)
+{
+	gint64 elapsed = g_get_monotonic_time () - start;
+
+	g_return_if_fail (phase < MATEKBD_PHASE_LAST);
+
+	matekbd_counters_init ();
+	G_LOCK (phases);
+	phase_times[phase] += MAX (elapsed, 0);
+	phase_calls[phase]++;
+	G_UNLOCK (phases);
+}
+
+guint64
+matekbd_counters_get_phase_time (MatekbdPhase phase)
+{
+	guint64 time;
+
+	g_return_val_if_fail (phase < MATEKBD_PHASE_LAST, 0);
+
+	G_LOCK (phases);
+	time = phase_times[phase];
+	G_UNLOCK (phases);
+
+	return time;
+}
+
+guint64
+matekbd_counters_get_phase_calls (MatekbdPhase phase)
+{
+	guint64 calls;
+
+	g_return_val_if_fail (phase < MATEKBD_PHASE_LAST, 0);
+
+	G_LOCK (phases);
+	calls = phase_calls[phase];
+	G_UNLOCK (phases);
+
+	return calls;
+}
+
+const gchar *
+matekbd_counters_get_phase_name (MatekbdPhase phase)
+{
+	g_return_val_if_fail (phase < MATEKBD_PHASE_LAST, NULL);
+
+	return phase_names[phase];
+}
+
+void
+matekbd_counters_reset (void)
+{
+	gint i;
+
+	G_LOCK (phases);
+	for (i = 0; i < MATEKBD_COUNTER_LAST; i++)
+		counters[i] = 0;
+	for (i = 0; i < MATEKBD_PHASE_LAST; i++) {
+		phase_times[i] = 0;
+		phase_calls[i] = 0;
+	}
+	G_UNLOCK (phases);
+}
+
+void
+matekbd_counters_print (void)
+{
+	gint i;
+
+	g_printerr ("libmatekbd counters:\n");
+	for (i = 0; i < MATEKBD_COUNTER_LAST; i++)
+		g_printerr ("  %-24s %12" G_GUINT64_FORMAT "\n",
+			    counter_names[i], matekbd_counters_get (i));
+
+	g_printerr ("libmatekbd phases:%9s%12s %12s\n", "", "calls",
+		    "total ms");
+	for (i = 0; i < MATEKBD_PHASE_LAST; i++)
+		g_printerr ("  %-24s %12" G_GUINT64_FORMAT " %12.3f\n",
+			    phase_names[i],
+			    matekbd_counters_get_phase_calls (i),
+			    matekbd_counters_get_phase_time (i) / 1000.0);
+}
@@ -0,0 +1,72 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __MATEKBD_COUNTERS_H__
+#define __MATEKBD_COUNTERS_H__
+
+#include <glib.h>
+
+/*
+ * Process wide counters of the expensive operations of the library and
+ * the time spent in its main phases.  They are always collected; with
+ * MATEKBD_COUNTERS set in the environment they are printed on exit.
+ */
+
+typedef enum {
+	MATEKBD_COUNTER_FULL_REDRAWS,
+	MATEKBD_COUNTER_PARTIAL_REDRAWS,
+	MATEKBD_COUNTER_LABELS_SHAPED,
+	MATEKBD_COUNTER_X_ROUND_TRIPS,
+	MATEKBD_COUNTER_CONFIG_RELOADS,
+	MATEKBD_COUNTER_REINIT_UI,
+	MATEKBD_COUNTER_PIXBUFS_LOADED,
+	MATEKBD_COUNTER_SURFACES_ALLOCATED,
+	MATEKBD_COUNTER_LAST
+} MatekbdCounter;
+
+typedef enum {
+	MATEKBD_PHASE_INIT_KEYS_AND_DOODADS,
+	MATEKBD_PHASE_INIT_COLORS,
+	MATEKBD_PHASE_DRAW_KEYBOARD,
+	MATEKBD_PHASE_STATUS_RENDERING,
+	MATEKBD_PHASE_REGISTRY_LOOKUPS,
+	MATEKBD_PHASE_LAST
+} MatekbdPhase;
+
+extern void matekbd_counters_add (MatekbdCounter counter, guint value);
+
+extern guint64 matekbd_counters_get (MatekbdCounter counter);
+
+extern const gchar *matekbd_counters_get_name (MatekbdCounter counter);
+
+/* Returns the start time to be passed to matekbd_counters_phase_end () */
+extern gint64 matekbd_counters_phase_begin (void);
+
+extern void matekbd_counters_phase_end (MatekbdPhase phase, gint64 start);
+
+/* Cumulative time spent in the phase, in microseconds */
+extern guint64 matekbd_counters_get_phase_time (MatekbdPhase phase);
+
+extern guint64 matekbd_counters_get_phase_calls (MatekbdPhase phase);
+
+extern const gchar *matekbd_counters_get_phase_name (MatekbdPhase phase);
+
+extern void matekbd_counters_reset (void);
+
+extern void matekbd_counters_print (void);
+
+#endif
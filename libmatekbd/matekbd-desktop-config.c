@@ -28,6 +28,7 @@
 #include <gio/gio.h>
 #include <matekbd-desktop-config.h>
 #include <matekbd-config-private.h>
+#include <matekbd-counters.h>
 
 /**
  * MatekbdDesktopConfig:
@@ -145,6 +146,8 @@ matekbd_desktop_config_term (MatekbdDesktopConfig * config)
 void
 matekbd_desktop_config_load_from_gsettings (MatekbdDesktopConfig * config)
 {
+	matekbd_counters_add (MATEKBD_COUNTER_CONFIG_RELOADS, 1);
+
 	config->group_per_app =
 	    g_settings_get_boolean (config->settings,
 				 MATEKBD_DESKTOP_CONFIG_KEY_GROUP_PER_WINDOW);
@@ -285,10 +288,14 @@ matekbd_desktop_config_load_group_descriptions (MatekbdDesktopConfig
 	gchar **psld, **plld, **plvd;
 	gchar **psgn, **pfgn, **psvd;
 	gint total_descriptions;
+	gint64 start = matekbd_counters_phase_begin ();
+	gboolean found;
 
-	if (!matekbd_desktop_config_get_lv_descriptions
+	found = matekbd_desktop_config_get_lv_descriptions
 	    (config, registry, layout_ids, variant_ids, &sld, &lld, &svd,
-	     &lvd)) {
+	     &lvd);
+	matekbd_counters_phase_end (MATEKBD_PHASE_REGISTRY_LOOKUPS, start);
+	if (!found) {
 		return False;
 	}
 
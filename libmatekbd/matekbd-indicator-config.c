@@ -33,6 +33,7 @@
 #include <matekbd-indicator-config.h>
 
 #include <matekbd-config-private.h>
+#include <matekbd-counters.h>
 
 /**
  * MatekbdIndicatorConfig:
@@ -279,6 +280,8 @@ matekbd_indicator_config_term (MatekbdIndicatorConfig * ind_config)
 void
 matekbd_indicator_config_load_from_gsettings (MatekbdIndicatorConfig * ind_config)
 {
+	matekbd_counters_add (MATEKBD_COUNTER_CONFIG_RELOADS, 1);
+
 	ind_config->secondary_groups_mask =
 	    g_settings_get_int (ind_config->settings,
 				MATEKBD_INDICATOR_CONFIG_KEY_SECONDARIES);
@@ -30,6 +30,7 @@
 
 #include <matekbd-desktop-config.h>
 #include <matekbd-indicator-config.h>
+#include <matekbd-counters.h>
 
 typedef struct _gki_globals {
 	XklEngine *engine;
@@ -106,6 +107,8 @@ matekbd_indicator_load_images ()
 			GError *gerror = NULL;
 			image =
 			    gdk_pixbuf_new_from_file (image_file, &gerror);
+			matekbd_counters_add (MATEKBD_COUNTER_PIXBUFS_LOADED,
+					      1);
 			if (image == NULL) {
 				GtkWidget *dialog =
 				    gtk_message_dialog_new (NULL,
@@ -453,6 +456,8 @@ matekbd_indicator_parent_set (GtkWidget * gki, GtkWidget * previous_parent)
 void
 matekbd_indicator_reinit_ui (MatekbdIndicator * gki)
 {
+	matekbd_counters_add (MATEKBD_COUNTER_REINIT_UI, 1);
+
 	matekbd_indicator_cleanup (gki);
 	matekbd_indicator_fill (gki);
 
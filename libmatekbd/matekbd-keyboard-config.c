@@ -29,6 +29,7 @@
 #include <matekbd-keyboard-config.h>
 #include <matekbd-config-private.h>
 #include <matekbd-util.h>
+#include <matekbd-counters.h>
 
 /*
  * MatekbdKeyboardConfig
@@ -90,6 +91,7 @@ matekbd_keyboard_config_get_lv_descriptions (XklConfigRegistry *
 	/* TODO make it not static */
 	static XklConfigItem *litem = NULL;
 	static XklConfigItem *vitem = NULL;
+	gint64 start = matekbd_counters_phase_begin ();
 
 	if (litem == NULL)
 		litem = xkl_config_item_new ();
@@ -121,6 +123,7 @@ matekbd_keyboard_config_get_lv_descriptions (XklConfigRegistry *
 		*variant_descr = NULL;
 
 	g_free ((char *) layout_name);
+	matekbd_counters_phase_end (MATEKBD_PHASE_REGISTRY_LOOKUPS, start);
 	return *layout_descr != NULL;
 }
 
@@ -432,6 +435,7 @@ matekbd_keyboard_config_load_from_gsettings (MatekbdKeyboardConfig * kbd_config,
 				      MatekbdKeyboardConfig *
 				      kbd_config_default)
 {
+	matekbd_counters_add (MATEKBD_COUNTER_CONFIG_RELOADS, 1);
 	matekbd_keyboard_config_load_params (kbd_config,
 					  MATEKBD_KEYBOARD_CONFIG_ACTIVE);
 
@@ -0,0 +1,1191 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <X11/XKBlib.h>
+#include <X11/extensions/XKBgeom.h>
+
+#include <matekbd-keyboard-drawing-cache.h>
+#include <matekbd-counters.h>
+
+/*
+ * A cache entry is one serialized GVariant, mapped into memory when it
+ * is read.  Atoms are server specific, so they are kept as indices into
+ * a table of atom names and interned again on load.  Key names are
+ * packed into 32 bits.  Bump CACHE_FORMAT_VERSION whenever a type below
+ * changes.
+ */
+#define CACHE_FORMAT_VERSION 1
+
+/* where the server compiles its keymaps from, unless told otherwise by
+ * XKB_CONFIG_ROOT; updates of xkeyboard-config show in its mtimes */
+#ifndef XKB_BASE
+#define XKB_BASE "/usr/share/X11/xkb"
+#endif
+
+/* entries older than that are loaded afresh whatever the stamp, and the
+ * directory keeps the most recent ones only */
+#define CACHE_MAX_AGE (30 * G_TIME_SPAN_DAY)
+#define CACHE_MAX_ENTRIES 64
+
+#define NO_INDEX G_MAXUINT32
+
+/* the indicators a physical indicator mask may name */
+#define INDICATORS_MASK \
+	((guint32) (((guint64) 1 << XkbNumIndicators) - 1))
+
+#define CACHE_COLOR "(uay)"
+#define CACHE_OUTLINE "(qa(nn))"
+#define CACHE_SHAPE "(ua" CACHE_OUTLINE "ii(nnnn))"
+/* name, type, priority, top, left, angle, then four numbers and two
+ * strings whose meaning depends on the type, see save_doodad () */
+#define CACHE_DOODAD "(uyynnnqqqqayay)"
+#define CACHE_KEY "(unyy)"
+#define CACHE_ROW "(nnba" CACHE_KEY ")"
+#define CACHE_SECTION "(uynnqqna" CACHE_ROW "a" CACHE_DOODAD ")"
+#define CACHE_GEOMETRY "(uqqua" CACHE_COLOR "a" CACHE_SHAPE "a" \
+			CACHE_SECTION "a" CACHE_DOODAD ")"
+/* key names, key aliases, indicator names, component names */
+#define CACHE_NAMES "(aua(uu)au(uuuuu))"
+#define CACHE_MODS "(yyq)"
+#define CACHE_KEY_TYPE "(" CACHE_MODS "ya(by" CACHE_MODS ")a" CACHE_MODS ")"
+#define CACHE_SYM_MAP "(yyyyyyq)"
+#define CACHE_MAP "(a" CACHE_KEY_TYPE "a" CACHE_SYM_MAP "at)"
+/* version, key, atom names, min and max keycodes, physical indicators */
+#define CACHE_TYPE "(uayaayyyu" CACHE_GEOMETRY CACHE_NAMES CACHE_MAP ")"
+
+typedef struct {
+	GHashTable *index;	/* Atom -> position in atoms + 1 */
+	GArray *atoms;
+} AtomTable;
+
+typedef struct {
+	Atom *atoms;
+	guint num_atoms;
+} LoadState;
+
+static guint32
+pack_key_name (const char *name)
+{
+	guint32 packed;
+
+	memcpy (&packed, name, XkbKeyNameLength);
+	return packed;
+}
+
+static void
+unpack_key_name (guint32 packed, char *name)
+{
+	memcpy (name, &packed, XkbKeyNameLength);
+}
+
+/* the mtimes of the XKB data directories, which change whenever the
+ * files in them are replaced */
+static gchar *
+get_xkb_data_stamp (void)
+{
+	static const gchar *dirs[] = {
+		"", "rules", "keycodes", "types", "compat", "symbols",
+		"geometry"
+	};
+	const gchar *root = g_getenv ("XKB_CONFIG_ROOT");
+	GString *stamp = g_string_new (NULL);
+	guint i;
+
+	if (root == NULL || *root == '\0')
+		root = XKB_BASE;
+
+	for (i = 0; i < G_N_ELEMENTS (dirs); i++) {
+		gchar *dir = g_build_filename (root, dirs[i], NULL);
+		GStatBuf buf;
+
+		if (g_stat (dir, &buf) == 0)
+			g_string_append_printf (stamp, " %" G_GINT64_FORMAT,
+						(gint64) buf.st_mtime);
+		else
+			g_string_append (stamp, " -");
+		g_free (dir);
+	}
+
+	return g_string_free (stamp, FALSE);
+}
+
+/* everything that determines what the server compiles for the names */
+static gchar *
+get_cache_key (Display * display, XkbComponentNamesRec * names)
+{
+	gchar *stamp = get_xkb_data_stamp ();
+	gchar *key;
+
+	key = g_strdup_printf ("%u\n%s %d\n%s\n%s\n%s\n%s\n%s\n%s\n%s",
+				CACHE_FORMAT_VERSION,
+				ServerVendor (display),
+				VendorRelease (display), stamp,
+				names->keymap ? names->keymap : "",
+				names->keycodes ? names->keycodes : "",
+				names->types ? names->types : "",
+				names->compat ? names->compat : "",
+				names->symbols ? names->symbols : "",
+				names->geometry ? names->geometry : "");
+	g_free (stamp);
+
+	return key;
+}
+
+typedef struct {
+	gchar *path;
+	gint64 mtime;
+} CacheEntry;
+
+static gint
+compare_cache_entries (const CacheEntry * a, const CacheEntry * b)
+{
+	/* the most recent first */
+	return a->mtime < b->mtime ? 1 : a->mtime > b->mtime ? -1 : 0;
+}
+
+/* removes the entries beyond the most recent CACHE_MAX_ENTRIES ones,
+ * the stale ones among them included */
+static void
+prune_cache (const gchar * dir)
+{
+	GDir *gdir = g_dir_open (dir, 0, NULL);
+	GArray *entries;
+	const gchar *name;
+	guint i;
+
+	if (gdir == NULL)
+		return;
+
+	entries = g_array_new (FALSE, FALSE, sizeof (CacheEntry));
+	while ((name = g_dir_read_name (gdir)) != NULL) {
+		CacheEntry entry;
+		GStatBuf buf;
+
+		entry.path = g_build_filename (dir, name, NULL);
+		if (g_stat (entry.path, &buf) != 0) {
+			g_free (entry.path);
+			continue;
+		}
+		entry.mtime = buf.st_mtime;
+		g_array_append_val (entries, entry);
+	}
+	g_dir_close (gdir);
+
+	g_array_sort (entries, (GCompareFunc) compare_cache_entries);
+	for (i = 0; i < entries->len; i++) {
+		CacheEntry *entry = &g_array_index (entries, CacheEntry, i);
+
+		if (i >= CACHE_MAX_ENTRIES)
+			g_unlink (entry->path);
+		g_free (entry->path);
+	}
+	g_array_free (entries, TRUE);
+}
+
+/* whether the entry is too old to be used, removing it then */
+static gboolean
+cache_entry_expired (const gchar * path)
+{
+	GStatBuf buf;
+
+	if (g_stat (path, &buf) != 0)
+		return TRUE;
+	if ((g_get_real_time () / G_USEC_PER_SEC - buf.st_mtime) *
+	    G_USEC_PER_SEC < CACHE_MAX_AGE)
+		return FALSE;
+
+	g_unlink (path);
+	return TRUE;
+}
+
+static gchar *
+get_cache_path (const gchar * key)
+{
+	gchar *checksum =
+	    g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+	gchar *path = g_build_filename (g_get_user_cache_dir (),
+					"libmatekbd", "keyboard-drawing",
+					checksum, NULL);
+
+	g_free (checksum);
+	return path;
+}
+
+static guint32
+atom_table_add (AtomTable * table, Atom atom)
+{
+	gpointer value;
+
+	if (atom == None)
+		return NO_INDEX;
+
+	value = g_hash_table_lookup (table->index, GSIZE_TO_POINTER (atom));
+	if (value != NULL)
+		return GPOINTER_TO_UINT (value) - 1;
+
+	g_array_append_val (table->atoms, atom);
+	g_hash_table_insert (table->index, GSIZE_TO_POINTER (atom),
+			     GUINT_TO_POINTER (table->atoms->len));
+	return table->atoms->len - 1;
+}
+
+static Atom
+get_atom (LoadState * state, guint32 index)
+{
+	return index < state->num_atoms ? state->atoms[index] : None;
+}
+
+static gchar *
+dup_string (const gchar * s)
+{
+	/* freed by Xkb, so not by g_free () */
+	return *s != '\0' ? strdup (s) : NULL;
+}
+
+static void
+save_doodad (GVariantBuilder * builder, AtomTable * atoms,
+	     XkbDoodadRec * doodad)
+{
+	guint16 n[4] = { 0, 0, 0, 0 };
+	const gchar *s[2] = { NULL, NULL };
+
+	switch (doodad->any.type) {
+	case XkbOutlineDoodad:
+	case XkbSolidDoodad:
+		n[0] = doodad->shape.color_ndx;
+		n[1] = doodad->shape.shape_ndx;
+		break;
+	case XkbTextDoodad:
+		n[0] = doodad->text.color_ndx;
+		n[2] = doodad->text.width;
+		n[3] = doodad->text.height;
+		s[0] = doodad->text.text;
+		s[1] = doodad->text.font;
+		break;
+	case XkbIndicatorDoodad:
+		n[0] = doodad->indicator.on_color_ndx;
+		n[1] = doodad->indicator.shape_ndx;
+		n[2] = doodad->indicator.off_color_ndx;
+		break;
+	case XkbLogoDoodad:
+		n[0] = doodad->logo.color_ndx;
+		n[1] = doodad->logo.shape_ndx;
+		s[0] = doodad->logo.logo_name;
+		break;
+	}
+
+	g_variant_builder_add (builder, "(uyynnnqqqq^ay^ay)",
+			       atom_table_add (atoms, doodad->any.name),
+			       doodad->any.type, doodad->any.priority,
+			       doodad->any.top, doodad->any.left,
+			       doodad->any.angle, n[0], n[1], n[2], n[3],
+			       s[0] ? s[0] : "", s[1] ? s[1] : "");
+}
+
+static gint
+get_outline_index (XkbShapeRec * shape, XkbOutlineRec * outline)
+{
+	return outline != NULL ? XkbOutlineIndex (shape, outline) : -1;
+}
+
+static GVariant *
+save_geometry (AtomTable * atoms, XkbGeometryRec * geom)
+{
+	GVariantBuilder colors, shapes, sections, doodads;
+	gint i, j, k, l;
+
+	g_variant_builder_init (&colors, G_VARIANT_TYPE ("a" CACHE_COLOR));
+	for (i = 0; i < geom->num_colors; i++)
+		g_variant_builder_add (&colors, "(u^ay)",
+				       geom->colors[i].pixel,
+				       geom->colors[i].spec ?
+				       geom->colors[i].spec : "");
+
+	g_variant_builder_init (&shapes, G_VARIANT_TYPE ("a" CACHE_SHAPE));
+	for (i = 0; i < geom->num_shapes; i++) {
+		XkbShapeRec *shape = geom->shapes + i;
+
+		g_variant_builder_open (&shapes,
+					G_VARIANT_TYPE (CACHE_SHAPE));
+		g_variant_builder_add (&shapes, "u",
+				       atom_table_add (atoms, shape->name));
+		g_variant_builder_open (&shapes,
+					G_VARIANT_TYPE ("a" CACHE_OUTLINE));
+		for (j = 0; j < shape->num_outlines; j++) {
+			XkbOutlineRec *outline = shape->outlines + j;
+
+			g_variant_builder_open (&shapes,
+						G_VARIANT_TYPE
+						(CACHE_OUTLINE));
+			g_variant_builder_add (&shapes, "q",
+					       outline->corner_radius);
+			g_variant_builder_open (&shapes,
+						G_VARIANT_TYPE ("a(nn)"));
+			for (k = 0; k < outline->num_points; k++)
+				g_variant_builder_add (&shapes, "(nn)",
+						       outline->points[k].x,
+						       outline->points[k].y);
+			g_variant_builder_close (&shapes);
+			g_variant_builder_close (&shapes);
+		}
+		g_variant_builder_close (&shapes);
+		g_variant_builder_add (&shapes, "i",
+				       get_outline_index (shape,
+							  shape->primary));
+		g_variant_builder_add (&shapes, "i",
+				       get_outline_index (shape,
+							  shape->approx));
+		g_variant_builder_add (&shapes, "(nnnn)", shape->bounds.x1,
+				       shape->bounds.y1, shape->bounds.x2,
+				       shape->bounds.y2);
+		g_variant_builder_close (&shapes);
+	}
+
+	g_variant_builder_init (&sections,
+				G_VARIANT_TYPE ("a" CACHE_SECTION));
+	for (i = 0; i < geom->num_sections; i++) {
+		XkbSectionRec *section = geom->sections + i;
+
+		g_variant_builder_open (&sections,
+					G_VARIANT_TYPE (CACHE_SECTION));
+		g_variant_builder_add (&sections, "u",
+				       atom_table_add (atoms,
+						       section->name));
+		g_variant_builder_add (&sections, "y", section->priority);
+		g_variant_builder_add (&sections, "n", section->top);
+		g_variant_builder_add (&sections, "n", section->left);
+		g_variant_builder_add (&sections, "q", section->width);
+		g_variant_builder_add (&sections, "q", section->height);
+		g_variant_builder_add (&sections, "n", section->angle);
+
+		g_variant_builder_open (&sections,
+					G_VARIANT_TYPE ("a" CACHE_ROW));
+		for (j = 0; j < section->num_rows; j++) {
+			XkbRowRec *row = section->rows + j;
+
+			g_variant_builder_open (&sections,
+						G_VARIANT_TYPE (CACHE_ROW));
+			g_variant_builder_add (&sections, "n", row->top);
+			g_variant_builder_add (&sections, "n", row->left);
+			g_variant_builder_add (&sections, "b",
+					       row->vertical != 0);
+			g_variant_builder_open (&sections,
+						G_VARIANT_TYPE ("a"
+								CACHE_KEY));
+			for (l = 0; l < row->num_keys; l++) {
+				XkbKeyRec *key = row->keys + l;
+
+				g_variant_builder_add (&sections, CACHE_KEY,
+						       pack_key_name
+						       (key->name.name),
+						       key->gap,
+						       key->shape_ndx,
+						       key->color_ndx);
+			}
+			g_variant_builder_close (&sections);
+			g_variant_builder_close (&sections);
+		}
+		g_variant_builder_close (&sections);
+
+		g_variant_builder_open (&sections,
+					G_VARIANT_TYPE ("a" CACHE_DOODAD));
+		for (j = 0; j < section->num_doodads; j++)
+			save_doodad (&sections, atoms, section->doodads + j);
+		g_variant_builder_close (&sections);
+
+		g_variant_builder_close (&sections);
+	}
+
+	g_variant_builder_init (&doodads, G_VARIANT_TYPE ("a" CACHE_DOODAD));
+	for (i = 0; i < geom->num_doodads; i++)
+		save_doodad (&doodads, atoms, geom->doodads + i);
+
+	return g_variant_new ("(uqqu" "a" CACHE_COLOR "a" CACHE_SHAPE "a"
+			      CACHE_SECTION "a" CACHE_DOODAD ")",
+			      atom_table_add (atoms, geom->name),
+			      geom->width_mm, geom->height_mm,
+			      geom->label_color ?
+			      (guint32) XkbGeomColorIndex (geom,
+							   geom->
+							   label_color) :
+			      NO_INDEX, &colors, &shapes, &sections,
+			      &doodads);
+}
+
+static GVariant *
+save_names (AtomTable * atoms, XkbDescRec * xkb)
+{
+	XkbNamesRec *names = xkb->names;
+	GVariantBuilder keys, aliases, indicators;
+	gint i;
+
+	g_variant_builder_init (&keys, G_VARIANT_TYPE ("au"));
+	for (i = xkb->min_key_code; i <= xkb->max_key_code; i++)
+		g_variant_builder_add (&keys, "u",
+				       names->keys ?
+				       pack_key_name (names->keys[i].name) :
+				       0);
+
+	g_variant_builder_init (&aliases, G_VARIANT_TYPE ("a(uu)"));
+	for (i = 0; names->key_aliases && i < names->num_key_aliases; i++)
+		g_variant_builder_add (&aliases, "(uu)",
+				       pack_key_name (names->
+						      key_aliases[i].real),
+				       pack_key_name (names->
+						      key_aliases[i].alias));
+
+	g_variant_builder_init (&indicators, G_VARIANT_TYPE ("au"));
+	for (i = 0; i < XkbNumIndicators; i++)
+		g_variant_builder_add (&indicators, "u",
+				       atom_table_add (atoms,
+						       names->indicators[i]));
+
+	return g_variant_new ("(auaa(uu)au(uuuuu))", &keys, &aliases,
+			      &indicators,
+			      atom_table_add (atoms, names->keycodes),
+			      atom_table_add (atoms, names->geometry),
+			      atom_table_add (atoms, names->symbols),
+			      atom_table_add (atoms, names->types),
+			      atom_table_add (atoms, names->compat));
+}
+
+static GVariant *
+save_map (XkbDescRec * xkb)
+{
+	XkbClientMapRec *map = xkb->map;
+	GVariantBuilder types, sym_maps, syms;
+	gint i, j;
+
+	g_variant_builder_init (&types, G_VARIANT_TYPE ("a" CACHE_KEY_TYPE));
+	for (i = 0; i < map->num_types; i++) {
+		XkbKeyTypeRec *type = map->types + i;
+
+		g_variant_builder_open (&types,
+					G_VARIANT_TYPE (CACHE_KEY_TYPE));
+		g_variant_builder_add (&types, CACHE_MODS, type->mods.mask,
+				       type->mods.real_mods,
+				       type->mods.vmods);
+		g_variant_builder_add (&types, "y", type->num_levels);
+
+		g_variant_builder_open (&types,
+					G_VARIANT_TYPE ("a(by" CACHE_MODS
+							")"));
+		for (j = 0; type->map && j < type->map_count; j++) {
+			XkbKTMapEntryRec *entry = type->map + j;
+
+			g_variant_builder_add (&types, "(by(yyq))",
+					       entry->active != 0,
+					       entry->level,
+					       entry->mods.mask,
+					       entry->mods.real_mods,
+					       entry->mods.vmods);
+		}
+		g_variant_builder_close (&types);
+
+		g_variant_builder_open (&types,
+					G_VARIANT_TYPE ("a" CACHE_MODS));
+		for (j = 0; type->preserve && j < type->map_count; j++)
+			g_variant_builder_add (&types, CACHE_MODS,
+					       type->preserve[j].mask,
+					       type->preserve[j].real_mods,
+					       type->preserve[j].vmods);
+		g_variant_builder_close (&types);
+
+		g_variant_builder_close (&types);
+	}
+
+	g_variant_builder_init (&sym_maps,
+				G_VARIANT_TYPE ("a" CACHE_SYM_MAP));
+	for (i = xkb->min_key_code; i <= xkb->max_key_code; i++) {
+		XkbSymMapRec *sym_map = map->key_sym_map + i;
+
+		g_variant_builder_add (&sym_maps, CACHE_SYM_MAP,
+				       sym_map->kt_index[0],
+				       sym_map->kt_index[1],
+				       sym_map->kt_index[2],
+				       sym_map->kt_index[3],
+				       sym_map->group_info, sym_map->width,
+				       sym_map->offset);
+	}
+
+	g_variant_builder_init (&syms, G_VARIANT_TYPE ("at"));
+	for (i = 0; i < map->num_syms; i++)
+		g_variant_builder_add (&syms, "t", (guint64) map->syms[i]);
+
+	return g_variant_new ("(a" CACHE_KEY_TYPE "a" CACHE_SYM_MAP "at)",
+			      &types, &sym_maps, &syms);
+}
+
+void
+matekbd_keyboard_drawing_cache_save (Display * display,
+				     XkbComponentNamesRec * names,
+				     XkbDescRec * xkb)
+{
+	AtomTable atoms;
+	GVariantBuilder atom_names;
+	GVariant *geometry, *xkb_names, *map, *cache;
+	char **strings;
+	gchar *key, *path, *dir;
+	guint i;
+
+	if (xkb->geom == NULL || xkb->names == NULL || xkb->map == NULL
+	    || xkb->map->key_sym_map == NULL || xkb->indicators == NULL)
+		return;
+
+	atoms.index = g_hash_table_new (NULL, NULL);
+	atoms.atoms = g_array_new (FALSE, FALSE, sizeof (Atom));
+
+	geometry = save_geometry (&atoms, xkb->geom);
+	xkb_names = save_names (&atoms, xkb);
+	map = save_map (xkb);
+
+	/* one round trip for all the names */
+	strings = g_new0 (char *, atoms.atoms->len + 1);
+	matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS, 1);
+	if (atoms.atoms->len > 0 &&
+	    !XGetAtomNames (display, (Atom *) atoms.atoms->data,
+			    atoms.atoms->len, strings)) {
+		g_variant_unref (g_variant_ref_sink (geometry));
+		g_variant_unref (g_variant_ref_sink (xkb_names));
+		g_variant_unref (g_variant_ref_sink (map));
+		goto out;
+	}
+
+	g_variant_builder_init (&atom_names, G_VARIANT_TYPE ("aay"));
+	for (i = 0; i < atoms.atoms->len; i++)
+		g_variant_builder_add (&atom_names, "^ay", strings[i]);
+
+	key = get_cache_key (display, names);
+	cache = g_variant_ref_sink (g_variant_new ("(u^ayaayyyu@"
+						   CACHE_GEOMETRY "@"
+						   CACHE_NAMES "@" CACHE_MAP
+						   ")",
+						   CACHE_FORMAT_VERSION,
+						   key, &atom_names,
+						   xkb->min_key_code,
+						   xkb->max_key_code,
+						   (guint32) xkb->
+						   indicators->phys_indicators,
+						   geometry, xkb_names,
+						   map));
+
+	path = get_cache_path (key);
+	dir = g_path_get_dirname (path);
+	/* the cache is only an optimization, failing to write it is fine */
+	if (g_mkdir_with_parents (dir, 0700) == 0
+	    && g_file_set_contents (path, g_variant_get_data (cache),
+				    g_variant_get_size (cache), NULL))
+		prune_cache (dir);
+
+	g_free (dir);
+	g_free (path);
+	g_free (key);
+	g_variant_unref (cache);
+
+      out:
+	for (i = 0; i < atoms.atoms->len; i++)
+		if (strings[i] != NULL)
+			XFree (strings[i]);
+	g_free (strings);
+	g_array_free (atoms.atoms, TRUE);
+	g_hash_table_destroy (atoms.index);
+}
+
+/* the file is not trusted: every index is checked before it is used */
+static gboolean
+load_doodad (LoadState * state, XkbGeometryRec * geom,
+	     XkbDoodadRec * doodad, GVariant * v)
+{
+	guint32 name;
+	guchar type, priority;
+	gint16 top, left, angle;
+	guint16 n[4];
+	const gchar *s[2];
+
+	g_variant_get (v, "(uyynnnqqqq^&ay^&ay)", &name, &type, &priority,
+		       &top, &left, &angle, n, n + 1, n + 2, n + 3, s,
+		       s + 1);
+
+	doodad->any.name = get_atom (state, name);
+	doodad->any.type = type;
+	doodad->any.priority = priority;
+	doodad->any.top = top;
+	doodad->any.left = left;
+	doodad->any.angle = angle;
+
+	switch (type) {
+	case XkbOutlineDoodad:
+	case XkbSolidDoodad:
+		if (n[0] >= geom->num_colors || n[1] >= geom->num_shapes)
+			return FALSE;
+		doodad->shape.color_ndx = n[0];
+		doodad->shape.shape_ndx = n[1];
+		break;
+	case XkbTextDoodad:
+		if (n[0] >= geom->num_colors)
+			return FALSE;
+		doodad->text.color_ndx = n[0];
+		doodad->text.width = (gint16) n[2];
+		doodad->text.height = (gint16) n[3];
+		doodad->text.text = strdup (s[0]);
+		doodad->text.font = dup_string (s[1]);
+		break;
+	case XkbIndicatorDoodad:
+		if (n[0] >= geom->num_colors || n[2] >= geom->num_colors
+		    || n[1] >= geom->num_shapes)
+			return FALSE;
+		doodad->indicator.on_color_ndx = n[0];
+		doodad->indicator.shape_ndx = n[1];
+		doodad->indicator.off_color_ndx = n[2];
+		break;
+	case XkbLogoDoodad:
+		if (n[0] >= geom->num_colors || n[1] >= geom->num_shapes)
+			return FALSE;
+		doodad->logo.color_ndx = n[0];
+		doodad->logo.shape_ndx = n[1];
+		doodad->logo.logo_name = dup_string (s[0]);
+		break;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+load_shape (LoadState * state, XkbShapeRec * shape, GVariant * v)
+{
+	GVariant *outlines, *points;
+	guint32 name;
+	gint32 primary, approx;
+	guint16 corner_radius;
+	gsize i, j, n;
+
+	g_variant_get (v, "(u@a" CACHE_OUTLINE "ii(nnnn))", &name,
+		       &outlines, &primary, &approx, &shape->bounds.x1,
+		       &shape->bounds.y1, &shape->bounds.x2,
+		       &shape->bounds.y2);
+
+	shape->name = get_atom (state, name);
+
+	/* a corrupt array reads as an empty one, and keys are drawn from
+	 * the first outline of their shape and its first point */
+	n = g_variant_n_children (outlines);
+	if (n == 0 || n > G_MAXUINT16
+	    || XkbAllocGeomOutlines (shape, n) != Success) {
+		g_variant_unref (outlines);
+		return FALSE;
+	}
+
+	for (i = 0; i < n; i++) {
+		XkbOutlineRec *outline = shape->outlines + i;
+		gsize num_points;
+
+		g_variant_get_child (outlines, i, "(q@a(nn))",
+				     &corner_radius, &points);
+		outline->corner_radius = corner_radius;
+		shape->num_outlines++;
+
+		num_points = g_variant_n_children (points);
+		if (num_points == 0 || num_points > G_MAXUINT16
+		    || XkbAllocGeomPoints (outline, num_points) != Success) {
+			g_variant_unref (points);
+			g_variant_unref (outlines);
+			return FALSE;
+		}
+		for (j = 0; j < num_points; j++)
+			g_variant_get_child (points, j, "(nn)",
+					     &outline->points[j].x,
+					     &outline->points[j].y);
+		outline->num_points = num_points;
+		g_variant_unref (points);
+	}
+	g_variant_unref (outlines);
+
+	if (primary >= (gint32) shape->num_outlines
+	    || approx >= (gint32) shape->num_outlines)
+		return FALSE;
+	shape->primary = primary >= 0 ? shape->outlines + primary : NULL;
+	shape->approx = approx >= 0 ? shape->outlines + approx : NULL;
+
+	return TRUE;
+}
+
+static gboolean
+load_section (LoadState * state, XkbGeometryRec * geom,
+	      XkbSectionRec * section, GVariant * v)
+{
+	GVariant *rows, *doodads;
+	guint32 name;
+	gsize i, j, n;
+
+	g_variant_get (v, "(uynnqqn@a" CACHE_ROW "@a" CACHE_DOODAD ")",
+		       &name, &section->priority, &section->top,
+		       &section->left, &section->width, &section->height,
+		       &section->angle, &rows, &doodads);
+
+	section->name = get_atom (state, name);
+
+	n = g_variant_n_children (rows);
+	if (n > G_MAXUINT16
+	    || (n > 0 && XkbAllocGeomRows (section, n) != Success))
+		goto fail;
+
+	for (i = 0; i < n; i++) {
+		XkbRowRec *row = section->rows + i;
+		GVariant *keys;
+		gboolean vertical;
+		gsize num_keys;
+
+		g_variant_get_child (rows, i, "(nnb@a" CACHE_KEY ")",
+				     &row->top, &row->left, &vertical,
+				     &keys);
+		row->vertical = vertical;
+		section->num_rows++;
+
+		num_keys = g_variant_n_children (keys);
+		if (num_keys > G_MAXUINT16
+		    || (num_keys > 0
+			&& XkbAllocGeomKeys (row, num_keys) != Success)) {
+			g_variant_unref (keys);
+			goto fail;
+		}
+		for (j = 0; j < num_keys; j++) {
+			XkbKeyRec *key = row->keys + j;
+			guint32 key_name;
+
+			g_variant_get_child (keys, j, CACHE_KEY, &key_name,
+					     &key->gap, &key->shape_ndx,
+					     &key->color_ndx);
+			unpack_key_name (key_name, key->name.name);
+			row->num_keys++;
+
+			if (key->shape_ndx >= geom->num_shapes
+			    || key->color_ndx >= geom->num_colors) {
+				g_variant_unref (keys);
+				goto fail;
+			}
+		}
+		g_variant_unref (keys);
+	}
+
+	n = g_variant_n_children (doodads);
+	if (n > G_MAXUINT16
+	    || (n > 0 && XkbAllocGeomSectionDoodads (section, n) != Success))
+		goto fail;
+
+	for (i = 0; i < n; i++) {
+		GVariant *doodad = g_variant_get_child_value (doodads, i);
+		gboolean valid =
+		    load_doodad (state, geom, section->doodads + i, doodad);
+
+		g_variant_unref (doodad);
+		section->num_doodads++;
+		if (!valid)
+			goto fail;
+	}
+
+	g_variant_unref (rows);
+	g_variant_unref (doodads);
+
+	XkbComputeSectionBounds (geom, section);
+	return TRUE;
+
+      fail:
+	g_variant_unref (rows);
+	g_variant_unref (doodads);
+	return FALSE;
+}
+
+static gboolean
+load_geometry (LoadState * state, XkbDescRec * xkb, GVariant * v)
+{
+	XkbGeometrySizesRec sizes;
+	XkbGeometryRec *geom;
+	GVariant *colors, *shapes, *sections, *doodads;
+	guint32 name, label_color;
+	guint16 width_mm, height_mm;
+	gboolean result = FALSE;
+	gsize i;
+
+	g_variant_get (v, "(uqqu@a" CACHE_COLOR "@a" CACHE_SHAPE "@a"
+		       CACHE_SECTION "@a" CACHE_DOODAD ")", &name,
+		       &width_mm, &height_mm, &label_color, &colors,
+		       &shapes, &sections, &doodads);
+
+	memset (&sizes, 0, sizeof (sizes));
+	sizes.which = XkbGeomAllMask;
+	sizes.num_colors = MIN (g_variant_n_children (colors), G_MAXUINT16);
+	sizes.num_shapes = MIN (g_variant_n_children (shapes), G_MAXUINT16);
+	sizes.num_sections =
+	    MIN (g_variant_n_children (sections), G_MAXUINT16);
+	sizes.num_doodads =
+	    MIN (g_variant_n_children (doodads), G_MAXUINT16);
+
+	if (XkbAllocGeometry (xkb, &sizes) != Success)
+		goto out;
+
+	geom = xkb->geom;
+	geom->name = get_atom (state, name);
+	geom->width_mm = width_mm;
+	geom->height_mm = height_mm;
+
+	for (i = 0; i < sizes.num_colors; i++) {
+		XkbColorRec *color = geom->colors + i;
+		const gchar *spec;
+
+		g_variant_get_child (colors, i, "(u^&ay)", &color->pixel,
+				     &spec);
+		color->spec = strdup (spec);
+		geom->num_colors++;
+	}
+	if (label_color >= geom->num_colors)
+		goto out;
+	geom->label_color = geom->colors + label_color;
+
+	for (i = 0; i < sizes.num_shapes; i++) {
+		GVariant *shape = g_variant_get_child_value (shapes, i);
+		gboolean valid =
+		    load_shape (state, geom->shapes + i, shape);
+
+		g_variant_unref (shape);
+		geom->num_shapes++;
+		if (!valid)
+			goto out;
+	}
+
+	for (i = 0; i < sizes.num_sections; i++) {
+		GVariant *section = g_variant_get_child_value (sections, i);
+		gboolean valid =
+		    load_section (state, geom, geom->sections + i, section);
+
+		g_variant_unref (section);
+		geom->num_sections++;
+		if (!valid)
+			goto out;
+	}
+
+	for (i = 0; i < sizes.num_doodads; i++) {
+		GVariant *doodad = g_variant_get_child_value (doodads, i);
+		gboolean valid =
+		    load_doodad (state, geom, geom->doodads + i, doodad);
+
+		g_variant_unref (doodad);
+		geom->num_doodads++;
+		if (!valid)
+			goto out;
+	}
+
+	result = TRUE;
+
+      out:
+	g_variant_unref (colors);
+	g_variant_unref (shapes);
+	g_variant_unref (sections);
+	g_variant_unref (doodads);
+	return result;
+}
+
+static gboolean
+load_names (LoadState * state, XkbDescRec * xkb, GVariant * v)
+{
+	XkbNamesRec *names;
+	GVariant *keys, *aliases, *indicators;
+	guint32 keycodes, geometry, symbols, types, compat;
+	gboolean result = FALSE;
+	gsize i, num_aliases;
+
+	g_variant_get (v, "(@au@a(uu)@au(uuuuu))", &keys, &aliases,
+		       &indicators, &keycodes, &geometry, &symbols, &types,
+		       &compat);
+
+	num_aliases = g_variant_n_children (aliases);
+	if (g_variant_n_children (keys) !=
+	    (gsize) (xkb->max_key_code - xkb->min_key_code + 1)
+	    || g_variant_n_children (indicators) != XkbNumIndicators
+	    || num_aliases > G_MAXUINT8)
+		goto out;
+
+	if (XkbAllocNames (xkb, XkbKeyNamesMask | XkbKeyAliasesMask |
+			   XkbIndicatorNamesMask, 0, num_aliases) != Success)
+		goto out;
+
+	names = xkb->names;
+	for (i = 0; i < g_variant_n_children (keys); i++) {
+		guint32 name;
+
+		g_variant_get_child (keys, i, "u", &name);
+		unpack_key_name (name, names->keys[xkb->min_key_code + i].name);
+	}
+
+	names->num_key_aliases = num_aliases;
+	for (i = 0; i < num_aliases; i++) {
+		guint32 real, alias;
+
+		g_variant_get_child (aliases, i, "(uu)", &real, &alias);
+		unpack_key_name (real, names->key_aliases[i].real);
+		unpack_key_name (alias, names->key_aliases[i].alias);
+	}
+
+	for (i = 0; i < XkbNumIndicators; i++) {
+		guint32 name;
+
+		g_variant_get_child (indicators, i, "u", &name);
+		names->indicators[i] = get_atom (state, name);
+	}
+
+	names->keycodes = get_atom (state, keycodes);
+	names->geometry = get_atom (state, geometry);
+	names->symbols = get_atom (state, symbols);
+	names->types = get_atom (state, types);
+	names->compat = get_atom (state, compat);
+
+	result = TRUE;
+
+      out:
+	g_variant_unref (keys);
+	g_variant_unref (aliases);
+	g_variant_unref (indicators);
+	return result;
+}
+
+static gboolean
+load_key_type (XkbKeyTypeRec * type, GVariant * v)
+{
+	GVariant *entries, *preserve;
+	gsize i, n;
+
+	g_variant_get (v, "((yyq)y@a(by" CACHE_MODS ")@a" CACHE_MODS ")",
+		       &type->mods.mask, &type->mods.real_mods,
+		       &type->mods.vmods, &type->num_levels, &entries,
+		       &preserve);
+
+	n = g_variant_n_children (entries);
+	if (type->num_levels == 0 || n > G_MAXUINT8
+	    || (g_variant_n_children (preserve) != 0
+		&& g_variant_n_children (preserve) != n)) {
+		g_variant_unref (entries);
+		g_variant_unref (preserve);
+		return FALSE;
+	}
+
+	/* freed by Xkb, so not by g_free () */
+	type->map_count = n;
+	type->map = n > 0 ? calloc (n, sizeof (XkbKTMapEntryRec)) : NULL;
+	for (i = 0; i < n; i++) {
+		XkbKTMapEntryRec *entry = type->map + i;
+		gboolean active;
+
+		g_variant_get_child (entries, i, "(by(yyq))", &active,
+				     &entry->level, &entry->mods.mask,
+				     &entry->mods.real_mods,
+				     &entry->mods.vmods);
+		entry->active = active;
+		/* the level picks the keysym of the key */
+		if (entry->level >= type->num_levels) {
+			g_variant_unref (entries);
+			g_variant_unref (preserve);
+			return FALSE;
+		}
+	}
+
+	if (g_variant_n_children (preserve) != 0) {
+		type->preserve = calloc (n, sizeof (XkbModsRec));
+		for (i = 0; i < n; i++)
+			g_variant_get_child (preserve, i, CACHE_MODS,
+					     &type->preserve[i].mask,
+					     &type->preserve[i].real_mods,
+					     &type->preserve[i].vmods);
+	}
+
+	g_variant_unref (entries);
+	g_variant_unref (preserve);
+	return TRUE;
+}
+
+static gboolean
+load_map (XkbDescRec * xkb, GVariant * v)
+{
+	XkbClientMapRec *map;
+	GVariant *types, *sym_maps, *syms;
+	gboolean result = FALSE;
+	gsize i, num_types, num_syms;
+
+	g_variant_get (v, "(@a" CACHE_KEY_TYPE "@a" CACHE_SYM_MAP "@at)",
+		       &types, &sym_maps, &syms);
+
+	num_types = g_variant_n_children (types);
+	num_syms = g_variant_n_children (syms);
+	if (num_types == 0 || num_types > G_MAXUINT8
+	    || num_syms > G_MAXUINT16
+	    || g_variant_n_children (sym_maps) !=
+	    (gsize) (xkb->max_key_code - xkb->min_key_code + 1))
+		goto out;
+
+	if (XkbAllocClientMap (xkb, XkbKeyTypesMask | XkbKeySymsMask,
+			       num_types) != Success)
+		goto out;
+
+	map = xkb->map;
+	for (i = 0; i < num_types; i++) {
+		GVariant *type = g_variant_get_child_value (types, i);
+		gboolean valid = load_key_type (map->types + i, type);
+
+		g_variant_unref (type);
+		map->num_types++;
+		if (!valid)
+			goto out;
+	}
+
+	free (map->syms);
+	map->syms = calloc (MAX (num_syms, 1), sizeof (KeySym));
+	map->size_syms = map->num_syms = num_syms;
+	for (i = 0; i < num_syms; i++) {
+		guint64 keysym;
+
+		g_variant_get_child (syms, i, "t", &keysym);
+		map->syms[i] = keysym;
+	}
+
+	for (i = 0; i < g_variant_n_children (sym_maps); i++) {
+		XkbSymMapRec *sym_map =
+		    map->key_sym_map + xkb->min_key_code + i;
+		gint g, num_groups;
+
+		g_variant_get_child (sym_maps, i, CACHE_SYM_MAP,
+				     sym_map->kt_index,
+				     sym_map->kt_index + 1,
+				     sym_map->kt_index + 2,
+				     sym_map->kt_index + 3,
+				     &sym_map->group_info, &sym_map->width,
+				     &sym_map->offset);
+
+		num_groups = XkbNumGroups (sym_map->group_info);
+		if (num_groups > XkbNumKbdGroups
+		    || sym_map->offset + sym_map->width * num_groups >
+		    num_syms)
+			goto out;
+		for (g = 0; g < num_groups; g++)
+			if (sym_map->kt_index[g] >= num_types
+			    || map->types[sym_map->kt_index[g]].num_levels >
+			    sym_map->width)
+				goto out;
+	}
+
+	result = TRUE;
+
+      out:
+	g_variant_unref (types);
+	g_variant_unref (sym_maps);
+	g_variant_unref (syms);
+	return result;
+}
+
+XkbDescRec *
+matekbd_keyboard_drawing_cache_load (Display * display,
+				     XkbComponentNamesRec * names)
+{
+	GMappedFile *mapped;
+	GBytes *bytes;
+	GVariant *cache, *atom_names, *geometry, *xkb_names, *map;
+	XkbDescRec *xkb = NULL;
+	LoadState state = { NULL, 0 };
+	const gchar *file_key;
+	char **strings;
+	gchar *key, *path;
+	guint32 version, phys_indicators;
+	guchar min_key_code, max_key_code;
+	guint i;
+
+	key = get_cache_key (display, names);
+	path = get_cache_path (key);
+	mapped = cache_entry_expired (path) ? NULL :
+	    g_mapped_file_new (path, FALSE, NULL);
+	g_free (path);
+	if (mapped == NULL) {
+		g_free (key);
+		return NULL;
+	}
+
+	bytes = g_mapped_file_get_bytes (mapped);
+	g_mapped_file_unref (mapped);
+	cache = g_variant_ref_sink (g_variant_new_from_bytes
+				    (G_VARIANT_TYPE (CACHE_TYPE), bytes,
+				     FALSE));
+	g_bytes_unref (bytes);
+
+	g_variant_get (cache, "(u^&ay@aayyyu@" CACHE_GEOMETRY "@"
+		       CACHE_NAMES "@" CACHE_MAP ")", &version, &file_key,
+		       &atom_names, &min_key_code, &max_key_code,
+		       &phys_indicators, &geometry, &xkb_names, &map);
+
+	/* the name of the file is only a hash of the key */
+	if (version != CACHE_FORMAT_VERSION || strcmp (file_key, key) != 0
+	    || min_key_code < XkbMinLegalKeyCode
+	    || max_key_code < min_key_code
+	    || (phys_indicators & ~INDICATORS_MASK) != 0)
+		goto out;
+
+	state.num_atoms = g_variant_n_children (atom_names);
+	state.atoms = g_new0 (Atom, state.num_atoms + 1);
+	strings = g_new0 (char *, state.num_atoms + 1);
+	for (i = 0; i < state.num_atoms; i++)
+		g_variant_get_child (atom_names, i, "^&ay", strings + i);
+	/* one round trip for all the names */
+	matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS, 1);
+	if (state.num_atoms > 0 &&
+	    !XInternAtoms (display, strings, state.num_atoms, False,
+			   state.atoms)) {
+		g_free (strings);
+		goto out;
+	}
+	g_free (strings);
+
+	xkb = XkbAllocKeyboard ();
+	if (xkb == NULL)
+		goto out;
+	xkb->dpy = display;
+	xkb->min_key_code = min_key_code;
+	xkb->max_key_code = max_key_code;
+
+	if (XkbAllocIndicatorMaps (xkb) != Success
+	    || !load_names (&state, xkb, xkb_names)
+	    || !load_map (xkb, map)
+	    || !load_geometry (&state, xkb, geometry)) {
+		XkbFreeKeyboard (xkb, 0, TRUE);
+		xkb = NULL;
+		goto out;
+	}
+	xkb->indicators->phys_indicators = phys_indicators;
+
+      out:
+	g_free (state.atoms);
+	g_variant_unref (atom_names);
+	g_variant_unref (geometry);
+	g_variant_unref (xkb_names);
+	g_variant_unref (map);
+	g_variant_unref (cache);
+	g_free (key);
+	return xkb;
+}
@@ -0,0 +1,37 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __MATEKBD_KEYBOARD_DRAWING_CACHE_H__
+#define __MATEKBD_KEYBOARD_DRAWING_CACHE_H__
+
+#include <glib.h>
+#include <X11/XKBlib.h>
+
+/**
+ * On-disk cache of the keyboard descriptions compiled by the server
+ * (private).  Only the parts the drawing uses are kept: the geometry,
+ * the key and indicator names, the key types and the key symbols.
+ */
+extern XkbDescRec *matekbd_keyboard_drawing_cache_load (Display * display,
+							XkbComponentNamesRec
+							* names);
+
+extern void matekbd_keyboard_drawing_cache_save (Display * display,
+						 XkbComponentNamesRec *
+						 names, XkbDescRec * xkb);
+
+#endif
@@ -25,12 +25,15 @@
 #include <X11/extensions/XKBgeom.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <locale.h>
 #include <math.h>
 #include <glib/gi18n-lib.h>
 #include <libxklavier/xklavier.h>
 
 #include <matekbd-keyboard-drawing.h>
 #include <matekbd-keyboard-drawing-marshal.h>
+#include <matekbd-keyboard-drawing-cache.h>
+#include <matekbd-counters.h>
 #include <matekbd-util.h>
 
 #define INVALID_KEYCODE ((guint)(-1))
@@ -39,8 +42,37 @@
 
 #define KEY_FONT_SIZE 12
 
+/* label layers kept for recently shown modifier states */
+#define LABEL_SURFACES_MAX 4
+
+/* flushed label layers kept for reuse: each one is as large as the
+ * widget, so all the more only cost memory */
+#define SPARE_SURFACES_MAX 1
+
+/* pixels painted around the bounds of an item: outline strokes and
+ * rounding */
+#define CLIP_MARGIN 6
+
+/* key events traced at once, the oldest ones are dropped */
+#define LATENCY_TRACES_MAX 64
+
+/* frames to wait for the presentation time of a frame before the time it
+ * was painted is taken instead */
+#define LATENCY_FRAMES_MAX 4
+
+/* microseconds the size has to stay the same before the layers are
+ * painted again for it */
+#define RESIZE_SETTLE_TIME 150000
+
+/* microseconds of a frame a progressive redraw paints for */
+#define RENDER_SLICE_TIME 8000
+
+/* bit of an XKB event type in the masks of the events listened for */
+#define XKB_EVENT(type) (1U << (type))
+
 enum {
 	BAD_KEYCODE = 0,
+	KEY_LATENCY,
 	NUM_SIGNALS
 };
 
@@ -255,8 +287,7 @@ rounded_corner (cairo_t * cr,
 
 static void
 rounded_polygon (cairo_t * cr,
-		 gboolean filled,
-		 gdouble radius, GdkPoint * points, gint num_points)
+		 gdouble radius, XkbPointRec * points, gint num_points)
 {
 	gint i, j;
 
@@ -283,53 +314,6 @@ rounded_polygon (cairo_t * cr,
 #endif
 	};
 	cairo_close_path (cr);
-
-	if (filled)
-		cairo_fill (cr);
-	else
-		cairo_stroke (cr);
-}
-
-static void
-draw_polygon (MatekbdKeyboardDrawingRenderContext * context,
-	      GdkRGBA * fill_color,
-	      gint xkb_x,
-	      gint xkb_y, XkbPointRec * xkb_points, guint num_points,
-	      gdouble radius)
-{
-	GdkPoint *points;
-	gboolean filled;
-	gint i;
-
-	if (fill_color) {
-		filled = TRUE;
-	} else {
-		fill_color = &context->dark_color;
-		filled = FALSE;
-	}
-
-	gdk_cairo_set_source_rgba (context->cr, fill_color);
-
-	points = g_new (GdkPoint, num_points);
-
-#ifdef KBDRAW_DEBUG
-	printf ("    Polygon points:\n");
-#endif
-	for (i = 0; i < num_points; i++) {
-		points[i].x =
-		    xkb_to_pixmap_coord (context, xkb_x + xkb_points[i].x);
-		points[i].y =
-		    xkb_to_pixmap_coord (context, xkb_y + xkb_points[i].y);
-#ifdef KBDRAW_DEBUG
-		printf ("      %d, %d\n", points[i].x, points[i].y);
-#endif
-	}
-
-	rounded_polygon (context->cr, filled,
-			 xkb_to_pixmap_double (context, radius),
-			 points, num_points);
-
-	g_free (points);
 }
 
 static void
@@ -361,131 +345,246 @@ curve_rectangle (cairo_t * cr,
 	cairo_close_path (cr);
 }
 
-static void
-draw_curve_rectangle (cairo_t * cr,
-		      gboolean filled,
-		      GdkRGBA * fill_color,
-		      gint x, gint y, gint width, gint height, gint radius)
+/* The outline path is built once, in xkb units relative to the outline
+ * origin and unrotated, and then replayed for every item using it */
+static cairo_path_t *
+build_outline_path (cairo_t * cr, XkbOutlineRec * outline)
 {
-	curve_rectangle (cr, x, y, width, height, radius);
-
-	gdk_cairo_set_source_rgba (cr, fill_color);
-
-	if (filled)
-		cairo_fill (cr);
-	else
-		cairo_stroke (cr);
+	cairo_path_t *path;
+
+	cairo_new_path (cr);
+
+	if (outline->num_points == 1)
+		curve_rectangle (cr, 0, 0, outline->points[0].x,
+				 outline->points[0].y,
+				 outline->corner_radius);
+	else if (outline->num_points == 2)
+		curve_rectangle (cr, outline->points[0].x,
+				 outline->points[0].y,
+				 outline->points[1].x,
+				 outline->points[1].y,
+				 outline->corner_radius);
+	else if (outline->num_points > 2)
+		rounded_polygon (cr, outline->corner_radius,
+				 outline->points, outline->num_points);
+
+	path = cairo_copy_path (cr);
+	cairo_new_path (cr);
+
+	return path;
 }
 
-/* x, y, width, height are in the xkb coordinate system */
+/* all the paths are built with the model, so that rendering never
+ * changes it */
 static void
-draw_rectangle (MatekbdKeyboardDrawingRenderContext * context,
-		GdkRGBA * fill_color,
-		gint angle,
-		gint xkb_x, gint xkb_y, gint xkb_width, gint xkb_height,
-		gint radius)
+init_outline_paths (MatekbdKeyboardDrawingModel * model)
 {
-	if (angle == 0) {
-		gint x, y, width, height;
-		gboolean filled;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	gint i, j;
 
-		if (fill_color) {
-			filled = TRUE;
-		} else {
-			fill_color = &context->dark_color;
-			filled = FALSE;
-		}
+	model->outline_paths =
+	    g_hash_table_new_full (NULL, NULL, NULL,
+				   (GDestroyNotify) cairo_path_destroy);
 
-		x = xkb_to_pixmap_coord (context, xkb_x);
-		y = xkb_to_pixmap_coord (context, xkb_y);
-		width =
-		    xkb_to_pixmap_coord (context, xkb_x + xkb_width) - x;
-		height =
-		    xkb_to_pixmap_coord (context, xkb_y + xkb_height) - y;
-
-		draw_curve_rectangle (context->cr, filled, fill_color,
-				      x, y, width, height,
-				      xkb_to_pixmap_double (context,
-							    radius));
-	} else {
-		XkbPointRec points[4];
-		gint x, y;
+	surface = cairo_image_surface_create (CAIRO_FORMAT_A8, 1, 1);
+	cr = cairo_create (surface);
 
-		points[0].x = xkb_x;
-		points[0].y = xkb_y;
-		rotate_coordinate (xkb_x, xkb_y, xkb_x + xkb_width, xkb_y,
-				   angle, &x, &y);
-		points[1].x = x;
-		points[1].y = y;
-		rotate_coordinate (xkb_x, xkb_y, xkb_x + xkb_width,
-				   xkb_y + xkb_height, angle, &x, &y);
-		points[2].x = x;
-		points[2].y = y;
-		rotate_coordinate (xkb_x, xkb_y, xkb_x, xkb_y + xkb_height,
-				   angle, &x, &y);
-		points[3].x = x;
-		points[3].y = y;
+	for (i = 0; i < model->xkb->geom->num_shapes; i++) {
+		XkbShapeRec *shape = model->xkb->geom->shapes + i;
 
-		/* the points we've calculated are relative to 0,0 */
-		draw_polygon (context, fill_color, 0, 0, points, 4,
-			      radius);
+		for (j = 0; j < shape->num_outlines; j++)
+			g_hash_table_insert (model->outline_paths,
+					     shape->outlines + j,
+					     build_outline_path (cr,
+								 shape->outlines
+								 + j));
 	}
+
+	cairo_destroy (cr);
+	cairo_surface_destroy (surface);
+}
+
+static cairo_path_t *
+get_outline_path (MatekbdKeyboardDrawingModel * model,
+		  XkbOutlineRec * outline)
+{
+	return g_hash_table_lookup (model->outline_paths, outline);
 }
 
 static void
 draw_outline (MatekbdKeyboardDrawingRenderContext * context,
+	      MatekbdKeyboardDrawingModel * model,
 	      XkbOutlineRec * outline,
 	      GdkRGBA * color,
 	      gint angle, gint origin_x, gint origin_y)
 {
+	cairo_t *cr = context->cr;
+	gdouble scale =
+	    (gdouble) context->scale_numerator / context->scale_denominator;
+
 #ifdef KBDRAW_DEBUG
 	printf (" num_points in %p: %d\n", outline, outline->num_points);
 #endif
 
-	if (outline->num_points == 1) {
-		if (color)
-			draw_rectangle (context, color, angle, origin_x,
-					origin_y, outline->points[0].x,
-					outline->points[0].y,
-					outline->corner_radius);
+	cairo_save (cr);
+	cairo_translate (cr, xkb_to_pixmap_double (context, origin_x),
+			 xkb_to_pixmap_double (context, origin_y));
+	cairo_rotate (cr, M_PI * angle / 1800.0);
+	cairo_scale (cr, scale, scale);
+	cairo_new_path (cr);
+	cairo_append_path (cr, get_outline_path (model, outline));
+	/* the path stays in device space, the line width does not scale */
+	cairo_restore (cr);
+
+	if (color) {
+		gdk_cairo_set_source_rgba (cr, color);
+		cairo_fill_preserve (cr);
+	}
 
-#ifdef KBDRAW_DEBUG
-		printf ("pointsxy:%d %d %d\n", outline->points[0].x,
-			outline->points[0].y, outline->corner_radius);
-#endif
+	gdk_cairo_set_source_rgba (cr, &context->palette.outline);
+	cairo_stroke (cr);
+}
 
-		draw_rectangle (context, NULL, angle, origin_x, origin_y,
-				outline->points[0].x,
-				outline->points[0].y,
-				outline->corner_radius);
-	} else if (outline->num_points == 2) {
-		gint rotated_x0, rotated_y0;
-
-		rotate_coordinate (origin_x, origin_y,
-				   origin_x + outline->points[0].x,
-				   origin_y + outline->points[0].y,
-				   angle, &rotated_x0, &rotated_y0);
-		if (color)
-			draw_rectangle (context, color, angle, rotated_x0,
-					rotated_y0, outline->points[1].x,
-					outline->points[1].y,
-					outline->corner_radius);
-
-		draw_rectangle (context, NULL, angle, rotated_x0,
-				rotated_y0, outline->points[1].x,
-				outline->points[1].y,
-				outline->corner_radius);
-	} else {
-		if (color)
-			draw_polygon (context, color, origin_x, origin_y,
-				      outline->points,
-				      outline->num_points,
-				      outline->corner_radius);
+typedef struct {
+	XkbOutlineRec *outline;
+	GdkRGBA color;
+} KeycapKey;
+
+/* a keycap rasterized once, (x, y) being its position relative to the
+ * origin of the key */
+typedef struct {
+	cairo_surface_t *surface;
+	gint x, y;
+	gint width, height;
+} Keycap;
+
+static guint
+keycap_key_hash (const KeycapKey * key)
+{
+	return g_direct_hash (key->outline) ^ gdk_rgba_hash (&key->color);
+}
+
+static gboolean
+keycap_key_equal (const KeycapKey * a, const KeycapKey * b)
+{
+	return a->outline == b->outline
+	    && gdk_rgba_equal (&a->color, &b->color);
+}
+
+static void
+keycap_free (Keycap * keycap)
+{
+	cairo_surface_destroy (keycap->surface);
+	g_free (keycap);
+}
+
+static GHashTable *
+keycaps_new (void)
+{
+	return g_hash_table_new_full ((GHashFunc) keycap_key_hash,
+				      (GEqualFunc) keycap_key_equal,
+				      g_free, (GDestroyNotify) keycap_free);
+}
+
+/* rasterizes the outline the way draw_outline () draws it unrotated */
+static Keycap *
+create_keycap (MatekbdKeyboardDrawingRenderContext * context,
+	       MatekbdKeyboardDrawingModel * model,
+	       XkbOutlineRec * outline, GdkRGBA * color)
+{
+	gdouble scale =
+	    (gdouble) context->scale_numerator / context->scale_denominator;
+	gdouble line_width = cairo_get_line_width (context->cr);
+	gint margin = ceil (line_width / 2) + 1;
+	gint x1, y1, x2, y2;
+	Keycap *keycap;
+	cairo_t *cr;
+	gint i;
+
+	/* the rounded corners stay within the points */
+	x1 = x2 = outline->num_points == 1 ? 0 : outline->points[0].x;
+	y1 = y2 = outline->num_points == 1 ? 0 : outline->points[0].y;
+	for (i = 0; i < outline->num_points; i++) {
+		x1 = MIN (x1, outline->points[i].x);
+		y1 = MIN (y1, outline->points[i].y);
+		x2 = MAX (x2, outline->points[i].x);
+		y2 = MAX (y2, outline->points[i].y);
+	}
+
+	keycap = g_new (Keycap, 1);
+	keycap->x = floor (x1 * scale) - margin;
+	keycap->y = floor (y1 * scale) - margin;
+	keycap->width = ceil (x2 * scale) + margin - keycap->x;
+	keycap->height = ceil (y2 * scale) + margin - keycap->y;
+
+	matekbd_counters_add (MATEKBD_COUNTER_SURFACES_ALLOCATED, 1);
+	keycap->surface =
+	    cairo_surface_create_similar (cairo_get_target (context->cr),
+					  CAIRO_CONTENT_COLOR_ALPHA,
+					  keycap->width, keycap->height);
+	cr = cairo_create (keycap->surface);
+	cairo_set_line_width (cr, line_width);
+
+	cairo_save (cr);
+	cairo_translate (cr, -keycap->x, -keycap->y);
+	cairo_scale (cr, scale, scale);
+	cairo_append_path (cr, get_outline_path (model, outline));
+	cairo_restore (cr);
+
+	gdk_cairo_set_source_rgba (cr, color);
+	cairo_fill_preserve (cr);
+	gdk_cairo_set_source_rgba (cr, &context->palette.outline);
+	cairo_stroke (cr);
+	cairo_destroy (cr);
+
+	return keycap;
+}
+
+/* Draws an unrotated keycap from the ones rasterized before, at a whole
+ * pixel, so that full redraws mostly copy pixels instead of filling
+ * paths.  Returns FALSE when it has to be drawn as a path instead. */
+static gboolean
+draw_keycap (MatekbdKeyboardDrawingRenderContext * context,
+	     MatekbdKeyboardDrawingModel * model,
+	     XkbOutlineRec * outline,
+	     GdkRGBA * color, gint origin_x, gint origin_y)
+{
+	cairo_t *cr = context->cr;
+	cairo_matrix_t matrix;
+	KeycapKey key;
+	Keycap *keycap;
+	gdouble x, y;
+
+	if (context->keycaps == NULL || outline->num_points < 1)
+		return FALSE;
+
+	/* only translations keep the pixels of the keycap as they are */
+	cairo_get_matrix (cr, &matrix);
+	if (matrix.xx != 1 || matrix.yy != 1 || matrix.xy != 0
+	    || matrix.yx != 0)
+		return FALSE;
+
+	key.outline = outline;
+	key.color = *color;
+	keycap = g_hash_table_lookup (context->keycaps, &key);
+	if (keycap == NULL) {
+		KeycapKey *new_key = g_new (KeycapKey, 1);
 
-		draw_polygon (context, NULL, origin_x, origin_y,
-			      outline->points, outline->num_points,
-			      outline->corner_radius);
+		*new_key = key;
+		keycap = create_keycap (context, model, outline, color);
+		g_hash_table_insert (context->keycaps, new_key, keycap);
 	}
+
+	x = round (xkb_to_pixmap_double (context, origin_x) + matrix.x0) -
+	    matrix.x0 + keycap->x;
+	y = round (xkb_to_pixmap_double (context, origin_y) + matrix.y0) -
+	    matrix.y0 + keycap->y;
+	cairo_set_source_surface (cr, keycap->surface, x, y);
+	cairo_rectangle (cr, x, y, keycap->width, keycap->height);
+	cairo_fill (cr);
+
+	return TRUE;
 }
 
 /* see PSColorDef in xkbprint */
@@ -547,530 +646,423 @@ parse_xkb_color_spec (gchar * colorspec, GdkRGBA * color)
 	return TRUE;
 }
 
-static guint
-find_keycode (MatekbdKeyboardDrawing * drawing, gchar * key_name)
+/* key names are up to XkbKeyNameLength chars, not necessarily
+ * NUL-terminated, so they fit in 32 bits */
+static guint32
+pack_key_name (const gchar * name)
 {
-#define KEYSYM_NAME_MAX_LENGTH 4
-	guint keycode;
-	gint i, j;
-	XkbKeyNamePtr pkey;
-	XkbKeyAliasPtr palias;
-	guint is_name_matched;
-	gchar *src, *dst;
-
-	if (!drawing->xkb)
-		return INVALID_KEYCODE;
-
-#ifdef KBDRAW_DEBUG
-	printf ("    looking for keycode for (%c%c%c%c)\n",
-		key_name[0], key_name[1], key_name[2], key_name[3]);
-#endif
-
-	pkey = drawing->xkb->names->keys + drawing->xkb->min_key_code;
-	for (keycode = drawing->xkb->min_key_code;
-	     keycode <= drawing->xkb->max_key_code; keycode++) {
-		is_name_matched = 1;
-		src = key_name;
-		dst = pkey->name;
-		for (i = KEYSYM_NAME_MAX_LENGTH; --i >= 0;) {
-			if ('\0' == *src)
-				break;
-			if (*src++ != *dst++) {
-				is_name_matched = 0;
-				break;
-			}
-		}
-		if (is_name_matched) {
-#ifdef KBDRAW_DEBUG
-			printf ("      found keycode %u\n", keycode);
-#endif
-			return keycode;
-		}
-		pkey++;
-	}
-
-	palias = drawing->xkb->names->key_aliases;
-	for (j = drawing->xkb->names->num_key_aliases; --j >= 0;) {
-		is_name_matched = 1;
-		src = key_name;
-		dst = palias->alias;
-		for (i = KEYSYM_NAME_MAX_LENGTH; --i >= 0;) {
-			if ('\0' == *src)
-				break;
-			if (*src++ != *dst++) {
-				is_name_matched = 0;
-				break;
-			}
-		}
+	guint32 packed = 0;
+	gint i;
 
-		if (is_name_matched) {
-			keycode = find_keycode (drawing, palias->real);
-#ifdef KBDRAW_DEBUG
-			printf ("found alias keycode %u\n", keycode);
-#endif
-			return keycode;
-		}
-		palias++;
-	}
+	for (i = 0; i < XkbKeyNameLength && name[i] != '\0'; i++)
+		packed |= (guint32) (guchar) name[i] << (8 * i);
 
-	return INVALID_KEYCODE;
+	return packed;
 }
 
-static void
-set_markup (MatekbdKeyboardDrawingRenderContext * context, gchar *txt)
+static guint
+resolve_key_alias (MatekbdKeyboardDrawingModel * model,
+		   const gchar * real, gint depth)
 {
-	PangoLayout *layout = context->layout;
-	txt = strcmp ("<", txt) ? txt : "&lt;";
-	txt = strcmp ("&", txt) ? txt : "&amp;";
-	if (g_utf8_strlen (txt, -1) > 1) {
-		gchar* buf =
-		    g_strdup_printf ("<span size=\"xx-small\">%s</span>", txt);
-		pango_layout_set_markup (layout, buf, -1);
-		g_free (buf);
-	} else {
-		pango_layout_set_markup (layout, txt, -1);
-	}
+	XkbNamesRec *names = model->xkb->names;
+	guint32 packed = pack_key_name (real);
+	gpointer value;
+	gint j;
+
+	if (g_hash_table_lookup_extended (model->keycode_index,
+					  GUINT_TO_POINTER (packed), NULL,
+					  &value))
+		return GPOINTER_TO_UINT (value);
+
+	/* the alias may point to another alias */
+	if (depth > 0)
+		for (j = 0; j < names->num_key_aliases; j++)
+			if (pack_key_name (names->key_aliases[j].alias) ==
+			    packed)
+				return resolve_key_alias (model,
+							  names->key_aliases
+							  [j].real,
+							  depth - 1);
+
+	return INVALID_KEYCODE;
 }
 
+/* name -> keycode hash, with all the aliases resolved once */
 static void
-set_key_label_in_layout (MatekbdKeyboardDrawingRenderContext * context,
-			 guint keyval)
+init_keycode_index (MatekbdKeyboardDrawingModel * model)
 {
-	gchar buf[5];
-	gunichar uc;
-
-	switch (keyval) {
-	case GDK_KEY_Scroll_Lock:
-		set_markup (context, _("Scroll\nLock"));
-		break;
-
-	case GDK_KEY_space:
-		set_markup (context, "");
-		break;
-
-	case GDK_KEY_Sys_Req:
-		set_markup (context, _("Sys Rq"));
-		break;
+	XkbNamesRec *names;
+	guint keycode;
+	gint j;
 
-	case GDK_KEY_Page_Up:
-		set_markup (context, _("Page\nUp"));
-		break;
+	model->keycode_index = g_hash_table_new (NULL, NULL);
 
-	case GDK_KEY_Page_Down:
-		set_markup (context, _("Page\nDown"));
-		break;
+	if (!model->xkb || !model->xkb->names
+	    || !model->xkb->names->keys)
+		return;
 
-	case GDK_KEY_Num_Lock:
-		set_markup (context, _("Num\nLock"));
-		break;
+	names = model->xkb->names;
 
-	case GDK_KEY_KP_Page_Up:
-		set_markup (context, _("Pg Up"));
-		break;
+	/* the first keycode with a given name wins */
+	for (keycode = model->xkb->min_key_code;
+	     keycode <= model->xkb->max_key_code; keycode++) {
+		guint32 packed = pack_key_name (names->keys[keycode].name);
 
-	case GDK_KEY_KP_Page_Down:
-		set_markup (context, _("Pg Dn"));
-		break;
+		if (packed != 0
+		    && !g_hash_table_contains (model->keycode_index,
+					       GUINT_TO_POINTER (packed)))
+			g_hash_table_insert (model->keycode_index,
+					     GUINT_TO_POINTER (packed),
+					     GUINT_TO_POINTER (keycode));
+	}
 
-	case GDK_KEY_KP_Home:
-		set_markup (context, _("Home"));
-		break;
+	/* real key names take precedence over aliases */
+	for (j = 0; j < names->num_key_aliases; j++) {
+		XkbKeyAliasRec *alias = names->key_aliases + j;
+		guint32 packed = pack_key_name (alias->alias);
 
-	case GDK_KEY_KP_Left:
-		set_markup (context, _("Left"));
-		break;
+		if (packed == 0
+		    || g_hash_table_contains (model->keycode_index,
+					      GUINT_TO_POINTER (packed)))
+			continue;
 
-	case GDK_KEY_KP_End:
-		set_markup (context, _("End"));
-		break;
+		keycode = resolve_key_alias (model, alias->real, 4);
+		if (keycode != INVALID_KEYCODE)
+			g_hash_table_insert (model->keycode_index,
+					     GUINT_TO_POINTER (packed),
+					     GUINT_TO_POINTER (keycode));
+	}
+}
 
-	case GDK_KEY_KP_Up:
-		set_markup (context, _("Up"));
-		break;
+static guint
+find_keycode (MatekbdKeyboardDrawingModel * model, gchar * key_name)
+{
+	gpointer value;
 
-	case GDK_KEY_KP_Begin:
-		set_markup (context, _("Begin"));
-		break;
+	if (!model->xkb || !model->keycode_index)
+		return INVALID_KEYCODE;
 
-	case GDK_KEY_KP_Right:
-		set_markup (context, _("Right"));
-		break;
+#ifdef KBDRAW_DEBUG
+	printf ("    looking for keycode for (%c%c%c%c)\n",
+		key_name[0], key_name[1], key_name[2], key_name[3]);
+#endif
 
-	case GDK_KEY_KP_Enter:
-		set_markup (context, _("Enter"));
-		break;
+	if (g_hash_table_lookup_extended (model->keycode_index,
+					  GUINT_TO_POINTER (pack_key_name
+							    (key_name)),
+					  NULL, &value)) {
+#ifdef KBDRAW_DEBUG
+		printf ("      found keycode %u\n",
+			GPOINTER_TO_UINT (value));
+#endif
+		return GPOINTER_TO_UINT (value);
+	}
 
-	case GDK_KEY_KP_Down:
-		set_markup (context, _("Down"));
-		break;
+	return INVALID_KEYCODE;
+}
 
-	case GDK_KEY_KP_Insert:
-		set_markup (context, _("Ins"));
-		break;
+#define KEY_LABEL_SMALL_MARKUP "<span size=\"xx-small\">%s</span>"
+
+/* labels of keys which are not just the unicode character of the keysym;
+ * N_() marks the ones translated once per locale */
+static const struct {
+	guint keysym;
+	const gchar *label;
+	gboolean translatable;
+} key_labels[] = {
+	{GDK_KEY_Scroll_Lock, N_("Scroll\nLock"), TRUE},
+	{GDK_KEY_space, "", FALSE},
+	{GDK_KEY_Sys_Req, N_("Sys Rq"), TRUE},
+	{GDK_KEY_Page_Up, N_("Page\nUp"), TRUE},
+	{GDK_KEY_Page_Down, N_("Page\nDown"), TRUE},
+	{GDK_KEY_Num_Lock, N_("Num\nLock"), TRUE},
+	{GDK_KEY_KP_Page_Up, N_("Pg Up"), TRUE},
+	{GDK_KEY_KP_Page_Down, N_("Pg Dn"), TRUE},
+	{GDK_KEY_KP_Home, N_("Home"), TRUE},
+	{GDK_KEY_KP_Left, N_("Left"), TRUE},
+	{GDK_KEY_KP_End, N_("End"), TRUE},
+	{GDK_KEY_KP_Up, N_("Up"), TRUE},
+	{GDK_KEY_KP_Begin, N_("Begin"), TRUE},
+	{GDK_KEY_KP_Right, N_("Right"), TRUE},
+	{GDK_KEY_KP_Enter, N_("Enter"), TRUE},
+	{GDK_KEY_KP_Down, N_("Down"), TRUE},
+	{GDK_KEY_KP_Insert, N_("Ins"), TRUE},
+	{GDK_KEY_KP_Delete, N_("Del"), TRUE},
+	{GDK_KEY_ISO_Level3_Shift, N_("ISO_Level3_Shift"), TRUE},
+	{GDK_KEY_ISO_Left_Tab, N_("Tab"), TRUE},
+	{GDK_KEY_BackSpace, N_("BackSpace"), TRUE},
+	{GDK_KEY_Tab, N_("Tab"), TRUE},
+	{GDK_KEY_Return, N_("Return"), TRUE},
+	{GDK_KEY_Pause, N_("Pause"), TRUE},
+	{GDK_KEY_Escape, N_("Esc"), TRUE},
+	{GDK_KEY_Home, N_("Home"), TRUE},
+	{GDK_KEY_Left, N_("Left"), TRUE},
+	{GDK_KEY_Up, N_("Up"), TRUE},
+	{GDK_KEY_Right, N_("Right"), TRUE},
+	{GDK_KEY_Down, N_("Down"), TRUE},
+	{GDK_KEY_End, N_("End"), TRUE},
+	{GDK_KEY_Print, N_("Print"), TRUE},
+	{GDK_KEY_Insert, N_("Insert"), TRUE},
+	{GDK_KEY_Menu, N_("Menu"), TRUE},
+	{GDK_KEY_F1, N_("F1"), TRUE},
+	{GDK_KEY_F2, N_("F2"), TRUE},
+	{GDK_KEY_F3, N_("F3"), TRUE},
+	{GDK_KEY_F4, N_("F4"), TRUE},
+	{GDK_KEY_F5, N_("F5"), TRUE},
+	{GDK_KEY_F6, N_("F6"), TRUE},
+	{GDK_KEY_F7, N_("F7"), TRUE},
+	{GDK_KEY_F8, N_("F8"), TRUE},
+	{GDK_KEY_F9, N_("F9"), TRUE},
+	{GDK_KEY_F10, N_("F10"), TRUE},
+	{GDK_KEY_F11, N_("F11"), TRUE},
+	{GDK_KEY_F12, N_("F12"), TRUE},
+	{GDK_KEY_Shift_L, N_("Shift"), TRUE},
+	{GDK_KEY_Shift_R, N_("Shift"), TRUE},
+	{GDK_KEY_Control_L, N_("Control"), TRUE},
+	{GDK_KEY_Control_R, N_("Control"), TRUE},
+	{GDK_KEY_Caps_Lock, N_("Caps\nLock"), TRUE},
+	{GDK_KEY_Meta_L, N_("Meta"), TRUE},
+	{GDK_KEY_Alt_L, N_("Alt"), TRUE},
+	{GDK_KEY_Super_L, N_("Super"), TRUE},
+	{GDK_KEY_Super_R, N_("Super"), TRUE},
+	{GDK_KEY_VoidSymbol, N_("Delete"), TRUE},
+	{GDK_KEY_dead_grave, "ˋ", FALSE},
+	{GDK_KEY_dead_acute, "ˊ", FALSE},
+	{GDK_KEY_dead_circumflex, "ˆ", FALSE},
+	{GDK_KEY_dead_tilde, "~", FALSE},
+	{GDK_KEY_dead_macron, "ˉ", FALSE},
+	{GDK_KEY_dead_breve, "˘", FALSE},
+	{GDK_KEY_dead_abovedot, "˙", FALSE},
+	{GDK_KEY_dead_diaeresis, "¨", FALSE},
+	{GDK_KEY_dead_abovering, "˚", FALSE},
+	{GDK_KEY_dead_doubleacute, "˝", FALSE},
+	{GDK_KEY_dead_caron, "ˇ", FALSE},
+	{GDK_KEY_dead_cedilla, "¸", FALSE},
+	{GDK_KEY_dead_ogonek, "˛", FALSE},
+	{GDK_KEY_dead_iota, "ͺ", FALSE},
+	{GDK_KEY_dead_voiced_sound, "゛", FALSE},
+	{GDK_KEY_dead_semivoiced_sound, "゜", FALSE},
+	{GDK_KEY_dead_belowdot, " ̣", FALSE},
+	{GDK_KEY_horizconnector, N_("horiz\nconn"), TRUE},
+	{GDK_KEY_Mode_switch, N_("AltGr"), TRUE},
+	{GDK_KEY_Multi_key, N_("Compose"), TRUE},
+};
 
-	case GDK_KEY_KP_Delete:
-		set_markup (context, _("Del"));
-		break;
+/* keysym -> interned label markup, for the locale in label_markups_locale;
+ * models may be rendered from several threads, hence the lock */
+static GHashTable *label_markups = NULL;
+static gchar *label_markups_locale = NULL;
+G_LOCK_DEFINE_STATIC (label_markups);
 
-	/* 0xfe03 */
-	case GDK_KEY_ISO_Level3_Shift:
-		set_markup (context, _("ISO_Level3_Shift"));
-		break;
+static gchar *
+label_markup_new (const gchar * txt)
+{
+	gchar *escaped, *markup;
 
-	/* 0xfe20 */
-	case GDK_KEY_ISO_Left_Tab:
-		set_markup (context, _("Tab"));
-		break;
+	escaped = g_markup_escape_text (txt, -1);
+	if (g_utf8_strlen (txt, -1) <= 1)
+		return escaped;
 
-	/* 0xff08 */
-	case GDK_KEY_BackSpace:
-		set_markup (context, _("BackSpace"));
-		break;
+	markup = g_strdup_printf (KEY_LABEL_SMALL_MARKUP, escaped);
+	g_free (escaped);
+	return markup;
+}
 
-	/* 0xff09 */
-	case GDK_KEY_Tab:
-		set_markup (context, _("Tab"));
-		break;
+static const gchar *
+label_markup_intern (const gchar * txt)
+{
+	gchar *markup = label_markup_new (txt);
+	const gchar *interned = g_intern_string (markup);
 
-	/* 0xff0d */
-	case GDK_KEY_Return:
-		set_markup (context, _("Return"));
-		break;
+	g_free (markup);
+	return interned;
+}
 
-	/* 0xff13 */
-	case GDK_KEY_Pause:
-		set_markup (context, _("Pause"));
-		break;
+static void
+init_label_markups (const gchar * locale)
+{
+	gint i;
 
-	/* 0xff1b */
-	case GDK_KEY_Escape:
-		set_markup (context, _("Esc"));
-		break;
+	if (label_markups != NULL)
+		g_hash_table_destroy (label_markups);
+	g_free (label_markups_locale);
+
+	label_markups = g_hash_table_new (NULL, NULL);
+	label_markups_locale = g_strdup (locale);
+
+	for (i = 0; i < G_N_ELEMENTS (key_labels); i++)
+		g_hash_table_insert (label_markups,
+				     GUINT_TO_POINTER (key_labels[i].keysym),
+				     (gpointer)
+				     label_markup_intern (key_labels
+							  [i].translatable ?
+							  _(key_labels
+							    [i].label) :
+							  key_labels[i].label));
+}
 
-	/* 0xff50 */
-	case GDK_KEY_Home:
-		set_markup (context, _("Home"));
-		break;
+/* Returns the pango markup to show for the keysym.  The table is built
+ * once per locale; other keysyms are resolved on first use and kept. */
+static const gchar *
+get_keysym_markup (guint keyval)
+{
+	const gchar *locale = setlocale (LC_MESSAGES, NULL);
+	const gchar *markup;
+	gchar buf[7];
+	gunichar uc;
 
-	/* 0xff51 */
-	case GDK_KEY_Left:
-		set_markup (context, _("Left"));
-		break;
+	G_LOCK (label_markups);
 
-	/* 0xff52 */
-	case GDK_KEY_Up:
-		set_markup (context, _("Up"));
-		break;
+	if (label_markups == NULL
+	    || g_strcmp0 (locale, label_markups_locale) != 0)
+		init_label_markups (locale);
 
-	/* 0xff53 */
-	case GDK_KEY_Right:
-		set_markup (context, _("Right"));
-		break;
+	markup = g_hash_table_lookup (label_markups,
+				      GUINT_TO_POINTER (keyval));
+	if (markup != NULL) {
+		G_UNLOCK (label_markups);
+		return markup;
+	}
 
-	/* 0xff54 */
-	case GDK_KEY_Down:
-		set_markup (context, _("Down"));
-		break;
+	uc = gdk_keyval_to_unicode (keyval);
+	if (uc != 0 && g_unichar_isgraph (uc)) {
+		buf[g_unichar_to_utf8 (uc, buf)] = '\0';
+		markup = label_markup_intern (buf);
+	} else {
+		gchar *name = gdk_keyval_name (keyval);
+		markup = label_markup_intern (name ? name : "");
+	}
 
-	/* 0xff57 */
-	case GDK_KEY_End:
-		set_markup (context, _("End"));
-		break;
+	g_hash_table_insert (label_markups, GUINT_TO_POINTER (keyval),
+			     (gpointer) markup);
+	G_UNLOCK (label_markups);
+	return markup;
+}
 
-	/* 0xff61 */
-	case GDK_KEY_Print:
-		set_markup (context, _("Print"));
-		break;
+static void
+set_markup (PangoLayout * layout, const gchar * txt)
+{
+	gchar *markup = label_markup_new (txt);
 
-	/* 0xff63 */
-	case GDK_KEY_Insert:
-		set_markup (context, _("Insert"));
-		break;
+	matekbd_counters_add (MATEKBD_COUNTER_LABELS_SHAPED, 1);
+	pango_layout_set_markup (layout, markup, -1);
+	g_free (markup);
+}
 
-	/* 0xff67 */
-	case GDK_KEY_Menu:
-		set_markup (context, _("Menu"));
-		break;
+typedef struct {
+	KeySym keysym;
+	gint width;
+	gint font_size;
+} LabelLayoutKey;
 
-	/* 0xffbe */
-	case GDK_KEY_F1:
-		set_markup (context, _("F1"));
-		break;
+static guint
+label_layout_key_hash (const LabelLayoutKey * key)
+{
+	return key->keysym ^ (key->width * 31) ^ (key->font_size * 131);
+}
 
-	/* 0xffbf */
-	case GDK_KEY_F2:
-		set_markup (context, _("F2"));
-		break;
+static gboolean
+label_layout_key_equal (const LabelLayoutKey * a, const LabelLayoutKey * b)
+{
+	return a->keysym == b->keysym && a->width == b->width
+	    && a->font_size == b->font_size;
+}
 
-	/* 0xffc0 */
-	case GDK_KEY_F3:
-		set_markup (context, _("F3"));
-		break;
+static GHashTable *
+label_layouts_new (void)
+{
+	return g_hash_table_new_full ((GHashFunc) label_layout_key_hash,
+				      (GEqualFunc) label_layout_key_equal,
+				      g_free, g_object_unref);
+}
 
-	/* 0xffc1 */
-	case GDK_KEY_F4:
-		set_markup (context, _("F4"));
-		break;
+/* Returns a shaped layout for the label of the keysym.  The layouts are
+ * cached per keysym, width and font size, so every label is only shaped
+ * once; the rotation is applied when the layout is drawn. */
+static PangoLayout *
+get_label_layout (MatekbdKeyboardDrawingRenderContext * context,
+		  KeySym keysym, gint width)
+{
+	LabelLayoutKey key, *new_key;
+	PangoLayout *layout;
+
+	if (context->label_layouts == NULL) {
+		matekbd_counters_add (MATEKBD_COUNTER_LABELS_SHAPED, 1);
+		pango_layout_set_markup (context->layout,
+					 get_keysym_markup (keysym), -1);
+		pango_layout_set_width (context->layout, width);
+		return context->layout;
+	}
 
-	/* 0xffc2 */
-	case GDK_KEY_F5:
-		set_markup (context, _("F5"));
-		break;
+	key.keysym = keysym;
+	key.width = width;
+	key.font_size = pango_font_description_get_size (context->font_desc);
 
-	/* 0xffc3 */
-	case GDK_KEY_F6:
-		set_markup (context, _("F6"));
-		break;
+	layout = g_hash_table_lookup (context->label_layouts, &key);
+	if (layout != NULL)
+		return layout;
 
-	/* 0xffc4 */
-	case GDK_KEY_F7:
-		set_markup (context, _("F7"));
-		break;
+	layout = pango_layout_new (pango_layout_get_context (context->layout));
+	pango_layout_set_font_description (layout, context->font_desc);
+	pango_layout_set_spacing (layout,
+				  pango_layout_get_spacing (context->layout));
+	pango_layout_set_ellipsize (layout, PANGO_ELLIPSIZE_END);
+	matekbd_counters_add (MATEKBD_COUNTER_LABELS_SHAPED, 1);
+	pango_layout_set_markup (layout, get_keysym_markup (keysym), -1);
+	pango_layout_set_width (layout, width);
 
-	/* 0xffc5 */
-	case GDK_KEY_F8:
-		set_markup (context, _("F8"));
-		break;
+	new_key = g_new (LabelLayoutKey, 1);
+	*new_key = key;
+	g_hash_table_insert (context->label_layouts, new_key, layout);
 
-	/* 0xffc6 */
-	case GDK_KEY_F9:
-		set_markup (context, _("F9"));
-		break;
+	return layout;
+}
 
-	/* 0xffc7 */
-	case GDK_KEY_F10:
-		set_markup (context, _("F10"));
-		break;
+static void
+draw_pango_layout (MatekbdKeyboardDrawingRenderContext * context,
+		   MatekbdKeyboardDrawingModel * model,
+		   PangoLayout * layout, gint angle, gint x, gint y)
+{
+	GdkRGBA *color;
 
-	/* 0xffc8 */
-	case GDK_KEY_F11:
-		set_markup (context, _("F11"));
-		break;
+	color =
+	    model->colors + (model->xkb->geom->label_color -
+			       model->xkb->geom->colors);
 
-	/* 0xffc9 */
-	case GDK_KEY_F12:
-		set_markup (context, _("F12"));
-		break;
+	cairo_save (context->cr);
+	cairo_translate (context->cr, x, y);
+	cairo_rotate (context->cr, M_PI * angle / 1800.0);
+	cairo_move_to (context->cr, 0, 0);
+	gdk_cairo_set_source_rgba (context->cr, color);
+	pango_cairo_show_layout (context->cr, layout);
+	cairo_restore (context->cr);
+}
 
-	/* 0xffe1 */
-	case GDK_KEY_Shift_L:
-		set_markup (context, _("Shift"));
-		break;
+static void
+draw_key_label_helper (MatekbdKeyboardDrawingRenderContext * context,
+		       MatekbdKeyboardDrawingModel * model,
+		       KeySym keysym,
+		       gint angle,
+		       MatekbdKeyboardDrawingGroupLevelPosition glp,
+		       gint x,
+		       gint y, gint width, gint height, gint padding)
+{
+	gint label_x, label_y, label_max_width, ycell;
+	PangoLayout *layout;
 
-	/* 0xffe2 */
-	case GDK_KEY_Shift_R:
-		set_markup (context, _("Shift"));
-		break;
+	if (keysym == 0)
+		return;
+#ifdef KBDRAW_DEBUG
+	printf ("keysym: %04X(%c) at glp: %d\n",
+		(unsigned) keysym, (char) keysym, (int) glp);
+#endif
 
-	/* 0xffe3 */
-	case GDK_KEY_Control_L:
-		set_markup (context, _("Control"));
-		break;
-
-	/* 0xffe4 */
-	case GDK_KEY_Control_R:
-		set_markup (context, _("Control"));
-		break;
-
-	/* 0xffe5 */
-	case GDK_KEY_Caps_Lock:
-		set_markup (context, _("Caps\nLock"));
-		break;
-
-	/* 0xffe7 */
-	case GDK_KEY_Meta_L:
-		set_markup (context, _("Meta"));
-		break;
-
-	/* 0xffe9 */
-	case GDK_KEY_Alt_L:
-		set_markup (context, _("Alt"));
-		break;
-
-	/* 0xffeb */
-	case GDK_KEY_Super_L:
-		set_markup (context, _("Super"));
-		break;
-
-	/* 0xffec */
-	case GDK_KEY_Super_R:
-		set_markup (context, _("Super"));
-		break;
-
-	/* 0xffff */
-	case GDK_KEY_VoidSymbol:
-		set_markup (context, _("Delete"));
-		break;
-
-	case GDK_KEY_dead_grave:
-		set_markup (context, "ˋ");
-		break;
-
-	case GDK_KEY_dead_acute:
-		set_markup (context, "ˊ");
-		break;
-
-	case GDK_KEY_dead_circumflex:
-		set_markup (context, "ˆ");
-		break;
-
-	case GDK_KEY_dead_tilde:
-		set_markup (context, "~");
-		break;
-
-	case GDK_KEY_dead_macron:
-		set_markup (context, "ˉ");
-		break;
-
-	case GDK_KEY_dead_breve:
-		set_markup (context, "˘");
-		break;
-
-	case GDK_KEY_dead_abovedot:
-		set_markup (context, "˙");
-		break;
-
-	case GDK_KEY_dead_diaeresis:
-		set_markup (context, "¨");
-		break;
-
-	case GDK_KEY_dead_abovering:
-		set_markup (context, "˚");
-		break;
-
-	case GDK_KEY_dead_doubleacute:
-		set_markup (context, "˝");
-		break;
-
-	case GDK_KEY_dead_caron:
-		set_markup (context, "ˇ");
-		break;
-
-	case GDK_KEY_dead_cedilla:
-		set_markup (context, "¸");
-		break;
-
-	case GDK_KEY_dead_ogonek:
-		set_markup (context, "˛");
-		break;
-
-		/* case GDK_KEY_dead_iota:
-		 * case GDK_KEY_dead_voiced_sound:
-		 * case GDK_KEY_dead_semivoiced_sound: */
-
-	case GDK_KEY_dead_belowdot:
-		set_markup (context, " ̣");
-		break;
-
-	case GDK_KEY_horizconnector:
-		set_markup (context, _("horiz\nconn"));
-		break;
-
-	case GDK_KEY_Mode_switch:
-		set_markup (context, _("AltGr"));
-		break;
-
-	case GDK_KEY_Multi_key:
-		set_markup (context, _("Compose"));
-		break;
-
-	default:
-		uc = gdk_keyval_to_unicode (keyval);
-		if (uc != 0 && g_unichar_isgraph (uc)) {
-			buf[g_unichar_to_utf8 (uc, buf)] = '\0';
-			set_markup (context, buf);
-		} else {
-			gchar *name = gdk_keyval_name (keyval);
-			if (name) {
-				set_markup (context, name);
-			} else
-				set_markup (context, "");
-		}
-	}
-}
-
-static void
-draw_pango_layout (MatekbdKeyboardDrawingRenderContext * context,
-		   MatekbdKeyboardDrawing * drawing,
-		   gint angle, gint x, gint y)
-{
-	PangoLayout *layout = context->layout;
-	GdkRGBA *color;
-	PangoLayoutLine *line;
-	gint x_off, y_off;
-	gint i;
-
-	color =
-	    drawing->colors + (drawing->xkb->geom->label_color -
-			       drawing->xkb->geom->colors);
-
-	if (angle != context->angle) {
-		PangoMatrix matrix = PANGO_MATRIX_INIT;
-		pango_matrix_rotate (&matrix, -angle / 10.0);
-		pango_context_set_matrix (pango_layout_get_context
-					  (layout), &matrix);
-		pango_layout_context_changed (layout);
-		context->angle = angle;
-	}
-
-	i = 0;
-	y_off = 0;
-	for (line = pango_layout_get_line (layout, i);
-	     line != NULL; line = pango_layout_get_line (layout, ++i)) {
-		GSList *runp;
-		PangoRectangle line_extents;
-
-		x_off = 0;
-
-		for (runp = line->runs; runp != NULL; runp = runp->next) {
-			PangoGlyphItem *run = runp->data;
-			gint j;
-
-			for (j = 0; j < run->glyphs->num_glyphs; j++) {
-				PangoGlyphGeometry *geometry;
-
-				geometry =
-				    &run->glyphs->glyphs[j].geometry;
-
-				x_off += geometry->width;
-			}
-		}
-
-		pango_layout_line_get_extents (line, NULL, &line_extents);
-		y_off +=
-		    line_extents.height +
-		    pango_layout_get_spacing (layout);
-	}
-
-	cairo_move_to (context->cr, x, y);
-	gdk_cairo_set_source_rgba (context->cr, color);
-	pango_cairo_show_layout (context->cr, layout);
-}
-
-static void
-draw_key_label_helper (MatekbdKeyboardDrawingRenderContext * context,
-		       MatekbdKeyboardDrawing * drawing,
-		       KeySym keysym,
-		       gint angle,
-		       MatekbdKeyboardDrawingGroupLevelPosition glp,
-		       gint x,
-		       gint y, gint width, gint height, gint padding)
-{
-	gint label_x, label_y, label_max_width, ycell;
-
-	if (keysym == 0)
-		return;
-#ifdef KBDRAW_DEBUG
-	printf ("keysym: %04X(%c) at glp: %d\n",
-		(unsigned) keysym, (char) keysym, (int) glp);
-#endif
-
-	switch (glp) {
-	case MATEKBD_KEYBOARD_DRAWING_POS_TOPLEFT:
-	case MATEKBD_KEYBOARD_DRAWING_POS_BOTTOMLEFT:
-		{
-			ycell =
-			    glp == MATEKBD_KEYBOARD_DRAWING_POS_BOTTOMLEFT;
+	switch (glp) {
+	case MATEKBD_KEYBOARD_DRAWING_POS_TOPLEFT:
+	case MATEKBD_KEYBOARD_DRAWING_POS_BOTTOMLEFT:
+		{
+			ycell =
+			    glp == MATEKBD_KEYBOARD_DRAWING_POS_BOTTOMLEFT;
 
 			rotate_coordinate (x, y, x + padding,
 					   y + padding + (height -
@@ -1103,90 +1095,59 @@ draw_key_label_helper (MatekbdKeyboardDrawingRenderContext * context,
 	default:
 		return;
 	}
-	set_key_label_in_layout (context, keysym);
-	pango_layout_set_width (context->layout, label_max_width);
-	label_y -= (pango_layout_get_line_count (context->layout) - 1) *
+	layout = get_label_layout (context, keysym, label_max_width);
+	label_y -= (pango_layout_get_line_count (layout) - 1) *
 	    (pango_font_description_get_size (context->font_desc) /
 	     PANGO_SCALE);
 	cairo_save (context->cr);
 	cairo_rectangle (context->cr, x + padding / 2, y + padding / 2,
 			 width - padding, height - padding);
 	cairo_clip (context->cr);
-	draw_pango_layout (context, drawing, angle, label_x, label_y);
+	draw_pango_layout (context, model, layout, angle, label_x,
+			   label_y);
 	cairo_restore (context->cr);
 }
 
-static void
-draw_key_label (MatekbdKeyboardDrawingRenderContext * context,
-		MatekbdKeyboardDrawing * drawing,
-		guint keycode,
-		gint angle,
-		gint xkb_origin_x,
-		gint xkb_origin_y, gint xkb_width, gint xkb_height)
+/* returns the keysym shown at the given group/level position for the
+ * given modifiers, or 0 if nothing should be shown there */
+static KeySym
+get_key_glp_keysym (MatekbdKeyboardDrawingRenderContext * context,
+		    MatekbdKeyboardDrawingModel * model,
+		    guint keycode,
+		    MatekbdKeyboardDrawingGroupLevelPosition glp, guint mods)
 {
-	gint x, y, width, height;
-	gint padding;
-	gint g, l, glp;
-
-	if (!drawing->xkb)
-		return;
-
-	padding = 23 * context->scale_numerator / context->scale_denominator;	/* 2.3mm */
-
-	x = xkb_to_pixmap_coord (context, xkb_origin_x);
-	y = xkb_to_pixmap_coord (context, xkb_origin_y);
-	width =
-	    xkb_to_pixmap_coord (context, xkb_origin_x + xkb_width) - x;
-	height =
-	    xkb_to_pixmap_coord (context, xkb_origin_y + xkb_height) - y;
-
-	for (glp = MATEKBD_KEYBOARD_DRAWING_POS_TOPLEFT;
-	     glp < MATEKBD_KEYBOARD_DRAWING_POS_TOTAL; glp++) {
-		if (drawing->groupLevels[glp] == NULL)
-			continue;
-		g = drawing->groupLevels[glp]->group;
-		l = drawing->groupLevels[glp]->level;
+	gint g, l;
 
-		if (g < 0 || g >= XkbKeyNumGroups (drawing->xkb, keycode))
-			continue;
-		if (l < 0
-		    || l >= XkbKeyGroupWidth (drawing->xkb, keycode, g))
-			continue;
+	if (context->groupLevels == NULL || context->groupLevels[glp] == NULL)
+		return 0;
+	g = context->groupLevels[glp]->group;
+	l = context->groupLevels[glp]->level;
 
-		/* Skip "exotic" levels like the "Ctrl" level in PC_SYSREQ */
-		if (l > 0) {
-			guint mods = XkbKeyKeyType (drawing->xkb, keycode,
-						    g)->mods.mask;
-			if ((mods & (ShiftMask | drawing->l3mod)) == 0)
-				continue;
-		}
+	if (g < 0 || g >= XkbKeyNumGroups (model->xkb, keycode))
+		return 0;
+	if (l < 0 || l >= XkbKeyGroupWidth (model->xkb, keycode, g))
+		return 0;
 
-		if (drawing->track_modifiers) {
-			guint mods_rtrn;
-			KeySym keysym;
-
-			if (XkbTranslateKeyCode (drawing->xkb, keycode,
-						 XkbBuildCoreState
-						 (drawing->mods, g),
-						 &mods_rtrn, &keysym)) {
-				draw_key_label_helper (context, drawing,
-						       keysym, angle, glp,
-						       x, y, width, height,
-						       padding);
-				/* reverse y order */
-			}
-		} else {
-			KeySym keysym;
+	/* Skip "exotic" levels like the "Ctrl" level in PC_SYSREQ */
+	if (l > 0) {
+		guint type_mods = XkbKeyKeyType (model->xkb, keycode,
+						 g)->mods.mask;
+		if ((type_mods & (ShiftMask | model->l3mod)) == 0)
+			return 0;
+	}
 
-			keysym =
-			    XkbKeySymEntry (drawing->xkb, keycode, l, g);
+	if (context->track_modifiers) {
+		guint mods_rtrn;
+		KeySym keysym;
 
-			draw_key_label_helper (context, drawing, keysym,
-					       angle, glp, x, y, width,
-					       height, padding);
-			/* reverse y order */
-		}
+		if (XkbTranslateKeyCode (model->xkb, keycode,
+					 XkbBuildCoreState (mods, g),
+					 &mods_rtrn, &keysym))
+			return keysym;
+		return 0;
 	}
+
+	return XkbKeySymEntry (model->xkb, keycode, l, g);
 }
 
 /*
@@ -1214,39 +1175,99 @@ calc_origin_offset_x (XkbOutlineRec * outline)
 	return rv;
 }
 
-/* groups are from 0-3 */
+/* the unrotated box, in pixels, the labels of the key are laid out in;
+ * they are clipped to the box shrunk by half of the padding */
 static void
-draw_key (MatekbdKeyboardDrawingRenderContext * context,
-	  MatekbdKeyboardDrawing * drawing, MatekbdKeyboardDrawingKey * key)
+get_key_label_box (MatekbdKeyboardDrawingRenderContext * context,
+		   MatekbdKeyboardDrawingModel * model,
+		   MatekbdKeyboardDrawingKey * key,
+		   GdkRectangle * box, gint * padding)
+{
+	XkbShapeRec *shape;
+	XkbOutlineRec *outline;
+	gint xkb_origin_x;
+
+	shape = model->xkb->geom->shapes + key->xkbkey->shape_ndx;
+	outline = shape->primary ? shape->primary : shape->outlines;
+	xkb_origin_x = key->origin_x + calc_origin_offset_x (outline);
+
+	*padding = 23 * context->scale_numerator / context->scale_denominator;	/* 2.3mm */
+
+	box->x = xkb_to_pixmap_coord (context, xkb_origin_x);
+	box->y = xkb_to_pixmap_coord (context, key->origin_y);
+	box->width =
+	    xkb_to_pixmap_coord (context,
+				 xkb_origin_x + shape->bounds.x2) - box->x;
+	box->height =
+	    xkb_to_pixmap_coord (context,
+				 key->origin_y + shape->bounds.y2) - box->y;
+}
+
+static void
+get_key_label_clip (MatekbdKeyboardDrawingRenderContext * context,
+		    MatekbdKeyboardDrawingModel * model,
+		    MatekbdKeyboardDrawingKey * key, GdkRectangle * clip)
+{
+	gint padding;
+
+	get_key_label_box (context, model, key, clip, &padding);
+	clip->x += padding / 2;
+	clip->y += padding / 2;
+	clip->width -= padding;
+	clip->height -= padding;
+}
+
+static void
+draw_key_label (MatekbdKeyboardDrawingRenderContext * context,
+		MatekbdKeyboardDrawingModel * model,
+		MatekbdKeyboardDrawingKey * key)
+{
+	GdkRectangle box;
+	gint padding;
+	gint glp;
+
+	if (!model->xkb)
+		return;
+
+	get_key_label_box (context, model, key, &box, &padding);
+
+	for (glp = MATEKBD_KEYBOARD_DRAWING_POS_TOPLEFT;
+	     glp < MATEKBD_KEYBOARD_DRAWING_POS_TOTAL; glp++) {
+		KeySym keysym = get_key_glp_keysym (context, model,
+						    key->keycode, glp,
+						    context->mods);
+
+		draw_key_label_helper (context, model, keysym, key->angle,
+				       glp, box.x, box.y, box.width,
+				       box.height, padding);
+	}
+}
+
+static void
+draw_key_shape (MatekbdKeyboardDrawingRenderContext * context,
+		MatekbdKeyboardDrawingModel * model,
+		MatekbdKeyboardDrawingKey * key, gboolean pressed)
 {
 	XkbShapeRec *shape;
-	GtkStyleContext *style_context;
 	GdkRGBA color;
 	XkbOutlineRec *outline;
-	int origin_offset_x;
 	/* gint i; */
 
-	if (!drawing->xkb)
+	if (!model->xkb)
 		return;
 
 #ifdef KBDRAW_DEBUG
 	printf ("shape: %p (base %p, index %d)\n",
-		drawing->xkb->geom->shapes + key->xkbkey->shape_ndx,
-		drawing->xkb->geom->shapes, key->xkbkey->shape_ndx);
+		model->xkb->geom->shapes + key->xkbkey->shape_ndx,
+		model->xkb->geom->shapes, key->xkbkey->shape_ndx);
 #endif
 
-	shape = drawing->xkb->geom->shapes + key->xkbkey->shape_ndx;
+	shape = model->xkb->geom->shapes + key->xkbkey->shape_ndx;
 
-	if (key->pressed) {
-		style_context = gtk_widget_get_style_context (GTK_WIDGET (drawing));
-		gtk_style_context_save (style_context);
-		gtk_style_context_add_class (style_context, GTK_STYLE_CLASS_VIEW);
-		gtk_style_context_get_background_color (style_context,
-		                                        GTK_STATE_FLAG_SELECTED,
-		                                        &color);
-		gtk_style_context_restore (style_context);
-	 } else
-		color = *(drawing->colors + key->xkbkey->color_ndx);
+	if (pressed)
+		color = context->palette.pressed;
+	else
+		color = *(model->colors + key->xkbkey->color_ndx);
 
 #ifdef KBDRAW_DEBUG
 	printf
@@ -1255,10 +1276,13 @@ draw_key (MatekbdKeyboardDrawingRenderContext * context,
 	     key->origin_y, key->angle);
 #endif
 
-	/* draw the primary outline */
+	/* draw the primary outline, rotated ones as paths */
 	outline = shape->primary ? shape->primary : shape->outlines;
-	draw_outline (context, outline, &color, key->angle, key->origin_x,
-		      key->origin_y);
+	if (key->angle != 0
+	    || !draw_keycap (context, model, outline, &color,
+			     key->origin_x, key->origin_y))
+		draw_outline (context, model, outline, &color, key->angle,
+			      key->origin_x, key->origin_y);
 #if 0
 	/* don't draw other outlines for now, since
 	 * the text placement does not take them into account
@@ -1267,109 +1291,363 @@ draw_key (MatekbdKeyboardDrawingRenderContext * context,
 		if (shape->outlines + i == shape->approx ||
 		    shape->outlines + i == shape->primary)
 			continue;
-		draw_outline (context, shape->outlines + i, NULL,
+		draw_outline (context, model, shape->outlines + i, NULL,
 			      key->angle, key->origin_x, key->origin_y);
 	}
 #endif
+}
 
-	origin_offset_x = calc_origin_offset_x (outline);
-	draw_key_label (context, drawing, key->keycode, key->angle,
-			key->origin_x + origin_offset_x, key->origin_y,
-			shape->bounds.x2, shape->bounds.y2);
+/* groups are from 0-3 */
+static void
+draw_key (MatekbdKeyboardDrawingRenderContext * context,
+	  MatekbdKeyboardDrawingModel * model, MatekbdKeyboardDrawingKey * key)
+{
+	draw_key_shape (context, model, key,
+			context->pressed_keys != NULL
+			&& context->pressed_keys[key->keycode]);
+	draw_key_label (context, model, key);
 }
 
+/* bounding box, in xkb units, of the box x1,y1-x2,y2 placed at
+ * origin_x,origin_y and rotated around it */
 static void
-invalidate_region (MatekbdKeyboardDrawing * drawing,
-		   gdouble angle,
-		   gint origin_x, gint origin_y, XkbShapeRec * shape)
+get_rotated_bounds (gint angle, gint origin_x, gint origin_y,
+		    gint x1, gint y1, gint x2, gint y2, GdkRectangle * rect)
 {
-	GdkPoint points[4];
+	gint xs[4], ys[4];
 	gint x_min, x_max, y_min, y_max;
-	gint x, y, width, height;
-	gint xx, yy;
-
-	rotate_coordinate (0, 0, 0, 0, angle, &xx, &yy);
-	points[0].x = xx;
-	points[0].y = yy;
-	rotate_coordinate (0, 0, shape->bounds.x2, 0, angle, &xx, &yy);
-	points[1].x = xx;
-	points[1].y = yy;
-	rotate_coordinate (0, 0, shape->bounds.x2, shape->bounds.y2, angle,
-			   &xx, &yy);
-	points[2].x = xx;
-	points[2].y = yy;
-	rotate_coordinate (0, 0, 0, shape->bounds.y2, angle, &xx, &yy);
-	points[3].x = xx;
-	points[3].y = yy;
-
-	x_min =
-	    MIN (MIN (points[0].x, points[1].x),
-		 MIN (points[2].x, points[3].x));
-	x_max =
-	    MAX (MAX (points[0].x, points[1].x),
-		 MAX (points[2].x, points[3].x));
-	y_min =
-	    MIN (MIN (points[0].y, points[1].y),
-		 MIN (points[2].y, points[3].y));
-	y_max =
-	    MAX (MAX (points[0].y, points[1].y),
-		 MAX (points[2].y, points[3].y));
-
-	x = xkb_to_pixmap_coord (drawing->renderContext,
-				 origin_x + x_min) - 6;
-	y = xkb_to_pixmap_coord (drawing->renderContext,
-				 origin_y + y_min) - 6;
-	width =
+	gint i;
+
+	rotate_coordinate (0, 0, x1, y1, angle, xs + 0, ys + 0);
+	rotate_coordinate (0, 0, x2, y1, angle, xs + 1, ys + 1);
+	rotate_coordinate (0, 0, x2, y2, angle, xs + 2, ys + 2);
+	rotate_coordinate (0, 0, x1, y2, angle, xs + 3, ys + 3);
+
+	x_min = x_max = xs[0];
+	y_min = y_max = ys[0];
+	for (i = 1; i < 4; i++) {
+		x_min = MIN (x_min, xs[i]);
+		x_max = MAX (x_max, xs[i]);
+		y_min = MIN (y_min, ys[i]);
+		y_max = MAX (y_max, ys[i]);
+	}
+
+	rect->x = origin_x + x_min;
+	rect->y = origin_y + y_min;
+	rect->width = x_max - x_min;
+	rect->height = y_max - y_min;
+}
+
+static void
+get_shape_bounds (gint angle, gint origin_x, gint origin_y,
+		  XkbShapeRec * shape, GdkRectangle * rect)
+{
+	get_rotated_bounds (angle, origin_x, origin_y,
+			    shape->bounds.x1, shape->bounds.y1,
+			    shape->bounds.x2, shape->bounds.y2, rect);
+}
+
+static void
+get_doodad_bounds (MatekbdKeyboardDrawingModel * model,
+		   MatekbdKeyboardDrawingDoodad * doodad,
+		   GdkRectangle * rect)
+{
+	XkbDoodadRec *xkbdoodad = doodad->doodad;
+
+	switch (xkbdoodad->any.type) {
+	case XkbOutlineDoodad:
+	case XkbSolidDoodad:
+	case XkbLogoDoodad:
+		get_shape_bounds (doodad->angle,
+				  doodad->origin_x + xkbdoodad->shape.left,
+				  doodad->origin_y + xkbdoodad->shape.top,
+				  model->xkb->geom->shapes +
+				  xkbdoodad->shape.shape_ndx, rect);
+		break;
+
+	case XkbIndicatorDoodad:
+		get_shape_bounds (doodad->angle,
+				  doodad->origin_x + xkbdoodad->indicator.left,
+				  doodad->origin_y + xkbdoodad->indicator.top,
+				  model->xkb->geom->shapes +
+				  xkbdoodad->indicator.shape_ndx, rect);
+		break;
+
+	case XkbTextDoodad:
+		get_rotated_bounds (doodad->angle,
+				    doodad->origin_x + xkbdoodad->text.left,
+				    doodad->origin_y + xkbdoodad->text.top,
+				    0, 0, xkbdoodad->text.width,
+				    xkbdoodad->text.height, rect);
+		break;
+
+	default:
+		rect->x = rect->y = rect->width = rect->height = 0;
+		break;
+	}
+}
+
+static void
+get_key_bounds (MatekbdKeyboardDrawingModel * model,
+		MatekbdKeyboardDrawingKey * key, GdkRectangle * rect)
+{
+	XkbShapeRec *shape =
+	    model->xkb->geom->shapes + key->xkbkey->shape_ndx;
+	XkbOutlineRec *outline =
+	    shape->primary ? shape->primary : shape->outlines;
+	GdkRectangle label_box;
+
+	get_shape_bounds (key->angle, key->origin_x, key->origin_y, shape,
+			  rect);
+
+	/* the labels are laid out unrotated, see get_key_label_box () */
+	label_box.x = key->origin_x + calc_origin_offset_x (outline);
+	label_box.y = key->origin_y;
+	label_box.width = shape->bounds.x2;
+	label_box.height = shape->bounds.y2;
+	gdk_rectangle_union (rect, &label_box, rect);
+}
+
+/* the range of grid cells, clamped to the grid, rect (in xkb units)
+ * falls into */
+static void
+get_grid_cells (MatekbdKeyboardDrawingModel * model, GdkRectangle * rect,
+		GdkRectangle * cells)
+{
+	gint x1, y1, x2, y2;
+
+	x1 = (rect->x - model->grid_area.x) / model->grid_cell_size;
+	y1 = (rect->y - model->grid_area.y) / model->grid_cell_size;
+	x2 = (rect->x + rect->width -
+	      model->grid_area.x) / model->grid_cell_size;
+	y2 = (rect->y + rect->height -
+	      model->grid_area.y) / model->grid_cell_size;
+
+	cells->x = CLAMP (x1, 0, model->grid_cols - 1);
+	cells->y = CLAMP (y1, 0, model->grid_rows - 1);
+	cells->width = CLAMP (x2, 0, model->grid_cols - 1) - cells->x + 1;
+	cells->height = CLAMP (y2, 0, model->grid_rows - 1) - cells->y + 1;
+}
+
+/* Every item is filed under all the cells of a uniform grid its bounds
+ * touch, so that "what is drawn here" only looks at nearby items.  The
+ * cells are stored back to back: the items of cell c are
+ * grid_items[grid_cells[c]] .. grid_items[grid_cells[c + 1] - 1] */
+static void
+init_item_index (MatekbdKeyboardDrawingModel * model)
+{
+	GdkRectangle *bounds;
+	gint64 size_sum = 0;
+	guint i, n, total;
+	guint c;
+	gint col, row;
+
+	model->item_bounds = g_new (GdkRectangle, model->num_items);
+	if (model->num_items == 0)
+		return;
+
+	for (i = 0; i < model->num_items; i++) {
+		MatekbdKeyboardDrawingItemSlot *slot = model->items + i;
+
+		bounds = model->item_bounds + i;
+		if (slot->item.type == MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_DOODAD)
+			get_doodad_bounds (model, &slot->doodad, bounds);
+		else
+			get_key_bounds (model, &slot->key, bounds);
+
+		if (i == 0)
+			model->grid_area = *bounds;
+		else
+			gdk_rectangle_union (&model->grid_area, bounds,
+					     &model->grid_area);
+		size_sum += MAX (bounds->width, bounds->height);
+	}
+
+	/* cells about the size of an average item */
+	model->grid_cell_size = MAX (1, size_sum / model->num_items);
+	model->grid_cols =
+	    model->grid_area.width / model->grid_cell_size + 1;
+	model->grid_rows =
+	    model->grid_area.height / model->grid_cell_size + 1;
+	n = model->grid_cols * model->grid_rows;
+
+	/* count the items per cell, then turn the counts into offsets */
+	model->grid_cells = g_new0 (guint, n + 1);
+	for (i = 0; i < model->num_items; i++) {
+		GdkRectangle cells;
+
+		get_grid_cells (model, model->item_bounds + i, &cells);
+		for (row = cells.y; row < cells.y + cells.height; row++)
+			for (col = cells.x; col < cells.x + cells.width; col++)
+				model->grid_cells[row * model->grid_cols +
+						    col + 1]++;
+	}
+	for (c = 0; c < n; c++)
+		model->grid_cells[c + 1] += model->grid_cells[c];
+	total = model->grid_cells[n];
+
+	model->grid_items = g_new (guint, MAX (total, 1));
+	for (i = 0; i < model->num_items; i++) {
+		GdkRectangle cells;
+
+		get_grid_cells (model, model->item_bounds + i, &cells);
+		for (row = cells.y; row < cells.y + cells.height; row++)
+			for (col = cells.x; col < cells.x + cells.width; col++)
+				model->grid_items[model->grid_cells
+						    [row * model->grid_cols +
+						     col]++] = i;
+	}
+	/* filling moved every offset to the start of the next cell */
+	for (c = n; c > 0; c--)
+		model->grid_cells[c] = model->grid_cells[c - 1];
+	model->grid_cells[0] = 0;
+
+#ifdef KBDRAW_DEBUG
+	printf ("item index: %u items, %dx%d cells of %d, %u entries\n",
+		model->num_items, model->grid_cols, model->grid_rows,
+		model->grid_cell_size, total);
+#endif
+}
+
+static void
+free_item_index (MatekbdKeyboardDrawingModel * model)
+{
+	g_free (model->item_bounds);
+	model->item_bounds = NULL;
+	g_free (model->grid_cells);
+	model->grid_cells = NULL;
+	g_free (model->grid_items);
+	model->grid_items = NULL;
+	model->grid_cols = model->grid_rows = 0;
+}
+
+static gint
+compare_item_indices (gconstpointer a, gconstpointer b)
+{
+	guint ia = *(const guint *) a;
+	guint ib = *(const guint *) b;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+/* appends to result the indices of the items whose bounds intersect rect
+ * (in xkb units), in drawing order */
+static void
+find_items (MatekbdKeyboardDrawingModel * model, GdkRectangle * rect,
+	    GArray * result)
+{
+	GdkRectangle cells;
+	guint first = result->len;
+	guint i, j;
+	gint col, row;
+
+	if (model->grid_cells == NULL)
+		return;
+
+	get_grid_cells (model, rect, &cells);
+	for (row = cells.y; row < cells.y + cells.height; row++)
+		for (col = cells.x; col < cells.x + cells.width; col++) {
+			gint c = row * model->grid_cols + col;
+
+			for (i = model->grid_cells[c];
+			     i < model->grid_cells[c + 1]; i++) {
+				guint item = model->grid_items[i];
+
+				if (gdk_rectangle_intersect
+				    (model->item_bounds + item, rect, NULL))
+					g_array_append_val (result, item);
+			}
+		}
+
+	/* an item spanning several cells is found once per cell */
+	g_qsort_with_data (&g_array_index (result, guint, first),
+			   result->len - first, sizeof (guint),
+			   (GCompareDataFunc) compare_item_indices, NULL);
+	for (i = j = first; i < result->len; i++)
+		if (j == first ||
+		    g_array_index (result, guint, i) !=
+		    g_array_index (result, guint, j - 1))
+			g_array_index (result, guint, j++) =
+			    g_array_index (result, guint, i);
+	g_array_set_size (result, j);
+}
+
+static guint
+get_item_index (MatekbdKeyboardDrawingModel * model,
+		MatekbdKeyboardDrawingItem * item)
+{
+	return (MatekbdKeyboardDrawingItemSlot *) item - model->items;
+}
+
+/* the pixels the item may paint on */
+static gboolean
+get_item_region (MatekbdKeyboardDrawing * drawing,
+		 MatekbdKeyboardDrawingItem * item, GdkRectangle * rect)
+{
+	GdkRectangle *bounds;
+
+	if (!drawing->model || drawing->model->item_bounds == NULL)
+		return FALSE;
+
+	bounds = drawing->model->item_bounds + get_item_index (drawing->model, item);
+
+	rect->x = xkb_to_pixmap_coord (drawing->renderContext,
+				       bounds->x) - CLIP_MARGIN;
+	rect->y = xkb_to_pixmap_coord (drawing->renderContext,
+				       bounds->y) - CLIP_MARGIN;
+	rect->width =
 	    xkb_to_pixmap_coord (drawing->renderContext,
-				 x_max - x_min) + 12;
-	height =
+				 bounds->width) + 2 * CLIP_MARGIN;
+	rect->height =
 	    xkb_to_pixmap_coord (drawing->renderContext,
-				 y_max - y_min) + 12;
+				 bounds->height) + 2 * CLIP_MARGIN;
+
+	return TRUE;
+}
+
+static void
+invalidate_item_region (MatekbdKeyboardDrawing * drawing,
+			MatekbdKeyboardDrawingItem * item)
+{
+	GdkRectangle rect;
 
-	gtk_widget_queue_draw_area (GTK_WIDGET (drawing), x, y, width,
-				    height);
+	if (get_item_region (drawing, item, &rect))
+		gtk_widget_queue_draw_area (GTK_WIDGET (drawing), rect.x,
+					    rect.y, rect.width, rect.height);
 }
 
+/* the item changed its look: its part of the keycap layer gets repainted
+ * before the next draw */
 static void
-invalidate_indicator_doodad_region (MatekbdKeyboardDrawing * drawing,
-				    MatekbdKeyboardDrawingDoodad * doodad)
+damage_item_region (MatekbdKeyboardDrawing * drawing,
+		    MatekbdKeyboardDrawingItem * item)
 {
-	if (!drawing->xkb)
+	GdkRectangle rect;
+
+	if (!get_item_region (drawing, item, &rect))
 		return;
 
-	invalidate_region (drawing,
-			   doodad->angle,
-			   doodad->origin_x +
-			   doodad->doodad->indicator.left,
-			   doodad->origin_y +
-			   doodad->doodad->indicator.top,
-			   &drawing->xkb->geom->shapes[doodad->
-						       doodad->indicator.shape_ndx]);
+	if (drawing->surface != NULL)
+		cairo_region_union_rectangle (drawing->damage, &rect);
+	gtk_widget_queue_draw_area (GTK_WIDGET (drawing), rect.x, rect.y,
+				    rect.width, rect.height);
 }
 
 static void
 invalidate_key_region (MatekbdKeyboardDrawing * drawing,
 		       MatekbdKeyboardDrawingKey * key)
 {
-	if (!drawing->xkb)
-		return;
-
-	invalidate_region (drawing,
-			   key->angle,
-			   key->origin_x,
-			   key->origin_y,
-			   &drawing->xkb->geom->shapes[key->
-						       xkbkey->shape_ndx]);
+	invalidate_item_region (drawing, (MatekbdKeyboardDrawingItem *) key);
 }
 
 static void
 draw_text_doodad (MatekbdKeyboardDrawingRenderContext * context,
-		  MatekbdKeyboardDrawing * drawing,
+		  MatekbdKeyboardDrawingModel * model,
 		  MatekbdKeyboardDrawingDoodad * doodad,
 		  XkbTextDoodadRec * text_doodad)
 {
 	gint x, y;
-	if (!drawing->xkb)
+	if (!model->xkb)
 		return;
 
 	x = xkb_to_pixmap_coord (context,
@@ -1377,13 +1655,14 @@ draw_text_doodad (MatekbdKeyboardDrawingRenderContext * context,
 	y = xkb_to_pixmap_coord (context,
 				 doodad->origin_y + text_doodad->top);
 
-	set_markup (context, text_doodad->text);
-	draw_pango_layout (context, drawing, doodad->angle, x, y);
+	set_markup (context->layout, text_doodad->text);
+	draw_pango_layout (context, model, context->layout, doodad->angle,
+			   x, y);
 }
 
 static void
 draw_indicator_doodad (MatekbdKeyboardDrawingRenderContext * context,
-		       MatekbdKeyboardDrawing * drawing,
+		       MatekbdKeyboardDrawingModel * model,
 		       MatekbdKeyboardDrawingDoodad * doodad,
 		       XkbIndicatorDoodadRec * indicator_doodad)
 {
@@ -1391,17 +1670,17 @@ draw_indicator_doodad (MatekbdKeyboardDrawingRenderContext * context,
 	XkbShapeRec *shape;
 	gint i;
 
-	if (!drawing->xkb)
+	if (!model->xkb)
 		return;
 
-	shape = drawing->xkb->geom->shapes + indicator_doodad->shape_ndx;
+	shape = model->xkb->geom->shapes + indicator_doodad->shape_ndx;
 
-	color = drawing->colors + (doodad->on ?
+	color = model->colors + (doodad->on ?
 				   indicator_doodad->on_color_ndx :
 				   indicator_doodad->off_color_ndx);
 
 	for (i = 0; i < 1; i++)
-		draw_outline (context, shape->outlines + i, color,
+		draw_outline (context, model, shape->outlines + i, color,
 			      doodad->angle,
 			      doodad->origin_x + indicator_doodad->left,
 			      doodad->origin_y + indicator_doodad->top);
@@ -1409,7 +1688,7 @@ draw_indicator_doodad (MatekbdKeyboardDrawingRenderContext * context,
 
 static void
 draw_shape_doodad (MatekbdKeyboardDrawingRenderContext * context,
-		   MatekbdKeyboardDrawing * drawing,
+		   MatekbdKeyboardDrawingModel * model,
 		   MatekbdKeyboardDrawingDoodad * doodad,
 		   XkbShapeDoodadRec * shape_doodad)
 {
@@ -1417,14 +1696,14 @@ draw_shape_doodad (MatekbdKeyboardDrawingRenderContext * context,
 	GdkRGBA *color;
 	gint i;
 
-	if (!drawing->xkb)
+	if (!model->xkb)
 		return;
 
-	shape = drawing->xkb->geom->shapes + shape_doodad->shape_ndx;
-	color = drawing->colors + shape_doodad->color_ndx;
+	shape = model->xkb->geom->shapes + shape_doodad->shape_ndx;
+	color = model->colors + shape_doodad->color_ndx;
 
 	/* draw the primary outline filled */
-	draw_outline (context,
+	draw_outline (context, model,
 		      shape->primary ? shape->primary : shape->outlines,
 		      color, doodad->angle,
 		      doodad->origin_x + shape_doodad->left,
@@ -1435,7 +1714,7 @@ draw_shape_doodad (MatekbdKeyboardDrawingRenderContext * context,
 		if (shape->outlines + i == shape->approx ||
 		    shape->outlines + i == shape->primary)
 			continue;
-		draw_outline (context, shape->outlines + i, NULL,
+		draw_outline (context, model, shape->outlines + i, NULL,
 			      doodad->angle,
 			      doodad->origin_x + shape_doodad->left,
 			      doodad->origin_y + shape_doodad->top);
@@ -1444,70 +1723,113 @@ draw_shape_doodad (MatekbdKeyboardDrawingRenderContext * context,
 
 static void
 draw_doodad (MatekbdKeyboardDrawingRenderContext * context,
-	     MatekbdKeyboardDrawing * drawing,
+	     MatekbdKeyboardDrawingModel * model,
 	     MatekbdKeyboardDrawingDoodad * doodad)
 {
 	switch (doodad->doodad->any.type) {
 	case XkbOutlineDoodad:
 	case XkbSolidDoodad:
-		draw_shape_doodad (context, drawing, doodad,
+		draw_shape_doodad (context, model, doodad,
 				   &doodad->doodad->shape);
 		break;
 
 	case XkbTextDoodad:
-		draw_text_doodad (context, drawing, doodad,
+		draw_text_doodad (context, model, doodad,
 				  &doodad->doodad->text);
 		break;
 
 	case XkbIndicatorDoodad:
-		draw_indicator_doodad (context, drawing, doodad,
+		draw_indicator_doodad (context, model, doodad,
 				       &doodad->doodad->indicator);
 		break;
 
 	case XkbLogoDoodad:
 		/* g_print ("draw_doodad: logo: %s\n", doodad->doodad->logo.logo_name); */
 		/* XkbLogoDoodadRec is essentially a subclass of XkbShapeDoodadRec */
-		draw_shape_doodad (context, drawing, doodad,
+		draw_shape_doodad (context, model, doodad,
 				   &doodad->doodad->shape);
 		break;
 	}
 }
 
-typedef struct {
-	MatekbdKeyboardDrawing *drawing;
-	MatekbdKeyboardDrawingRenderContext *context;
-} DrawKeyboardItemData;
+/* the clip of the context in xkb units, widened by the outline stroke;
+ * FALSE when nothing at all is visible */
+static gboolean
+get_clip_bounds (MatekbdKeyboardDrawingRenderContext * context,
+		 GdkRectangle * rect)
+{
+	gdouble x1, y1, x2, y2;
+	gdouble scale =
+	    (gdouble) context->scale_denominator / context->scale_numerator;
+
+	cairo_clip_extents (context->cr, &x1, &y1, &x2, &y2);
+	if (x1 >= x2 || y1 >= y2)
+		return FALSE;
+
+	/* an unbounded clip would overflow gint below */
+	x1 = MAX (x1 - CLIP_MARGIN, -G_MAXINT / 4 / scale);
+	y1 = MAX (y1 - CLIP_MARGIN, -G_MAXINT / 4 / scale);
+	x2 = MIN (x2 + CLIP_MARGIN, G_MAXINT / 4 / scale);
+	y2 = MIN (y2 + CLIP_MARGIN, G_MAXINT / 4 / scale);
+
+	rect->x = floor (x1 * scale);
+	rect->y = floor (y1 * scale);
+	rect->width = ceil (x2 * scale) - rect->x;
+	rect->height = ceil (y2 * scale) - rect->y;
 
+	return TRUE;
+}
+
+/* the widget keeps the keycaps (with the doodads) and the key labels on
+ * separate surfaces; pressed keys are painted over the keycaps in draw () */
+typedef enum {
+	DRAW_LAYER_SHAPES = 1 << 0,
+	DRAW_LAYER_LABELS = 1 << 1,
+	DRAW_LAYER_ALL = DRAW_LAYER_SHAPES | DRAW_LAYER_LABELS
+} DrawLayers;
+
+typedef struct {
+	MatekbdKeyboardDrawingModel *model;
+	MatekbdKeyboardDrawingRenderContext *context;
+	DrawLayers layers;
+} DrawKeyboardItemData;
+
+/* draws the doodads painted over the given item */
 static void
 redraw_overlapping_doodads (MatekbdKeyboardDrawingRenderContext * context,
-			    MatekbdKeyboardDrawing * drawing,
-			    MatekbdKeyboardDrawingKey * key)
+			    MatekbdKeyboardDrawingModel * model,
+			    MatekbdKeyboardDrawingItem * item)
 {
-	GList *list;
-	gboolean do_draw = FALSE;
+	guint index = get_item_index (model, item);
+	GArray *found;
+	guint i;
+
+	if (model->item_bounds == NULL)
+		return;
 
-	for (list = drawing->keyboard_items; list; list = list->next) {
-		MatekbdKeyboardDrawingItem *item = list->data;
+	found = g_array_new (FALSE, FALSE, sizeof (guint));
+	find_items (model, model->item_bounds + index, found);
 
-		if (do_draw
-		    && item->type ==
-		    MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_DOODAD)
-			draw_doodad (context, drawing,
-				     (MatekbdKeyboardDrawingDoodad *) item);
+	for (i = 0; i < found->len; i++) {
+		MatekbdKeyboardDrawingItemSlot *slot =
+		    model->items + g_array_index (found, guint, i);
 
-		if (list->data == key)
-			do_draw = TRUE;
+		if (slot - model->items > index &&
+		    slot->item.type == MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_DOODAD)
+			draw_doodad (context, model, &slot->doodad);
 	}
+
+	g_array_free (found, TRUE);
 }
 
 static void
 draw_keyboard_item (MatekbdKeyboardDrawingItem * item,
 		    DrawKeyboardItemData * data)
 {
-	MatekbdKeyboardDrawing *drawing = data->drawing;
+	MatekbdKeyboardDrawingModel *model = data->model;
 	MatekbdKeyboardDrawingRenderContext *context = data->context;
 
-	if (!drawing->xkb)
+	if (!model->xkb)
 		return;
 
 	switch (item->type) {
@@ -1516,44 +1838,94 @@ draw_keyboard_item (MatekbdKeyboardDrawingItem * item,
 
 	case MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY:
 	case MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY_EXTRA:
-		draw_key (context, drawing,
-			  (MatekbdKeyboardDrawingKey *) item);
+		if (data->layers == DRAW_LAYER_ALL)
+			draw_key (context, model,
+				  (MatekbdKeyboardDrawingKey *) item);
+		else if (data->layers & DRAW_LAYER_SHAPES)
+			draw_key_shape (context, model,
+					(MatekbdKeyboardDrawingKey *) item,
+					FALSE);
+		else
+			draw_key_label (context, model,
+					(MatekbdKeyboardDrawingKey *) item);
 		break;
 
 	case MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_DOODAD:
-		draw_doodad (context, drawing,
-			     (MatekbdKeyboardDrawingDoodad *) item);
+		if (data->layers & DRAW_LAYER_SHAPES)
+			draw_doodad (context, model,
+				     (MatekbdKeyboardDrawingDoodad *) item);
 		break;
 	}
 }
 
 static void
-draw_keyboard_to_context (MatekbdKeyboardDrawingRenderContext * context,
-			  MatekbdKeyboardDrawing * drawing)
+draw_keyboard_layers_to_context (MatekbdKeyboardDrawingRenderContext *
+				 context, MatekbdKeyboardDrawingModel * model,
+				 DrawLayers layers)
 {
-	DrawKeyboardItemData data = { drawing, context };
+	DrawKeyboardItemData data = { model, context, layers };
+	GdkRectangle clip, all;
+	GArray *found;
+	guint i;
 #ifdef KBDRAW_DEBUG
-	printf ("mods: %d\n", drawing->mods);
+	printf ("mods: %d, layers: %d\n", context->mods, layers);
 #endif
-	g_list_foreach (drawing->keyboard_items,
-			(GFunc) draw_keyboard_item, &data);
+	/* nothing to cull when the whole keyboard is visible */
+	if (model->item_bounds == NULL
+	    || !get_clip_bounds (context, &clip)
+	    || (gdk_rectangle_intersect (&clip, &model->grid_area, &all)
+		&& gdk_rectangle_equal (&all, &model->grid_area))) {
+		for (i = 0; i < model->num_items; i++)
+			draw_keyboard_item (&model->items[i].item, &data);
+		return;
+	}
+
+	found = g_array_new (FALSE, FALSE, sizeof (guint));
+	find_items (model, &clip, found);
+#ifdef KBDRAW_DEBUG
+	printf ("clip %d,%d %dx%d: %u of %u items\n", clip.x, clip.y,
+		clip.width, clip.height, found->len, model->num_items);
+#endif
+	for (i = 0; i < found->len; i++)
+		draw_keyboard_item (&model->items
+				    [g_array_index (found, guint, i)].item,
+				    &data);
+	g_array_free (found, TRUE);
 }
 
+/* paints the layers of the items from *item on until the deadline,
+ * returns whether all of them are painted */
 static gboolean
-create_cairo (MatekbdKeyboardDrawing * drawing)
+draw_keyboard_layers_slice (MatekbdKeyboardDrawingRenderContext * context,
+			    MatekbdKeyboardDrawingModel * model,
+			    DrawLayers layers, guint * item, gint64 deadline)
+{
+	DrawKeyboardItemData data = { model, context, layers };
+
+	while (*item < model->num_items) {
+		draw_keyboard_item (&model->items[(*item)++].item, &data);
+		if (g_get_monotonic_time () >= deadline)
+			break;
+	}
+
+	return *item >= model->num_items;
+}
+
+static void
+draw_keyboard_to_context (MatekbdKeyboardDrawingRenderContext * context,
+			  MatekbdKeyboardDrawingModel * model)
+{
+	draw_keyboard_layers_to_context (context, model, DRAW_LAYER_ALL);
+}
+
+static void
+get_style_palette (MatekbdKeyboardDrawing * drawing,
+		   MatekbdKeyboardDrawingPalette * palette)
 {
 	GtkStyleContext *style_context = NULL;
 	GtkStateFlags state;
 	GdkRGBA dark_color;
 
-	if (drawing == NULL)
-		return FALSE;
-	if (drawing->surface == NULL)
-		return FALSE;
-
-	drawing->renderContext->cr =
-	    cairo_create (drawing->surface);
-
 	style_context = gtk_widget_get_style_context (GTK_WIDGET (drawing));
 	state = gtk_style_context_get_state (style_context);
 
@@ -1563,89 +1935,854 @@ create_cairo (MatekbdKeyboardDrawing * drawing)
 	dark_color.red *= 0.7;
 	dark_color.green *= 0.7;
 	dark_color.blue *= 0.7;
+	palette->outline = dark_color;
+
+	gtk_style_context_save (style_context);
+	gtk_style_context_add_class (style_context, GTK_STYLE_CLASS_VIEW);
+	gtk_style_context_get_background_color (style_context, state,
+	                                        &palette->background);
+	gtk_style_context_get_background_color (style_context,
+	                                        GTK_STATE_FLAG_SELECTED,
+	                                        &palette->pressed);
+	gtk_style_context_restore (style_context);
+}
+
+/* resolves the theme colors and font once per style change, returns
+ * whether they differ from the previous ones */
+static gboolean
+update_style (MatekbdKeyboardDrawing * drawing)
+{
+	GtkStyleContext *style_context =
+	    gtk_widget_get_style_context (GTK_WIDGET (drawing));
+	MatekbdKeyboardDrawingPalette palette;
+	PangoFontDescription *font_desc;
+	gboolean changed;
+
+	get_style_palette (drawing, &palette);
+	gtk_style_context_get (style_context,
+	                       gtk_style_context_get_state (style_context),
+	                       GTK_STYLE_PROPERTY_FONT, &font_desc,
+	                       NULL);
+
+	changed = drawing->font_desc == NULL ||
+	    !pango_font_description_equal (font_desc, drawing->font_desc) ||
+	    !gdk_rgba_equal (&palette.background,
+			     &drawing->palette.background) ||
+	    !gdk_rgba_equal (&palette.outline, &drawing->palette.outline) ||
+	    !gdk_rgba_equal (&palette.pressed, &drawing->palette.pressed);
+
+	if (drawing->font_desc != NULL)
+		pango_font_description_free (drawing->font_desc);
+	drawing->font_desc = font_desc;
+	drawing->palette = palette;
+
+	return changed;
+}
+
+/* the render context gets what the labels show and the colors from the
+ * widget */
+static void
+sync_render_context (MatekbdKeyboardDrawing * drawing)
+{
+	MatekbdKeyboardDrawingRenderContext *context = drawing->renderContext;
+
+	context->palette = drawing->palette;
+	context->groupLevels = drawing->groupLevels;
+	context->mods = drawing->mods;
+	context->track_modifiers = drawing->track_modifiers;
+}
+
+static gboolean
+create_cairo (MatekbdKeyboardDrawing * drawing, cairo_surface_t * surface)
+{
+	if (drawing == NULL)
+		return FALSE;
+	if (surface == NULL)
+		return FALSE;
+
+	/* the keycaps are repaired often, their context is kept and only
+	 * its state saved */
+	if (surface == drawing->surface) {
+		if (drawing->surface_cr == NULL)
+			drawing->surface_cr = cairo_create (surface);
+		cairo_save (drawing->surface_cr);
+		drawing->renderContext->cr = drawing->surface_cr;
+	} else
+		drawing->renderContext->cr = cairo_create (surface);
+	sync_render_context (drawing);
+
+	return TRUE;
+}
+
+static void
+destroy_cairo (MatekbdKeyboardDrawing * drawing)
+{
+	if (drawing->renderContext->cr == drawing->surface_cr)
+		cairo_restore (drawing->surface_cr);
+	else
+		cairo_destroy (drawing->renderContext->cr);
+	drawing->renderContext->cr = NULL;
+}
+
+static void
+free_surface (MatekbdKeyboardDrawing * drawing)
+{
+	if (drawing->surface_cr != NULL) {
+		cairo_destroy (drawing->surface_cr);
+		drawing->surface_cr = NULL;
+	}
+	if (drawing->surface != NULL) {
+		cairo_surface_destroy (drawing->surface);
+		drawing->surface = NULL;
+	}
+}
+
+static void
+free_spare_surfaces (MatekbdKeyboardDrawing * drawing)
+{
+	g_slist_free_full (drawing->spare_surfaces,
+			   (GDestroyNotify) cairo_surface_destroy);
+	drawing->spare_surfaces = NULL;
+}
+
+/* whether the layer surfaces made so far fit the allocation */
+static gboolean
+layer_surfaces_fit (MatekbdKeyboardDrawing * drawing,
+		    GtkAllocation * allocation)
+{
+	return allocation->width == drawing->surface_width &&
+	    allocation->height == drawing->surface_height &&
+	    gtk_widget_get_scale_factor (GTK_WIDGET (drawing)) ==
+	    drawing->surface_scale;
+}
+
+/* label layers come from the spares when there are some, and have to be
+ * cleared before they are painted */
+static cairo_surface_t *
+create_layer_surface (MatekbdKeyboardDrawing * drawing,
+		      cairo_content_t content)
+{
+	GtkAllocation allocation;
+
+	gtk_widget_get_allocation (GTK_WIDGET (drawing), &allocation);
+
+	if (!layer_surfaces_fit (drawing, &allocation)) {
+		free_spare_surfaces (drawing);
+		drawing->surface_width = allocation.width;
+		drawing->surface_height = allocation.height;
+		drawing->surface_scale =
+		    gtk_widget_get_scale_factor (GTK_WIDGET (drawing));
+	}
+
+	if (content == CAIRO_CONTENT_COLOR_ALPHA &&
+	    drawing->spare_surfaces != NULL) {
+		cairo_surface_t *surface = drawing->spare_surfaces->data;
+
+		drawing->spare_surfaces =
+		    g_slist_delete_link (drawing->spare_surfaces,
+					 drawing->spare_surfaces);
+		return surface;
+	}
+
+	matekbd_counters_add (MATEKBD_COUNTER_SURFACES_ALLOCATED, 1);
+	return gdk_window_create_similar_surface (gtk_widget_get_window
+						  (GTK_WIDGET (drawing)),
+						  content,
+						  allocation.width,
+						  allocation.height);
+}
+
+static guint
+label_layer_mods (MatekbdKeyboardDrawing * drawing)
+{
+	/* without modifier tracking the labels do not depend on mods */
+	return drawing->track_modifiers ? drawing->mods : 0;
+}
+
+static gboolean
+spare_label_surface (gpointer mods, cairo_surface_t * surface,
+		     MatekbdKeyboardDrawing * drawing)
+{
+	if (g_slist_length (drawing->spare_surfaces) < SPARE_SURFACES_MAX)
+		drawing->spare_surfaces =
+		    g_slist_prepend (drawing->spare_surfaces, surface);
+	else
+		cairo_surface_destroy (surface);
+	return TRUE;
+}
+
+static void
+flush_label_surfaces (MatekbdKeyboardDrawing * drawing)
+{
+	drawing->label_surface = NULL;
+	g_hash_table_foreach_steal (drawing->label_surfaces,
+				    (GHRFunc) spare_label_surface, drawing);
+}
+
+static void
+add_label_surface (MatekbdKeyboardDrawing * drawing,
+		   cairo_surface_t * surface)
+{
+	/* only a few mods combinations are ever shown, so a full cache is
+	 * simply started over */
+	if (g_hash_table_size (drawing->label_surfaces) >= LABEL_SURFACES_MAX)
+		flush_label_surfaces (drawing);
+
+	g_hash_table_insert (drawing->label_surfaces,
+			     GUINT_TO_POINTER (label_layer_mods (drawing)),
+			     surface);
+	drawing->label_surface = surface;
+}
+
+static gboolean
+context_setup_scaling (MatekbdKeyboardDrawingRenderContext * context,
+		       MatekbdKeyboardDrawingModel * model,
+		       gdouble width, gdouble height,
+		       gdouble dpi_x, gdouble dpi_y)
+{
+	gint font_size;
+
+	if (!model)
+		return FALSE;
+
+	if (model->xkb->geom->width_mm <= 0
+	    || model->xkb->geom->height_mm <= 0) {
+		g_critical
+		    ("keyboard geometry reports width or height as zero!");
+		return FALSE;
+	}
+
+	if (width * model->xkb->geom->height_mm <
+	    height * model->xkb->geom->width_mm) {
+		context->scale_numerator = width;
+		context->scale_denominator = model->xkb->geom->width_mm;
+	} else {
+		context->scale_numerator = height;
+		context->scale_denominator = model->xkb->geom->height_mm;
+	}
+
+	font_size = 72 * KEY_FONT_SIZE * dpi_x *
+	    context->scale_numerator / context->scale_denominator;
+	/* cached labels are keyed by font size, drop the stale ones */
+	if (context->label_layouts != NULL &&
+	    font_size != pango_font_description_get_size (context->font_desc))
+		g_hash_table_remove_all (context->label_layouts);
+
+	pango_font_description_set_size (context->font_desc, font_size);
+	pango_layout_set_spacing (context->layout,
+				  -160 * dpi_y * context->scale_numerator /
+				  context->scale_denominator);
+	pango_layout_set_font_description (context->layout,
+					   context->font_desc);
+
+	return TRUE;
+}
+
+static void
+drop_labels_list (MatekbdKeyboardDrawing * drawing)
+{
+	if (drawing->labels_list != NULL) {
+		cairo_surface_destroy (drawing->labels_list);
+		drawing->labels_list = NULL;
+	}
+}
+
+static cairo_surface_t *
+new_labels_recording (MatekbdKeyboardDrawing * drawing)
+{
+	XkbGeometryRec *geom = drawing->model->xkb->geom;
+	cairo_rectangle_t extents = { 0, 0, geom->width_mm, geom->height_mm };
+
+	return cairo_recording_surface_create (CAIRO_CONTENT_COLOR_ALPHA,
+					       &extents);
+}
+
+/* Records the labels of the items from labels_list_items on until the
+ * deadline, returns whether all of them are recorded.  The labels are
+ * laid out once in xkb units, so that a new size only replays them.
+ * With slice, what gets recorded this time is also returned there, to
+ * be shown on its own. */
+static gboolean
+record_labels_list (MatekbdKeyboardDrawing * drawing, gint64 deadline,
+		    cairo_surface_t ** slice)
+{
+	MatekbdKeyboardDrawingRenderContext *context = drawing->listContext;
+	XkbGeometryRec *geom = drawing->model->xkb->geom;
+	cairo_surface_t *target;
+	gboolean done;
+
+	if (slice != NULL)
+		*slice = NULL;
+
+	if (drawing->labels_list != NULL
+	    && drawing->labels_list_mods != label_layer_mods (drawing))
+		drop_labels_list (drawing);
+
+	if (drawing->labels_list == NULL) {
+		/* one xkb unit per unit, at the resolution relayout ()
+		 * lays the widget out for */
+		if (!context_setup_scaling (context, drawing->model,
+					    geom->width_mm, geom->height_mm,
+					    50, 50))
+			return TRUE;
+		drawing->labels_list = new_labels_recording (drawing);
+		drawing->labels_list_mods = label_layer_mods (drawing);
+		drawing->labels_list_items = 0;
+	}
+
+	if (drawing->labels_list_items >= drawing->model->num_items)
+		return TRUE;
+
+	target = slice != NULL ? new_labels_recording (drawing) :
+	    drawing->labels_list;
+	context->cr = cairo_create (target);
+	context->groupLevels = drawing->groupLevels;
+	context->mods = drawing->mods;
+	context->track_modifiers = drawing->track_modifiers;
+	done = draw_keyboard_layers_slice (context, drawing->model,
+					   DRAW_LAYER_LABELS,
+					   &drawing->labels_list_items,
+					   deadline);
+	cairo_destroy (context->cr);
+	context->cr = NULL;
+
+	if (slice != NULL) {
+		cairo_t *cr = cairo_create (drawing->labels_list);
+
+		cairo_set_source_surface (cr, target, 0, 0);
+		cairo_paint (cr);
+		cairo_destroy (cr);
+		*slice = target;
+	}
+
+	return done;
+}
+
+/* Paints recording over surface at the current scale, within region (in
+ * pixels) if given.  With clear, what surface held there goes first. */
+static void
+replay_labels (MatekbdKeyboardDrawing * drawing, cairo_surface_t * surface,
+	       cairo_surface_t * recording, cairo_region_t * region,
+	       gboolean clear)
+{
+	MatekbdKeyboardDrawingRenderContext *context = drawing->renderContext;
+	gdouble scale =
+	    (gdouble) context->scale_numerator / context->scale_denominator;
+
+	if (!create_cairo (drawing, surface))
+		return;
+
+	if (region != NULL) {
+		gdk_cairo_region (context->cr, region);
+		cairo_clip (context->cr);
+	}
+	if (clear) {
+		cairo_set_operator (context->cr, CAIRO_OPERATOR_CLEAR);
+		cairo_paint (context->cr);
+		cairo_set_operator (context->cr, CAIRO_OPERATOR_OVER);
+	}
+	if (recording != NULL) {
+		cairo_scale (context->cr, scale, scale);
+		cairo_set_source_surface (context->cr, recording, 0, 0);
+		cairo_paint (context->cr);
+	}
+	destroy_cairo (drawing);
+}
+
+/* makes drawing->label_surface hold the labels for the current mods,
+ * painting them unless they are cached already */
+static void
+update_label_surface (MatekbdKeyboardDrawing * drawing)
+{
+	cairo_surface_t *surface;
+
+	if (!drawing->model || drawing->surface == NULL)
+		return;
+
+	surface = g_hash_table_lookup (drawing->label_surfaces,
+				       GUINT_TO_POINTER (label_layer_mods
+							 (drawing)));
+	if (surface != NULL) {
+		drawing->label_surface = surface;
+		return;
+	}
+
+	surface = create_layer_surface (drawing, CAIRO_CONTENT_COLOR_ALPHA);
+	record_labels_list (drawing, G_MAXINT64, NULL);
+	replay_labels (drawing, surface, drawing->labels_list, NULL, TRUE);
+	add_label_surface (drawing, surface);
+}
+
+static void
+paint_background (MatekbdKeyboardDrawingRenderContext * context)
+{
+	/* replaces what the reused surfaces held before */
+	cairo_set_operator (context->cr, CAIRO_OPERATOR_SOURCE);
+	gdk_cairo_set_source_rgba (context->cr, &context->palette.background);
+	cairo_paint (context->cr);
+	cairo_set_operator (context->cr, CAIRO_OPERATOR_OVER);
+}
+
+/* repaints the given layers of surface within region (in pixels), drawing
+ * only the items reaching into it */
+static void
+repair_layer (MatekbdKeyboardDrawing * drawing, cairo_surface_t * surface,
+	      DrawLayers layers, cairo_region_t * region)
+{
+	cairo_t *cr;
+	gint i, n;
+
+	if (!create_cairo (drawing, surface))
+		return;
+	cr = drawing->renderContext->cr;
+
+	matekbd_counters_add (MATEKBD_COUNTER_PARTIAL_REDRAWS, 1);
+
+	n = cairo_region_num_rectangles (region);
+	for (i = 0; i < n; i++) {
+		cairo_rectangle_int_t rect;
+
+		cairo_region_get_rectangle (region, i, &rect);
+		cairo_save (cr);
+		cairo_rectangle (cr, rect.x, rect.y, rect.width, rect.height);
+		cairo_clip (cr);
+
+		if (layers & DRAW_LAYER_SHAPES)
+			paint_background (drawing->renderContext);
+		else {
+			cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+			cairo_paint (cr);
+			cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+		}
+
+		draw_keyboard_layers_to_context (drawing->renderContext,
+						 drawing->model, layers);
+		cairo_restore (cr);
+	}
+
+	destroy_cairo (drawing);
+}
+
+static void
+clear_damage (MatekbdKeyboardDrawing * drawing)
+{
+	cairo_region_destroy (drawing->damage);
+	drawing->damage = cairo_region_create ();
+}
+
+/* makes drawing->surface fit the allocation and blank, and drops the
+ * label layers, for all the layers to be painted again */
+static void
+begin_draw_keyboard (MatekbdKeyboardDrawing * drawing)
+{
+	GtkAllocation allocation;
+
+	matekbd_counters_add (MATEKBD_COUNTER_FULL_REDRAWS, 1);
+
+	/* the keycaps are painted over completely, so a surface of the
+	 * right size is reused */
+	gtk_widget_get_allocation (GTK_WIDGET (drawing), &allocation);
+	if (drawing->surface == NULL
+	    || !layer_surfaces_fit (drawing, &allocation)) {
+		free_surface (drawing);
+		drawing->surface =
+		    create_layer_surface (drawing, CAIRO_CONTENT_COLOR);
+	}
+	clear_damage (drawing);
+
+	if (create_cairo (drawing, drawing->surface)) {
+		/* blank background */
+		paint_background (drawing->renderContext);
+		destroy_cairo (drawing);
+	}
+	drawing->layers_scale =
+	    (gdouble) drawing->renderContext->scale_numerator /
+	    drawing->renderContext->scale_denominator;
+
+	flush_label_surfaces (drawing);
+}
+
+static void
+draw_keyboard (MatekbdKeyboardDrawing * drawing)
+{
+	gint64 start;
+
+	if (!drawing->model)
+		return;
+
+	start = matekbd_counters_phase_begin ();
+	begin_draw_keyboard (drawing);
+
+	if (create_cairo (drawing, drawing->surface)) {
+		draw_keyboard_layers_to_context (drawing->renderContext,
+						 drawing->model, DRAW_LAYER_SHAPES);
+		destroy_cairo (drawing);
+	}
+
+	update_label_surface (drawing);
+
+	matekbd_counters_phase_end (MATEKBD_PHASE_DRAW_KEYBOARD, start);
+}
+
+/* starts the label layer of a progressive redraw with the labels
+ * recorded so far, every slice recorded afterwards is painted over it */
+static void
+begin_label_slices (MatekbdKeyboardDrawing * drawing)
+{
+	cairo_surface_t *surface;
+
+	if (drawing->labels_list != NULL
+	    && drawing->labels_list_mods != label_layer_mods (drawing))
+		drop_labels_list (drawing);
+
+	flush_label_surfaces (drawing);
+	surface = create_layer_surface (drawing, CAIRO_CONTENT_COLOR_ALPHA);
+	replay_labels (drawing, surface, drawing->labels_list, NULL, TRUE);
+	add_label_surface (drawing, surface);
+
+	drawing->render_layer = DRAW_LAYER_LABELS;
+	drawing->render_mods = label_layer_mods (drawing);
+}
+
+/* paints the keycaps and then the labels of a progressive redraw for a
+ * slice of the frame, returns whether the layers are complete.  The
+ * layers are shown as they fill in. */
+static gboolean
+draw_keyboard_slice (MatekbdKeyboardDrawing * drawing)
+{
+	MatekbdKeyboardDrawingRenderContext *context = drawing->renderContext;
+	gint64 start = matekbd_counters_phase_begin ();
+	gint64 deadline = start + RENDER_SLICE_TIME;
+	gboolean done = TRUE;
+
+	if (!drawing->model)
+		return TRUE;
+
+	if (!drawing->rendering) {
+		begin_draw_keyboard (drawing);
+		drawing->render_layer = DRAW_LAYER_SHAPES;
+		drawing->render_item = 0;
+		drawing->rendering = 1;
+	}
+
+	if (drawing->render_layer == DRAW_LAYER_SHAPES) {
+		if (create_cairo (drawing, drawing->surface)) {
+			done = draw_keyboard_layers_slice (context,
+							   drawing->model,
+							   DRAW_LAYER_SHAPES,
+							   &drawing->render_item,
+							   deadline);
+			destroy_cairo (drawing);
+		}
+		if (done)
+			begin_label_slices (drawing);
+	} else if (drawing->label_surface == NULL
+		   || drawing->render_mods != label_layer_mods (drawing))
+		/* the labels shown changed meanwhile */
+		begin_label_slices (drawing);
+
+	/* a size change only replays labels recorded before */
+	if (done) {
+		cairo_surface_t *slice;
+
+		done = record_labels_list (drawing, deadline, &slice);
+		if (slice != NULL) {
+			replay_labels (drawing, drawing->label_surface, slice,
+				       NULL, FALSE);
+			cairo_surface_destroy (slice);
+		}
+	}
+
+	matekbd_counters_phase_end (MATEKBD_PHASE_DRAW_KEYBOARD, start);
+	if (done)
+		drawing->rendering = 0;
+	return done;
+}
+
+static MatekbdKeyboardDrawingRenderContext *
+new_render_context (MatekbdKeyboardDrawing * drawing)
+{
+	MatekbdKeyboardDrawingRenderContext *context =
+	    g_new0 (MatekbdKeyboardDrawingRenderContext, 1);
+
+	PangoContext *pangoContext =
+	    gtk_widget_get_pango_context (GTK_WIDGET (drawing));
+
+	context->font_desc = pango_font_description_copy (drawing->font_desc);
+
+	context->layout = pango_layout_new (pangoContext);
+	pango_layout_set_ellipsize (context->layout, PANGO_ELLIPSIZE_END);
+	context->label_layouts = label_layouts_new ();
+
+	context->angle = 0;
+	context->scale_numerator = 1;
+	context->scale_denominator = 1;
+
+	return context;
+}
+
+static void
+alloc_render_context (MatekbdKeyboardDrawing * drawing)
+{
+	drawing->renderContext = new_render_context (drawing);
+	/* only the widget paints the same keycaps over and over */
+	drawing->renderContext->keycaps = keycaps_new ();
+	drawing->listContext = new_render_context (drawing);
+}
+
+static void
+render_context_free (MatekbdKeyboardDrawingRenderContext * context)
+{
+	g_object_unref (G_OBJECT (context->layout));
+	g_hash_table_destroy (context->label_layouts);
+	if (context->keycaps != NULL)
+		g_hash_table_destroy (context->keycaps);
+	pango_font_description_free (context->font_desc);
+
+	g_free (context);
+}
+
+static void
+free_render_context (MatekbdKeyboardDrawing * drawing)
+{
+	render_context_free (drawing->renderContext);
+	drawing->renderContext = NULL;
+	render_context_free (drawing->listContext);
+	drawing->listContext = NULL;
+}
+
+/* the pressed state is transient, so it is not kept on any surface */
+static void
+draw_pressed_keys (MatekbdKeyboardDrawing * drawing, cairo_t * cr)
+{
+	MatekbdKeyboardDrawingRenderContext *context = drawing->renderContext;
+	MatekbdKeyboardDrawingModel *model = drawing->model;
+	GdkRectangle clip;
+	gint i;
+
+	context->cr = cr;
+	if (model->item_bounds == NULL || !get_clip_bounds (context, &clip)) {
+		context->cr = NULL;
+		return;
+	}
+	context->cr = NULL;
+
+	for (i = model->xkb->min_key_code; i <= model->xkb->max_key_code; i++) {
+		MatekbdKeyboardDrawingKey *key = model->keys[i];
+
+		if (key == NULL || !drawing->pressed_keys[i])
+			continue;
+		if (!gdk_rectangle_intersect (&clip, model->item_bounds +
+					      get_item_index (model,
+							      (MatekbdKeyboardDrawingItem
+							       *) key), NULL))
+			continue;
+
+		if (context->cr == NULL) {
+			context->cr = cr;
+			sync_render_context (drawing);
+		}
+		draw_key_shape (context, model, key, TRUE);
+		redraw_overlapping_doodads (context, model,
+					    (MatekbdKeyboardDrawingItem *) key);
+	}
+
+	context->cr = NULL;
+}
+
+/* shown while set_keyboard_async () is loading */
+static void
+draw_placeholder (MatekbdKeyboardDrawing * drawing, cairo_t * cr)
+{
+	GtkWidget *widget = GTK_WIDGET (drawing);
+	PangoLayout *layout =
+	    gtk_widget_create_pango_layout (widget, _("Loading keyboard…"));
+	gint width, height;
+
+	pango_layout_get_pixel_size (layout, &width, &height);
+	gtk_render_layout (gtk_widget_get_style_context (widget), cr,
+			   (gtk_widget_get_allocated_width (widget) -
+			    width) / 2,
+			   (gtk_widget_get_allocated_height (widget) -
+			    height) / 2, layout);
+	g_object_unref (layout);
+}
+
+typedef struct {
+	guint keycode;
+	/* monotonic times in microseconds, 0 until reached */
+	gint64 event_time;
+	gint64 draw_time;
+	gint64 paint_time;
+	/* the frame drawn, valid with draw_time */
+	gint64 frame_counter;
+	gint frames_waited;
+} LatencyTrace;
+
+static void
+trace_key_event (MatekbdKeyboardDrawing * drawing, guint keycode)
+{
+	LatencyTrace trace = { keycode, g_get_monotonic_time () };
+
+	if (!drawing->trace_latency)
+		return;
+
+	if (drawing->latency_traces->len >= LATENCY_TRACES_MAX)
+		g_array_remove_index (drawing->latency_traces, 0);
+	g_array_append_val (drawing->latency_traces, trace);
+}
+
+static void
+record_latency (MatekbdKeyboardDrawing * drawing, LatencyTrace * trace,
+		gint64 present_time)
+{
+	gint64 latency = present_time - trace->event_time;
+	gint64 ms = latency / 1000;
+	gint bucket = 0;
+
+	while (ms > 0 && bucket < MATEKBD_KEYBOARD_DRAWING_LATENCY_BUCKETS - 1) {
+		ms >>= 1;
+		bucket++;
+	}
+	drawing->latency_histogram[bucket]++;
+
+	g_signal_emit (drawing,
+		       matekbd_keyboard_drawing_signals[KEY_LATENCY], 0,
+		       trace->keycode, trace->draw_time - trace->event_time,
+		       latency);
+}
+
+/* completes the traces of the frames painted, using the presentation time
+ * when the windowing system reports one */
+static void
+latency_after_paint (GdkFrameClock * clock, MatekbdKeyboardDrawing * drawing)
+{
+	GArray *done = g_array_new (FALSE, FALSE, sizeof (LatencyTrace));
+	gint64 now = g_get_monotonic_time ();
+	gboolean waiting = FALSE;
+	guint i;
+
+	for (i = 0; i < drawing->latency_traces->len; i++) {
+		LatencyTrace *trace = &g_array_index (drawing->latency_traces,
+						      LatencyTrace, i);
+		GdkFrameTimings *timings;
+
+		if (trace->draw_time == 0)
+			continue;
+		if (trace->paint_time == 0)
+			trace->paint_time = now;
+
+		timings = gdk_frame_clock_get_timings (clock,
+						       trace->frame_counter);
+		if (timings != NULL && !gdk_frame_timings_get_complete (timings)
+		    && ++trace->frames_waited < LATENCY_FRAMES_MAX) {
+			waiting = TRUE;
+			continue;
+		}
+
+		g_array_append_val (done, *trace);
+		g_array_remove_index (drawing->latency_traces, i--);
+	}
 
-	drawing->renderContext->dark_color = dark_color;
+	if (waiting)
+		gdk_frame_clock_request_phase (clock,
+					       GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
 
-	return TRUE;
-}
+	/* handlers may turn tracing off, so only done is used from here */
+	for (i = 0; i < done->len; i++) {
+		LatencyTrace *trace = &g_array_index (done, LatencyTrace, i);
+		GdkFrameTimings *timings =
+		    gdk_frame_clock_get_timings (clock, trace->frame_counter);
+		gint64 present_time = 0;
 
-static void
-destroy_cairo (MatekbdKeyboardDrawing * drawing)
-{
-	cairo_destroy (drawing->renderContext->cr);
-	drawing->renderContext->cr = NULL;
+		if (timings != NULL && gdk_frame_timings_get_complete (timings))
+			present_time =
+			    gdk_frame_timings_get_presentation_time (timings);
+
+		record_latency (drawing, trace,
+				present_time > 0 ? present_time :
+				trace->paint_time);
+	}
+	g_array_free (done, TRUE);
 }
 
 static void
-draw_keyboard (MatekbdKeyboardDrawing * drawing)
+disconnect_latency_clock (MatekbdKeyboardDrawing * drawing)
 {
-        GtkStyleContext *context =
-	    gtk_widget_get_style_context (GTK_WIDGET (drawing));
-	GtkStateFlags state = gtk_style_context_get_state (context);
-	GdkRGBA color;
-	GtkAllocation allocation;
-
-	if (!drawing->xkb)
+	if (drawing->latency_clock == NULL)
 		return;
 
-	gtk_widget_get_allocation (GTK_WIDGET (drawing), &allocation);
-
-	drawing->surface =
-	    gdk_window_create_similar_surface (gtk_widget_get_window
-					       (GTK_WIDGET (drawing)),
-					       CAIRO_CONTENT_COLOR,
-					       allocation.width,
-					       allocation.height);
-
-	if (create_cairo (drawing)) {
-		/* blank background */
-		gtk_style_context_save (context);
-		gtk_style_context_add_class (context, GTK_STYLE_CLASS_VIEW);
-		gtk_style_context_get_background_color (context, state, &color);
-		gtk_style_context_restore (context);
-		gdk_cairo_set_source_rgba (drawing->renderContext->cr, &color);
-		cairo_paint (drawing->renderContext->cr);
-
-		draw_keyboard_to_context (drawing->renderContext, drawing);
-		destroy_cairo (drawing);
-	}
+	g_signal_handler_disconnect (drawing->latency_clock,
+				     drawing->latency_handler);
+	g_object_unref (drawing->latency_clock);
+	drawing->latency_clock = NULL;
+	drawing->latency_handler = 0;
 }
 
+/* marks the traced key changes as drawn in the frame being painted */
 static void
-alloc_render_context (MatekbdKeyboardDrawing * drawing)
+trace_key_draw (MatekbdKeyboardDrawing * drawing)
 {
-	MatekbdKeyboardDrawingRenderContext *context =
-	    drawing->renderContext =
-	    g_new0 (MatekbdKeyboardDrawingRenderContext, 1);
+	GdkFrameClock *clock;
+	gint64 now;
+	guint i;
 
-	PangoContext *pangoContext =
-	    gtk_widget_get_pango_context (GTK_WIDGET (drawing));
+	if (!drawing->trace_latency || drawing->latency_traces->len == 0)
+		return;
 
-	GtkStyleContext *style_context =
-	    gtk_widget_get_style_context (GTK_WIDGET (drawing));
+	clock = gtk_widget_get_frame_clock (GTK_WIDGET (drawing));
+	if (clock == NULL)
+		return;
 
-	gtk_style_context_get (style_context,
-	                       gtk_style_context_get_state (style_context),
-	                       GTK_STYLE_PROPERTY_FONT, &context->font_desc,
-	                       NULL);
+	/* the clock changes when the widget moves to another toplevel */
+	if (clock != drawing->latency_clock) {
+		disconnect_latency_clock (drawing);
+		drawing->latency_clock = g_object_ref (clock);
+		drawing->latency_handler =
+		    g_signal_connect (clock, "after-paint",
+				      G_CALLBACK (latency_after_paint),
+				      drawing);
+	}
 
-	context->layout = pango_layout_new (pangoContext);
-	pango_layout_set_ellipsize (context->layout, PANGO_ELLIPSIZE_END);
+	now = g_get_monotonic_time ();
+	for (i = 0; i < drawing->latency_traces->len; i++) {
+		LatencyTrace *trace = &g_array_index (drawing->latency_traces,
+						      LatencyTrace, i);
 
-	context->angle = 0;
-	context->scale_numerator = 1;
-	context->scale_denominator = 1;
+		if (trace->draw_time != 0)
+			continue;
+		trace->draw_time = now;
+		trace->frame_counter = gdk_frame_clock_get_frame_counter (clock);
+	}
 }
 
+/* shows the layers of the previous size while a resize goes on */
 static void
-free_render_context (MatekbdKeyboardDrawing * drawing)
+draw_scaled_layers (MatekbdKeyboardDrawing * drawing, cairo_t * cr)
 {
 	MatekbdKeyboardDrawingRenderContext *context = drawing->renderContext;
-	g_object_unref (G_OBJECT (context->layout));
-	pango_font_description_free (context->font_desc);
+	gdouble zoom = (gdouble) context->scale_numerator /
+	    context->scale_denominator / drawing->layers_scale;
 
-	g_free (drawing->renderContext);
-	drawing->renderContext = NULL;
+	gdk_cairo_set_source_rgba (cr, &drawing->palette.background);
+	cairo_paint (cr);
+
+	cairo_save (cr);
+	cairo_scale (cr, zoom, zoom);
+	cairo_set_source_surface (cr, drawing->surface, 0, 0);
+	cairo_paint (cr);
+	cairo_restore (cr);
+
+	/* drawn for the new size already */
+	draw_pressed_keys (drawing, cr);
+
+	if (drawing->label_surface != NULL) {
+		cairo_save (cr);
+		cairo_scale (cr, zoom, zoom);
+		cairo_set_source_surface (cr, drawing->label_surface, 0, 0);
+		cairo_paint (cr);
+		cairo_restore (cr);
+	}
 }
 
 static gboolean
@@ -1653,85 +2790,122 @@ draw (GtkWidget *widget,
       cairo_t *cr,
       MatekbdKeyboardDrawing *drawing)
 {
-	if (!drawing->xkb)
+	if (drawing->load_task != NULL) {
+		draw_placeholder (drawing, cr);
+		return FALSE;
+	}
+
+	if (!drawing->model)
 		return FALSE;
 
 	if (drawing->surface == NULL)
 		return FALSE;
 
+	/* the layers are out of date until the pending redraw */
+	if (drawing->redraw_tick && !drawing->rendering) {
+		if (drawing->layers_scale > 0)
+			draw_scaled_layers (drawing, cr);
+		return FALSE;
+	}
+
+	/* damage is repaired once the progressive redraw is done, painting
+	 * the same items twice would thicken their edges */
+	if (!drawing->rendering && !cairo_region_is_empty (drawing->damage)) {
+		repair_layer (drawing, drawing->surface, DRAW_LAYER_SHAPES,
+			      drawing->damage);
+		clear_damage (drawing);
+	}
+
 	cairo_set_source_surface (cr, drawing->surface, 0, 0);
 	cairo_paint (cr);
 
+	draw_pressed_keys (drawing, cr);
+
+	if (drawing->label_surface != NULL) {
+		cairo_set_source_surface (cr, drawing->label_surface, 0, 0);
+		cairo_paint (cr);
+	}
+
+	trace_key_draw (drawing);
+
 	return FALSE;
 }
 
+/* paints all the layers again in the next frame, so they are painted at
+ * most once per frame, and not before a resize has settled */
 static gboolean
-idle_redraw (gpointer user_data)
+redraw_tick (GtkWidget * widget, GdkFrameClock * clock, gpointer user_data)
 {
-	MatekbdKeyboardDrawing *drawing = user_data;
+	MatekbdKeyboardDrawing *drawing = MATEKBD_KEYBOARD_DRAWING (widget);
 
-	drawing->idle_redraw = 0;
-	draw_keyboard (drawing);
-	gtk_widget_queue_draw (GTK_WIDGET (drawing));
-	return FALSE;
+	if (gdk_frame_clock_get_frame_time (clock) - drawing->resize_time <
+	    RESIZE_SETTLE_TIME)
+		return G_SOURCE_CONTINUE;
+
+	if (drawing->progressive) {
+		gtk_widget_queue_draw (widget);
+		if (!draw_keyboard_slice (drawing))
+			return G_SOURCE_CONTINUE;
+	} else
+		draw_keyboard (drawing);
+
+	drawing->redraw_tick = 0;
+	gtk_widget_queue_draw (widget);
+	return G_SOURCE_REMOVE;
 }
 
-static gboolean
-context_setup_scaling (MatekbdKeyboardDrawingRenderContext * context,
-		       MatekbdKeyboardDrawing * drawing,
-		       gdouble width, gdouble height,
-		       gdouble dpi_x, gdouble dpi_y)
+static void
+queue_redraw (MatekbdKeyboardDrawing * drawing)
 {
-	if (!drawing->xkb)
-		return FALSE;
+	if (!drawing->redraw_tick)
+		drawing->redraw_tick =
+		    gtk_widget_add_tick_callback (GTK_WIDGET (drawing),
+						  redraw_tick, NULL, NULL);
+}
 
-	if (drawing->xkb->geom->width_mm <= 0
-	    || drawing->xkb->geom->height_mm <= 0) {
-		g_critical
-		    ("keyboard geometry reports width or height as zero!");
-		return FALSE;
-	}
+/* scales the keyboard to the allocation and repaints all the layers in a
+ * following frame.  When resizing, the current layers are shown scaled
+ * meanwhile, otherwise they are only kept for reuse. */
+static void
+relayout (MatekbdKeyboardDrawing * drawing, gboolean resizing)
+{
+	MatekbdKeyboardDrawingRenderContext *context = drawing->renderContext;
+	GtkAllocation allocation;
 
-	if (width * drawing->xkb->geom->height_mm <
-	    height * drawing->xkb->geom->width_mm) {
-		context->scale_numerator = width;
-		context->scale_denominator = drawing->xkb->geom->width_mm;
-	} else {
-		context->scale_numerator = height;
-		context->scale_denominator = drawing->xkb->geom->height_mm;
+	gtk_widget_get_allocation (GTK_WIDGET (drawing), &allocation);
+
+	clear_damage (drawing);
+	/* the keycaps are rasterized for the scale */
+	g_hash_table_remove_all (context->keycaps);
+	/* a progressive redraw under way starts over */
+	drawing->rendering = 0;
+	if (resizing)
+		drawing->resize_time = g_get_monotonic_time ();
+	else {
+		flush_label_surfaces (drawing);
+		drawing->layers_scale = 0;
 	}
 
-	pango_font_description_set_size (context->font_desc,
-					 72 * KEY_FONT_SIZE * dpi_x *
-					 context->scale_numerator /
-					 context->scale_denominator);
-	pango_layout_set_spacing (context->layout,
-				  -160 * dpi_y * context->scale_numerator /
-				  context->scale_denominator);
-	pango_layout_set_font_description (context->layout,
-					   context->font_desc);
+	if (!context_setup_scaling (context, drawing->model,
+				    allocation.width, allocation.height,
+				    50, 50)) {
+		free_surface (drawing);
+		return;
+	}
 
-	return TRUE;
+	queue_redraw (drawing);
 }
 
 static void
 size_allocate (GtkWidget * widget,
 	       GtkAllocation * allocation, MatekbdKeyboardDrawing * drawing)
 {
-	MatekbdKeyboardDrawingRenderContext *context = drawing->renderContext;
-
-	if (drawing->surface) {
-		cairo_surface_destroy (drawing->surface);
-		drawing->surface = NULL;
-	}
-
-	if (!context_setup_scaling (context, drawing,
-				    allocation->width, allocation->height,
-				    50, 50))
+	/* containers allocate again at the same size all the time */
+	if (drawing->surface != NULL
+	    && layer_surfaces_fit (drawing, allocation))
 		return;
 
-	if (!drawing->idle_redraw)
-		drawing->idle_redraw = g_idle_add (idle_redraw, drawing);
+	relayout (drawing, drawing->surface != NULL);
 }
 
 static gint
@@ -1739,34 +2913,27 @@ key_event (GtkWidget * widget,
 	   GdkEventKey * event, MatekbdKeyboardDrawing * drawing)
 {
 	MatekbdKeyboardDrawingKey *key;
-	if (!drawing->xkb)
+	if (!drawing->model)
 		return FALSE;
 
-	key = drawing->keys + event->hardware_keycode;
-
-	if (event->hardware_keycode > drawing->xkb->max_key_code ||
-	    event->hardware_keycode < drawing->xkb->min_key_code ||
-	    key->xkbkey == NULL) {
+	if (event->hardware_keycode > drawing->model->xkb->max_key_code ||
+	    event->hardware_keycode < drawing->model->xkb->min_key_code ||
+	    (key = drawing->model->keys[event->hardware_keycode]) == NULL) {
 		g_signal_emit (drawing,
 			       matekbd_keyboard_drawing_signals[BAD_KEYCODE],
 			       0, event->hardware_keycode);
 		return TRUE;
 	}
 
-	if ((event->type == GDK_KEY_PRESS && key->pressed) ||
-	    (event->type == GDK_KEY_RELEASE && !key->pressed))
+	if ((event->type == GDK_KEY_PRESS) ==
+	    !!drawing->pressed_keys[event->hardware_keycode])
 		return TRUE;
 	/* otherwise this event changes the state we believed we had before */
 
-	key->pressed = (event->type == GDK_KEY_PRESS);
-
-	if (create_cairo (drawing)) {
-		draw_key (drawing->renderContext, drawing, key);
-		redraw_overlapping_doodads (drawing->renderContext,
-					    drawing, key);
-		destroy_cairo (drawing);
-	}
+	drawing->pressed_keys[event->hardware_keycode] =
+	    (event->type == GDK_KEY_PRESS);
 
+	trace_key_event (drawing, event->hardware_keycode);
 	invalidate_key_region (drawing, key);
 	return TRUE;
 }
@@ -1775,7 +2942,7 @@ static gint
 button_press_event (GtkWidget * widget,
 		    GdkEventButton * event, MatekbdKeyboardDrawing * drawing)
 {
-	if (!drawing->xkb)
+	if (!drawing->model)
 		return FALSE;
 
 	gtk_widget_grab_focus (widget);
@@ -1789,21 +2956,15 @@ unpress_keys (MatekbdKeyboardDrawing * drawing)
 
 	drawing->timeout = 0;
 
-	if (!drawing->xkb)
+	if (!drawing->model)
 		return FALSE;
 
-	if (create_cairo (drawing)) {
-		for (i = drawing->xkb->min_key_code;
-		     i <= drawing->xkb->max_key_code; i++)
-			if (drawing->keys[i].pressed) {
-				drawing->keys[i].pressed = FALSE;
-				draw_key (drawing->renderContext, drawing,
-					  drawing->keys + i);
-				invalidate_key_region (drawing,
-						       drawing->keys + i);
-			}
-		destroy_cairo (drawing);
-	}
+	for (i = drawing->model->xkb->min_key_code;
+	     i <= drawing->model->xkb->max_key_code; i++)
+		if (drawing->model->keys[i] != NULL && drawing->pressed_keys[i]) {
+			drawing->pressed_keys[i] = FALSE;
+			invalidate_key_region (drawing, drawing->model->keys[i]);
+		}
 
 	return FALSE;
 }
@@ -1825,7 +2986,8 @@ focus_event (GtkWidget * widget,
 
 static gint
 compare_keyboard_item_priorities (MatekbdKeyboardDrawingItem * a,
-				  MatekbdKeyboardDrawingItem * b)
+				  MatekbdKeyboardDrawingItem * b,
+				  gpointer user_data)
 {
 	if (a->priority > b->priority)
 		return 1;
@@ -1836,11 +2998,12 @@ compare_keyboard_item_priorities (MatekbdKeyboardDrawingItem * a,
 }
 
 static void
-init_indicator_doodad (MatekbdKeyboardDrawing * drawing,
+init_indicator_doodad (MatekbdKeyboardDrawingModel * model,
+		       Display * display,
 		       XkbDoodadRec * xkbdoodad,
 		       MatekbdKeyboardDrawingDoodad * doodad)
 {
-	if (!drawing->xkb)
+	if (!model->xkb)
 		return;
 
 	if (xkbdoodad->any.type == XkbIndicatorDoodad) {
@@ -1848,12 +3011,12 @@ init_indicator_doodad (MatekbdKeyboardDrawing * drawing,
 		Atom iname = 0;
 		Atom sname = xkbdoodad->indicator.name;
 		unsigned long phys_indicators =
-		    drawing->xkb->indicators->phys_indicators;
-		Atom *pind = drawing->xkb->names->indicators;
+		    model->xkb->indicators->phys_indicators;
+		Atom *pind = model->xkb->names->indicators;
 
 #ifdef KBDRAW_DEBUG
 		printf ("Looking for %d[%s]\n",
-			(int) sname, XGetAtomName (drawing->display,
+			(int) sname, XGetAtomName (display,
 						   sname));
 #endif
 
@@ -1861,7 +3024,7 @@ init_indicator_doodad (MatekbdKeyboardDrawing * drawing,
 			iname = *pind++;
 			/* name matches and it is real */
 			if (iname == sname
-			    && (phys_indicators & (1 << index)))
+			    && (phys_indicators & (1U << index)))
 				break;
 			if (iname == 0)
 				break;
@@ -1869,34 +3032,80 @@ init_indicator_doodad (MatekbdKeyboardDrawing * drawing,
 		if (iname == 0)
 			g_warning ("Could not find indicator %d [%s]\n",
 				   (int) sname,
-				   XGetAtomName (drawing->display, sname));
+				   XGetAtomName (display, sname));
 		else {
 #ifdef KBDRAW_DEBUG
 			printf ("Found in xkbdesc as %d\n", index);
 #endif
-			drawing->physical_indicators[index] = doodad;
-			/* Trying to obtain the real state, but if fail - just assume OFF */
-			if (!XkbGetNamedIndicator
-			    (drawing->display, sname, NULL, &doodad->on,
-			     NULL, NULL))
-				doodad->on = 0;
+			model->physical_indicators[index] = doodad;
+			/* the state is up to whoever shows the model */
+			doodad->on = 0;
 		}
 	}
 }
 
+/* points keys and physical_indicators at the items */
+static void
+index_keys_and_indicators (MatekbdKeyboardDrawingModel * model,
+			   Display * display)
+{
+	guint n;
+
+	for (n = 0; n < model->num_items; n++) {
+		MatekbdKeyboardDrawingItemSlot *slot = model->items + n;
+
+		if (slot->item.type == MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY)
+			model->keys[slot->key.keycode] = &slot->key;
+		else if (slot->item.type ==
+			 MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_DOODAD)
+			init_indicator_doodad (model, display,
+					       slot->doodad.doodad,
+					       &slot->doodad);
+	}
+}
+
+static guint
+count_keys_and_doodads (MatekbdKeyboardDrawingModel * model)
+{
+	guint n;
+	gint i, j;
+
+	n = model->xkb->geom->num_doodads;
+	for (i = 0; i < model->xkb->geom->num_sections; i++) {
+		XkbSectionRec *section = model->xkb->geom->sections + i;
+
+		for (j = 0; j < section->num_rows; j++)
+			n += section->rows[j].num_keys;
+		n += section->num_doodads;
+	}
+
+	return n;
+}
+
 static void
-init_keys_and_doodads (MatekbdKeyboardDrawing * drawing)
+init_keys_and_doodads (MatekbdKeyboardDrawingModel * model,
+		       Display * display)
 {
 	gint i, j, k;
 	gint x, y;
+	guint n;
+	guint8 *seen;
 
-	if (!drawing->xkb)
+	if (!model->xkb)
 		return;
 
-	for (i = 0; i < drawing->xkb->geom->num_doodads; i++) {
-		XkbDoodadRec *xkbdoodad = drawing->xkb->geom->doodads + i;
+	/* all the items share one block, sized for every key and doodad
+	 * of the geometry; keys with invalid names just leave it unused */
+	model->items =
+	    g_new0 (MatekbdKeyboardDrawingItemSlot,
+		    count_keys_and_doodads (model));
+	model->num_items = 0;
+	seen = g_new0 (guint8, model->xkb->max_key_code + 1);
+
+	for (i = 0; i < model->xkb->geom->num_doodads; i++) {
+		XkbDoodadRec *xkbdoodad = model->xkb->geom->doodads + i;
 		MatekbdKeyboardDrawingDoodad *doodad =
-		    g_new (MatekbdKeyboardDrawingDoodad, 1);
+		    &model->items[model->num_items++].doodad;
 
 		doodad->type = MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_DOODAD;
 		doodad->origin_x = 0;
@@ -1904,15 +3113,10 @@ init_keys_and_doodads (MatekbdKeyboardDrawing * drawing)
 		doodad->angle = 0;
 		doodad->priority = xkbdoodad->any.priority * 256 * 256;
 		doodad->doodad = xkbdoodad;
-
-		init_indicator_doodad (drawing, xkbdoodad, doodad);
-
-		drawing->keyboard_items =
-		    g_list_append (drawing->keyboard_items, doodad);
 	}
 
-	for (i = 0; i < drawing->xkb->geom->num_sections; i++) {
-		XkbSectionRec *section = drawing->xkb->geom->sections + i;
+	for (i = 0; i < model->xkb->geom->num_sections; i++) {
+		XkbSectionRec *section = model->xkb->geom->sections + i;
 		guint priority;
 
 #ifdef KBDRAW_DEBUG
@@ -1936,9 +3140,9 @@ init_keys_and_doodads (MatekbdKeyboardDrawing * drawing)
 				XkbKeyRec *xkbkey = row->keys + k;
 				MatekbdKeyboardDrawingKey *key;
 				XkbShapeRec *shape =
-				    drawing->xkb->geom->shapes +
+				    model->xkb->geom->shapes +
 				    xkbkey->shape_ndx;
-				guint keycode = find_keycode (drawing,
+				guint keycode = find_keycode (model,
 							      xkbkey->
 							      name.name);
 
@@ -1947,7 +3151,7 @@ init_keys_and_doodads (MatekbdKeyboardDrawing * drawing)
 #ifdef KBDRAW_DEBUG
 				printf
 				    ("    initing key %d, shape: %p(%p + %d), code: %u\n",
-				     k, shape, drawing->xkb->geom->shapes,
+				     k, shape, model->xkb->geom->shapes,
 				     xkbkey->shape_ndx, keycode);
 #endif
 				if (row->vertical)
@@ -1955,22 +3159,18 @@ init_keys_and_doodads (MatekbdKeyboardDrawing * drawing)
 				else
 					x += xkbkey->gap;
 
-				if (keycode >= drawing->xkb->min_key_code
+				key = &model->items[model->num_items++].key;
+
+				if (keycode >= model->xkb->min_key_code
 				    && keycode <=
-				    drawing->xkb->max_key_code) {
-					key = drawing->keys + keycode;
-					if (key->type ==
-					    MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_INVALID)
-					{
+				    model->xkb->max_key_code) {
+					if (!seen[keycode]) {
+						seen[keycode] = TRUE;
 						key->type =
 						    MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY;
 					} else {
 						/* duplicate key for the same keycode,
 						   already defined as MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY */
-						key =
-						    g_new0
-						    (MatekbdKeyboardDrawingKey,
-						     1);
 						key->type =
 						    MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY_EXTRA;
 					}
@@ -1978,12 +3178,9 @@ init_keys_and_doodads (MatekbdKeyboardDrawing * drawing)
 					g_warning
 					    ("key %4.4s: keycode = %u; not in range %d..%d\n",
 					     xkbkey->name.name, keycode,
-					     drawing->xkb->min_key_code,
-					     drawing->xkb->max_key_code);
+					     model->xkb->min_key_code,
+					     model->xkb->max_key_code);
 
-					key =
-					    g_new0 (MatekbdKeyboardDrawingKey,
-						    1);
 					key->type =
 					    MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY_EXTRA;
 				}
@@ -1998,10 +3195,6 @@ init_keys_and_doodads (MatekbdKeyboardDrawing * drawing)
 				key->priority = priority;
 				key->keycode = keycode;
 
-				drawing->keyboard_items =
-				    g_list_append (drawing->keyboard_items,
-						   key);
-
 				if (row->vertical)
 					y += shape->bounds.y2;
 				else
@@ -2014,7 +3207,7 @@ init_keys_and_doodads (MatekbdKeyboardDrawing * drawing)
 		for (j = 0; j < section->num_doodads; j++) {
 			XkbDoodadRec *xkbdoodad = section->doodads + j;
 			MatekbdKeyboardDrawingDoodad *doodad =
-			    g_new (MatekbdKeyboardDrawingDoodad, 1);
+			    &model->items[model->num_items++].doodad;
 
 			doodad->type =
 			    MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_DOODAD;
@@ -2024,90 +3217,348 @@ init_keys_and_doodads (MatekbdKeyboardDrawing * drawing)
 			doodad->priority =
 			    priority + xkbdoodad->any.priority;
 			doodad->doodad = xkbdoodad;
-
-			init_indicator_doodad (drawing, xkbdoodad, doodad);
-
-			drawing->keyboard_items =
-			    g_list_append (drawing->keyboard_items,
-					   doodad);
 		}
 	}
 
-	drawing->keyboard_items = g_list_sort (drawing->keyboard_items,
-					       (GCompareFunc)
-					       compare_keyboard_item_priorities);
+	g_free (seen);
+
+	/* stable, so equal priorities keep the geometry order */
+	g_qsort_with_data (model->items, model->num_items,
+			   sizeof (MatekbdKeyboardDrawingItemSlot),
+			   (GCompareDataFunc)
+			   compare_keyboard_item_priorities, NULL);
+
+	/* the items do not move any more, index them */
+	index_keys_and_indicators (model, display);
+	init_item_index (model);
 }
 
 static void
-init_colors (MatekbdKeyboardDrawing * drawing)
+init_colors (MatekbdKeyboardDrawingModel * model)
 {
 	gboolean result;
 	gint i;
 
-	if (!drawing->xkb)
+	if (!model->xkb)
 		return;
 
-	drawing->colors = g_new (GdkRGBA, drawing->xkb->geom->num_colors);
+	model->colors = g_new (GdkRGBA, model->xkb->geom->num_colors);
 
-	for (i = 0; i < drawing->xkb->geom->num_colors; i++) {
+	for (i = 0; i < model->xkb->geom->num_colors; i++) {
 		result =
-		    parse_xkb_color_spec (drawing->xkb->geom->
+		    parse_xkb_color_spec (model->xkb->geom->
 					  colors[i].spec,
-					  drawing->colors + i);
+					  model->colors + i);
 
 		if (!result)
 			g_warning
 			    ("init_colors: unable to parse color %s\n",
-			     drawing->xkb->geom->colors[i].spec);
+			     model->xkb->geom->colors[i].spec);
 	}
 }
 
 static void
-free_cdik (			/*colors doodads indicators keys */
-		  MatekbdKeyboardDrawing * drawing)
+model_free (MatekbdKeyboardDrawingModel * model)
 {
-	GList *itemp;
+	g_free (model->items);
 
-	if (!drawing->xkb)
-		return;
+	g_free (model->physical_indicators);
+	g_free (model->keys);
 
-	for (itemp = drawing->keyboard_items; itemp; itemp = itemp->next) {
-		MatekbdKeyboardDrawingItem *item = itemp->data;
+	if (model->keycode_index)
+		g_hash_table_destroy (model->keycode_index);
+	if (model->outline_paths)
+		g_hash_table_unref (model->outline_paths);
 
-		switch (item->type) {
-		case MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_INVALID:
-		case MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY:
-			break;
+	if (model->geometry_source) {
+		/* all of it belongs to the source */
+		model->xkb->geom = NULL;
+		matekbd_keyboard_drawing_model_unref
+		    (model->geometry_source);
+	} else {
+		free_item_index (model);
+		g_free (model->colors);
+	}
 
-		case MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY_EXTRA:
-		case MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_DOODAD:
-			g_free (item);
-			break;
+	XkbFreeKeyboard (model->xkb, 0, TRUE);	/* free_all = TRUE */
+	g_free (model);
+}
+
+/* lays out xkb, which the model takes over */
+static MatekbdKeyboardDrawingModel *
+model_new_for_xkb (Display * display, XkbDescRec * xkb)
+{
+	MatekbdKeyboardDrawingModel *model;
+	gint64 start;
+
+	model = g_new0 (MatekbdKeyboardDrawingModel, 1);
+	model->ref_count = 1;
+	model->xkb = xkb;
+	model->l3mod = XkbKeysymToModifiers (display,
+					     GDK_KEY_ISO_Level3_Shift);
+
+	/* indexed by indicator, whatever the mask of physical ones says */
+	model->physical_indicators_size = XkbNumIndicators;
+	model->physical_indicators =
+	    g_new0 (MatekbdKeyboardDrawingDoodad *,
+		    model->physical_indicators_size);
+	model->keys =
+	    g_new0 (MatekbdKeyboardDrawingKey *,
+		    model->xkb->max_key_code + 1);
+
+	init_keycode_index (model);
+	init_outline_paths (model);
+	start = matekbd_counters_phase_begin ();
+	init_keys_and_doodads (model, display);
+	matekbd_counters_phase_end (MATEKBD_PHASE_INIT_KEYS_AND_DOODADS,
+				    start);
+
+	start = matekbd_counters_phase_begin ();
+	init_colors (model);
+	matekbd_counters_phase_end (MATEKBD_PHASE_INIT_COLORS, start);
+
+	return model;
+}
+
+/* Lays out xkb, which has no geometry of its own, with the geometry of
+ * source: the items are copied for their own indicator states and
+ * indexed again for the new names, everything else derived
+ * from the geometry alone is shared */
+static MatekbdKeyboardDrawingModel *
+model_new_sharing_geometry (Display * display, XkbDescRec * xkb,
+			    MatekbdKeyboardDrawingModel * source)
+{
+	MatekbdKeyboardDrawingModel *model;
+
+	if (source->geometry_source)
+		source = source->geometry_source;
+
+	model = g_new0 (MatekbdKeyboardDrawingModel, 1);
+	model->ref_count = 1;
+	model->geometry_source =
+	    matekbd_keyboard_drawing_model_ref (source);
+	model->xkb = xkb;
+	model->xkb->geom = source->xkb->geom;
+	model->l3mod = XkbKeysymToModifiers (display,
+					     GDK_KEY_ISO_Level3_Shift);
+
+	/* indexed by indicator, whatever the mask of physical ones says */
+	model->physical_indicators_size = XkbNumIndicators;
+	model->physical_indicators =
+	    g_new0 (MatekbdKeyboardDrawingDoodad *,
+		    model->physical_indicators_size);
+	model->keys =
+	    g_new0 (MatekbdKeyboardDrawingKey *,
+		    model->xkb->max_key_code + 1);
+
+	init_keycode_index (model);
+	model->outline_paths = g_hash_table_ref (source->outline_paths);
+
+	model->num_items = source->num_items;
+	model->items =
+	    g_new (MatekbdKeyboardDrawingItemSlot, MAX (source->num_items, 1));
+	memcpy (model->items, source->items,
+		source->num_items * sizeof (MatekbdKeyboardDrawingItemSlot));
+	index_keys_and_indicators (model, display);
+
+	model->item_bounds = source->item_bounds;
+	model->grid_area = source->grid_area;
+	model->grid_cell_size = source->grid_cell_size;
+	model->grid_cols = source->grid_cols;
+	model->grid_rows = source->grid_rows;
+	model->grid_cells = source->grid_cells;
+	model->grid_items = source->grid_items;
+
+	model->colors = source->colors;
+
+	return model;
+}
+
+/* Loads the keyboard of the display.  Its geometry is only fetched and
+ * laid out when it is not the one of previous: switching layouts changes
+ * the symbols and names alone. */
+static MatekbdKeyboardDrawingModel *
+model_reload (Display * display, MatekbdKeyboardDrawingModel * previous)
+{
+	XkbDescRec *xkb;
+	XkbNamesRec *names;
+
+	matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS, 2);
+	xkb = XkbGetKeyboard (display,
+			      XkbGBN_KeyNamesMask |
+			      XkbGBN_OtherNamesMask |
+			      XkbGBN_SymbolsMask |
+			      XkbGBN_IndicatorMapMask, XkbUseCoreKbd);
+	if (xkb == NULL)
+		return NULL;
+	XkbGetNames (display, XkbAllNamesMask, xkb);
+	names = xkb->names;
+
+	/* the items hold keycodes, so the keycodes have to match too */
+	if (previous != NULL && names != NULL
+	    && names->geometry != None
+	    && names->geometry == previous->xkb->names->geometry
+	    && names->keycodes == previous->xkb->names->keycodes
+	    && xkb->min_key_code == previous->xkb->min_key_code
+	    && xkb->max_key_code == previous->xkb->max_key_code) {
+#ifdef KBDRAW_DEBUG
+		printf ("same geometry and keycodes, symbols reloaded\n");
+#endif
+		return model_new_sharing_geometry (display, xkb, previous);
+	}
+
+	matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS, 1);
+	if (XkbGetGeometry (display, xkb) != Success || xkb->geom == NULL) {
+		XkbFreeKeyboard (xkb, 0, TRUE);
+		return NULL;
+	}
+
+	return model_new_for_xkb (display, xkb);
+}
+
+/**
+ * matekbd_keyboard_drawing_model_new: (skip)
+ * @display: the X display to load the keyboard description from
+ * @names:   the XKB components to load, or %NULL for the keyboard of
+ *           @display
+ *
+ * Loads a keyboard description and lays it out for drawing.  The model
+ * does not refer to @display afterwards and does not change, so it can
+ * be rendered from any thread with matekbd_keyboard_drawing_model_render().
+ * That is not true of the model a #MatekbdKeyboardDrawing shows, whose
+ * indicator states the widget updates on the main thread.
+ *
+ * Returns: a new model, or %NULL if the keyboard could not be loaded
+ */
+MatekbdKeyboardDrawingModel *
+matekbd_keyboard_drawing_model_new (Display * display,
+				    XkbComponentNamesRec * names)
+{
+	XkbDescRec *xkb;
+
+	if (names) {
+		/* spares the server compiling the same keymap again */
+		xkb = matekbd_keyboard_drawing_cache_load (display, names);
+		if (xkb == NULL) {
+			matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS,
+					      1);
+			xkb = XkbGetKeyboardByName (display, XkbUseCoreKbd,
+						    names, 0,
+						    XkbGBN_GeometryMask |
+						    XkbGBN_KeyNamesMask |
+						    XkbGBN_OtherNamesMask |
+						    XkbGBN_ClientSymbolsMask |
+						    XkbGBN_IndicatorMapMask,
+						    FALSE);
+			if (xkb)
+				matekbd_keyboard_drawing_cache_save (display,
+								     names,
+								     xkb);
+		}
+	} else {
+		/* XXX: XkbClientMapMask | XkbIndicatorMapMask | XkbNamesMask | XkbGeometryMask */
+		xkb = XkbGetKeyboard (display,
+				      XkbGBN_GeometryMask |
+				      XkbGBN_KeyNamesMask |
+				      XkbGBN_OtherNamesMask |
+				      XkbGBN_SymbolsMask |
+				      XkbGBN_IndicatorMapMask,
+				      XkbUseCoreKbd);
+		matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS, 1);
+		if (xkb) {
+			XkbGetNames (display, XkbAllNamesMask, xkb);
+			matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS,
+					      1);
 		}
 	}
 
-	g_list_free (drawing->keyboard_items);
-	drawing->keyboard_items = NULL;
+	if (!xkb)
+		return NULL;
+
+	return model_new_for_xkb (display, xkb);
+}
+
+/**
+ * matekbd_keyboard_drawing_model_ref: (skip)
+ */
+MatekbdKeyboardDrawingModel *
+matekbd_keyboard_drawing_model_ref (MatekbdKeyboardDrawingModel * model)
+{
+	g_atomic_int_inc (&model->ref_count);
+	return model;
+}
+
+/**
+ * matekbd_keyboard_drawing_model_unref: (skip)
+ */
+void
+matekbd_keyboard_drawing_model_unref (MatekbdKeyboardDrawingModel * model)
+{
+	if (g_atomic_int_dec_and_test (&model->ref_count))
+		model_free (model);
+}
+
+G_DEFINE_BOXED_TYPE (MatekbdKeyboardDrawingModel,
+		     matekbd_keyboard_drawing_model,
+		     matekbd_keyboard_drawing_model_ref,
+		     matekbd_keyboard_drawing_model_unref);
+
+static void
+init_indicators_state (MatekbdKeyboardDrawing * drawing)
+{
+	MatekbdKeyboardDrawingModel *model = drawing->model;
+	unsigned int state = 0;
+	gint i;
+
+	/* one round trip for all of them, IndicatorStateNotify keeps them
+	 * current afterwards.  Trying to obtain the real state, but if fail
+	 * - just assume OFF */
+	matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS, 1);
+	if (XkbGetIndicatorState (drawing->display, XkbUseCoreKbd, &state) !=
+	    Success)
+		state = 0;
+
+	for (i = 0; i < model->physical_indicators_size; i++) {
+		MatekbdKeyboardDrawingDoodad *doodad =
+		    model->physical_indicators[i];
+
+		if (doodad != NULL)
+			doodad->on = (state & 1U << i) != 0;
+	}
+}
+
+static void
+select_indicator_events (MatekbdKeyboardDrawing * drawing)
+{
+	MatekbdKeyboardDrawingModel *model = drawing->model;
 
-	g_free (drawing->physical_indicators);
-	g_free (drawing->keys);
-	g_free (drawing->colors);
+	XkbSelectEventDetails (drawing->display, XkbUseCoreKbd,
+			       XkbIndicatorStateNotify,
+			       model->xkb->indicators->phys_indicators,
+			       model->xkb->indicators->phys_indicators);
 }
 
+/* takes over model, which may be NULL */
 static void
-alloc_cdik (MatekbdKeyboardDrawing * drawing)
+set_model (MatekbdKeyboardDrawing * drawing,
+	   MatekbdKeyboardDrawingModel * model)
 {
-	if (!drawing->xkb)
+	if (drawing->model)
+		matekbd_keyboard_drawing_model_unref (drawing->model);
+	drawing->model = model;
+	drop_labels_list (drawing);
+	/* the keycodes may mean other keys now */
+	memset (drawing->pressed_keys, 0, sizeof (drawing->pressed_keys));
+	/* keyed by the outlines of the model */
+	if (drawing->renderContext != NULL)
+		g_hash_table_remove_all (drawing->renderContext->keycaps);
+
+	if (model == NULL)
 		return;
 
-	drawing->physical_indicators_size =
-	    drawing->xkb->indicators->phys_indicators + 1;
-	drawing->physical_indicators =
-	    g_new0 (MatekbdKeyboardDrawingDoodad *,
-		    drawing->physical_indicators_size);
-	drawing->keys =
-	    g_new0 (MatekbdKeyboardDrawingKey,
-		    drawing->xkb->max_key_code + 1);
+	if (drawing->xkb_events & XKB_EVENT (XkbIndicatorStateNotify))
+		select_indicator_events (drawing);
+	init_indicators_state (drawing);
 }
 
 static void
@@ -2118,135 +3569,302 @@ process_indicators_state_notify (XkbIndicatorNotifyEvent * iev,
 	   NOT really taken from the screen */
 	gint i;
 
-	for (i = 0; i <= drawing->xkb->indicators->phys_indicators; i++)
-		if (drawing->physical_indicators[i] != NULL
-		    && (iev->changed & 1 << i)) {
-			gint state = (iev->state & 1 << i) != FALSE;
+	for (i = 0; i < drawing->model->physical_indicators_size; i++)
+		if (drawing->model->physical_indicators[i] != NULL
+		    && (iev->changed & 1U << i)) {
+			gint state = (iev->state & 1U << i) != FALSE;
 
-			if ((state && !drawing->physical_indicators[i]->on)
+			if ((state && !drawing->model->physical_indicators[i]->on)
 			    || (!state
-				&& drawing->physical_indicators[i]->on)) {
-				drawing->physical_indicators[i]->on =
+				&& drawing->model->physical_indicators[i]->on)) {
+				drawing->model->physical_indicators[i]->on =
 				    state;
-				if (create_cairo (drawing)) {
-					draw_doodad
-					    (drawing->renderContext,
-					     drawing,
-					     drawing->physical_indicators
-					     [i]);
-					destroy_cairo (drawing);
-				}
-				invalidate_indicator_doodad_region
-				    (drawing,
-				     drawing->physical_indicators[i]);
+				damage_item_region
+				    (drawing, (MatekbdKeyboardDrawingItem *)
+				     drawing->model->physical_indicators[i]);
 			}
 		}
 }
 
-static GdkFilterReturn
-xkb_state_notify_event_filter (GdkXEvent * gdkxev,
-			       GdkEvent * event,
-			       MatekbdKeyboardDrawing * drawing)
+static void
+process_xkb_event (XkbEvent * kev, MatekbdKeyboardDrawing * drawing)
 {
 #define modifier_change_mask (XkbModifierStateMask | XkbModifierBaseMask | XkbModifierLatchMask | XkbModifierLockMask)
 
-	if (!drawing->xkb)
+	if (!drawing->model)
+		return;
+
+	switch (kev->any.xkb_type) {
+	case XkbStateNotify:
+		if (((kev->state.changed & modifier_change_mask) &&
+		     drawing->track_modifiers))
+			matekbd_keyboard_drawing_set_mods (drawing,
+							kev->state.compat_state);
+		break;
+
+	case XkbIndicatorStateNotify:
+		process_indicators_state_notify (&kev->indicators, drawing);
+		break;
+
+	case XkbIndicatorMapNotify:
+	case XkbControlsNotify:
+	case XkbNamesNotify:
+	case XkbNewKeyboardNotify:
+		{
+			XkbStateRec state;
+			memset (&state, 0, sizeof (state));
+			matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS, 1);
+			XkbGetState (drawing->display, XkbUseCoreKbd, &state);
+			if (drawing->track_modifiers)
+				matekbd_keyboard_drawing_set_mods
+				    (drawing, state.compat_state);
+			if (drawing->track_config)
+				matekbd_keyboard_drawing_set_keyboard
+				    (drawing, NULL);
+		}
+		break;
+	}
+}
+
+/* XKB events are delivered by a single filter shared by all the widgets,
+ * to the ones listening for the type of the event */
+static GSList *xkb_listeners[XkbNumberEvents];
+static guint xkb_selected_events;
+static gint xkb_event_base = -1;
+
+static GdkFilterReturn
+xkb_event_filter (GdkXEvent * gdkxev, GdkEvent * event, gpointer data)
+{
+	XkbEvent *kev = (XkbEvent *) gdkxev;
+	GSList *l, *next;
+#ifdef KBDRAW_DEBUG
+	unsigned long request;
+#endif
+
+	if (kev->type != xkb_event_base ||
+	    kev->any.xkb_type >= XkbNumberEvents)
 		return GDK_FILTER_CONTINUE;
 
-	if (((XEvent *) gdkxev)->type == drawing->xkb_event_type) {
-		XkbEvent *kev = (XkbEvent *) gdkxev;
-		GtkAllocation allocation;
-		switch (kev->any.xkb_type) {
-		case XkbStateNotify:
-			if (((kev->state.changed & modifier_change_mask) &&
-			     drawing->track_modifiers)) {
-				free_cdik (drawing);
-				if (drawing->track_modifiers)
-					matekbd_keyboard_drawing_set_mods
-					    (drawing,
-					     kev->state.compat_state);
-				drawing->keys =
-				    g_new0 (MatekbdKeyboardDrawingKey,
-					    drawing->xkb->max_key_code +
-					    1);
-
-				gtk_widget_get_allocation (GTK_WIDGET
-							   (drawing),
-							   &allocation);
-				size_allocate (GTK_WIDGET (drawing),
-					       &allocation, drawing);
-
-				init_keys_and_doodads (drawing);
-				init_colors (drawing);
-			}
-			break;
+#ifdef KBDRAW_DEBUG
+	request = NextRequest (kev->any.display);
+#endif
+	/* a listener may stop listening while being dispatched to */
+	for (l = xkb_listeners[kev->any.xkb_type]; l != NULL; l = next) {
+		next = l->next;
+		process_xkb_event (kev, l->data);
+	}
+#ifdef KBDRAW_DEBUG
+	/* state and indicator changes are to be handled without
+	 * talking to the server */
+	printf ("xkb event %d: %lu X requests\n", kev->any.xkb_type,
+		NextRequest (kev->any.display) - request);
+#endif
 
-		case XkbIndicatorStateNotify:
-			{
-				process_indicators_state_notify (&
-								 ((XkbEvent
-								   *)
-								  gdkxev)->indicators,
-drawing);
-			}
-			break;
+	return GDK_FILTER_CONTINUE;
+}
+
+/* the XKB events the widget has to be told about in its current state */
+static guint
+wanted_xkb_events (MatekbdKeyboardDrawing * drawing)
+{
+	guint events = 0;
+
+	if (gtk_widget_in_destruction (GTK_WIDGET (drawing)))
+		return 0;
+	if (gtk_widget_get_mapped (GTK_WIDGET (drawing)))
+		events |= XKB_EVENT (XkbIndicatorStateNotify);
+	if (drawing->track_modifiers)
+		events |= XKB_EVENT (XkbStateNotify);
+	if (drawing->track_modifiers || drawing->track_config)
+		events |= XKB_EVENT (XkbIndicatorMapNotify) |
+		    XKB_EVENT (XkbControlsNotify) |
+		    XKB_EVENT (XkbNamesNotify) |
+		    XKB_EVENT (XkbNewKeyboardNotify);
+
+	return events;
+}
+
+/* Events once selected stay selected: the connection is shared with GDK
+ * and libxklavier, which may be relying on them as well.  The indicator
+ * state notifications are selected per model, for its physical
+ * indicators only */
+static void
+select_xkb_events (MatekbdKeyboardDrawing * drawing, guint events)
+{
+	guint mask;
+
+	events &= ~(xkb_selected_events |
+		    XKB_EVENT (XkbIndicatorStateNotify));
+	if (events == 0)
+		return;
+
+	XkbSelectEvents (drawing->display, XkbUseCoreKbd, events, events);
+
+	if (events & XKB_EVENT (XkbStateNotify)) {
+		mask = XkbGroupStateMask | XkbModifierStateMask;
+		XkbSelectEventDetails (drawing->display, XkbUseCoreKbd,
+				       XkbStateNotify, mask, mask);
+	}
+	if (events & XKB_EVENT (XkbNamesNotify)) {
+		mask = (XkbGroupNamesMask | XkbIndicatorNamesMask);
+		XkbSelectEventDetails (drawing->display, XkbUseCoreKbd,
+				       XkbNamesNotify, mask, mask);
+	}
+
+	xkb_selected_events |= events;
+}
+
+/* makes the widget listen for exactly the given XKB events */
+static void
+listen_xkb_events (MatekbdKeyboardDrawing * drawing, guint events)
+{
+	gboolean had_listeners = FALSE, has_listeners = FALSE;
+	guint started = events & ~drawing->xkb_events;
+	gint type;
+
+	if (events == drawing->xkb_events)
+		return;
 
-		case XkbIndicatorMapNotify:
-		case XkbControlsNotify:
-		case XkbNamesNotify:
-		case XkbNewKeyboardNotify:
-			{
-				XkbStateRec state;
-				memset (&state, 0, sizeof (state));
-				XkbGetState (drawing->display,
-					     XkbUseCoreKbd, &state);
-				if (drawing->track_modifiers)
-					matekbd_keyboard_drawing_set_mods
-					    (drawing, state.compat_state);
-				if (drawing->track_config)
-					matekbd_keyboard_drawing_set_keyboard
-					    (drawing, NULL);
-			}
-			break;
+	select_xkb_events (drawing, events);
+
+	for (type = 0; type < XkbNumberEvents; type++) {
+		had_listeners |= xkb_listeners[type] != NULL;
+		if ((drawing->xkb_events ^ events) & XKB_EVENT (type)) {
+			if (events & XKB_EVENT (type))
+				xkb_listeners[type] =
+				    g_slist_prepend (xkb_listeners[type],
+						     drawing);
+			else
+				xkb_listeners[type] =
+				    g_slist_remove (xkb_listeners[type],
+						    drawing);
 		}
+		has_listeners |= xkb_listeners[type] != NULL;
 	}
+	drawing->xkb_events = events;
+
+	if (has_listeners && !had_listeners) {
+		xkb_event_base = drawing->xkb_event_type;
+		gdk_window_add_filter (NULL, xkb_event_filter, NULL);
+	} else if (had_listeners && !has_listeners)
+		gdk_window_remove_filter (NULL, xkb_event_filter, NULL);
+
+	/* catch up with what happened while nobody was listening */
+	if ((started & XKB_EVENT (XkbIndicatorStateNotify)) &&
+	    drawing->model != NULL) {
+		XkbIndicatorNotifyEvent ev;
+
+		memset (&ev, 0, sizeof (ev));
+		ev.changed = ~0U;
+		matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS, 1);
+		XkbGetIndicatorState (drawing->display, XkbUseCoreKbd,
+				      &ev.state);
+		select_indicator_events (drawing);
+		process_indicators_state_notify (&ev, drawing);
+	}
+}
 
-	return GDK_FILTER_CONTINUE;
+static void
+update_xkb_listening (MatekbdKeyboardDrawing * drawing)
+{
+	listen_xkb_events (drawing, wanted_xkb_events (drawing));
+}
+
+static gboolean
+is_hidden_label_surface (gpointer mods, cairo_surface_t * surface,
+			 MatekbdKeyboardDrawing * drawing)
+{
+	return surface != drawing->label_surface;
+}
+
+/* a hidden widget keeps only the layers it shows when mapped again */
+static void
+unmapped (MatekbdKeyboardDrawing * drawing)
+{
+	update_xkb_listening (drawing);
+
+	g_hash_table_foreach_remove (drawing->label_surfaces,
+				     (GHRFunc) is_hidden_label_surface,
+				     drawing);
+	free_spare_surfaces (drawing);
 }
 
 static void
 destroy (MatekbdKeyboardDrawing * drawing)
 {
 	free_render_context (drawing);
-	gdk_window_remove_filter (NULL, (GdkFilterFunc)
-				  xkb_state_notify_event_filter, drawing);
+	listen_xkb_events (drawing, 0);
 	if (drawing->timeout > 0) {
 		g_source_remove (drawing->timeout);
 		drawing->timeout = 0;
 	}
-	if (drawing->idle_redraw > 0) {
-		g_source_remove (drawing->idle_redraw);
-		drawing->idle_redraw = 0;
+	if (drawing->redraw_tick > 0) {
+		gtk_widget_remove_tick_callback (GTK_WIDGET (drawing),
+						 drawing->redraw_tick);
+		drawing->redraw_tick = 0;
 	}
 
-	if (drawing->surface != NULL) {
-		cairo_surface_destroy (drawing->surface);
+	free_surface (drawing);
+	free_spare_surfaces (drawing);
+	g_hash_table_destroy (drawing->label_surfaces);
+	drawing->label_surface = NULL;
+	cairo_region_destroy (drawing->damage);
+	drawing->damage = NULL;
+
+	/* a pending load still holds a reference, it must not swap in */
+	drawing->load_task = NULL;
+	set_model (drawing, NULL);
+
+	if (drawing->font_desc != NULL) {
+		pango_font_description_free (drawing->font_desc);
+		drawing->font_desc = NULL;
 	}
 
-	free_cdik (drawing);
+	disconnect_latency_clock (drawing);
+	if (drawing->latency_traces != NULL) {
+		g_array_free (drawing->latency_traces, TRUE);
+		drawing->latency_traces = NULL;
+	}
+}
+
+static void
+render_context_style_changed (MatekbdKeyboardDrawingRenderContext * context,
+			      PangoFontDescription * font_desc)
+{
+	pango_layout_context_changed (context->layout);
+	g_hash_table_remove_all (context->label_layouts);
+	/* the outline color may have changed */
+	if (context->keycaps != NULL)
+		g_hash_table_remove_all (context->keycaps);
+
+	if (font_desc != NULL) {
+		pango_font_description_free (context->font_desc);
+		context->font_desc = pango_font_description_copy (font_desc);
+	}
 }
 
 static void
 style_changed (MatekbdKeyboardDrawing * drawing)
 {
-	pango_layout_context_changed (drawing->renderContext->layout);
+	PangoFontDescription *font_desc = NULL;
+
+	if (update_style (drawing)) {
+		font_desc = drawing->font_desc;
+		drop_labels_list (drawing);
+	}
+	render_context_style_changed (drawing->renderContext, font_desc);
+	render_context_style_changed (drawing->listContext, font_desc);
+
+	/* the layers were painted with the old colors and font */
+	if (font_desc != NULL
+	    && gtk_widget_get_realized (GTK_WIDGET (drawing)))
+		relayout (drawing, FALSE);
 }
 
 static void
 matekbd_keyboard_drawing_init (MatekbdKeyboardDrawing * drawing)
 {
 	gint opcode = 0, error = 0, major = 1, minor = 0;
-	gint mask;
 
 	drawing->display = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
 
@@ -2271,52 +3889,27 @@ matekbd_keyboard_drawing_init (MatekbdKeyboardDrawing * drawing)
 		    gdk_x11_screen_get_screen_number (gdk_screen_get_default ());
 
 	drawing->surface = NULL;
+	drawing->label_surfaces =
+	    g_hash_table_new_full (NULL, NULL, NULL,
+				   (GDestroyNotify) cairo_surface_destroy);
+	drawing->damage = cairo_region_create ();
+	update_style (drawing);
 	alloc_render_context (drawing);
 
-	drawing->keyboard_items = NULL;
-	drawing->colors = NULL;
+	drawing->model = NULL;
 
 	drawing->track_modifiers = 0;
 	drawing->track_config = 0;
+	drawing->trace_latency = 0;
+	drawing->latency_traces =
+	    g_array_new (FALSE, FALSE, sizeof (LatencyTrace));
 
-	/* XXX: XkbClientMapMask | XkbIndicatorMapMask | XkbNamesMask | XkbGeometryMask */
-	drawing->xkb = XkbGetKeyboard (drawing->display,
-				       XkbGBN_GeometryMask |
-				       XkbGBN_KeyNamesMask |
-				       XkbGBN_OtherNamesMask |
-				       XkbGBN_SymbolsMask |
-				       XkbGBN_IndicatorMapMask,
-				       XkbUseCoreKbd);
-	if (drawing->xkb) {
-		XkbGetNames (drawing->display, XkbAllNamesMask, drawing->xkb);
-		XkbSelectEventDetails (drawing->display, XkbUseCoreKbd,
-				       XkbIndicatorStateNotify,
-				       drawing->xkb->indicators->phys_indicators,
-				       drawing->xkb->indicators->phys_indicators);
-	}
-
-	drawing->l3mod = XkbKeysymToModifiers (drawing->display,
-					       GDK_KEY_ISO_Level3_Shift);
-
+	set_model (drawing,
+		   matekbd_keyboard_drawing_model_new (drawing->display, NULL));
 	drawing->xkbOnDisplay = TRUE;
 
-	alloc_cdik (drawing);
-
-	mask =
-	    (XkbStateNotifyMask | XkbNamesNotifyMask |
-	     XkbControlsNotifyMask | XkbIndicatorMapNotifyMask |
-	     XkbNewKeyboardNotifyMask);
-	XkbSelectEvents (drawing->display, XkbUseCoreKbd, mask, mask);
-
-	mask = XkbGroupStateMask | XkbModifierStateMask;
-	XkbSelectEventDetails (drawing->display, XkbUseCoreKbd,
-			       XkbStateNotify, mask, mask);
-
-	mask = (XkbGroupNamesMask | XkbIndicatorNamesMask);
-	XkbSelectEventDetails (drawing->display, XkbUseCoreKbd,
-			       XkbNamesNotify, mask, mask);
-	init_keys_and_doodads (drawing);
-	init_colors (drawing);
+	/* the XKB events are listened for once mapped or tracking */
+	drawing->xkb_events = 0;
 
 	/* required to get key events */
 	gtk_widget_set_can_focus (GTK_WIDGET (drawing), TRUE);
@@ -2341,11 +3934,12 @@ matekbd_keyboard_drawing_init (MatekbdKeyboardDrawing * drawing)
 			  G_CALLBACK (size_allocate), drawing);
 	g_signal_connect (G_OBJECT (drawing), "destroy",
 			  G_CALLBACK (destroy), drawing);
-	g_signal_connect (G_OBJECT (drawing), "style-set",
+	g_signal_connect (G_OBJECT (drawing), "style-updated",
 			  G_CALLBACK (style_changed), drawing);
-
-	gdk_window_add_filter (NULL, (GdkFilterFunc)
-			       xkb_state_notify_event_filter, drawing);
+	g_signal_connect (G_OBJECT (drawing), "map",
+			  G_CALLBACK (update_xkb_listening), NULL);
+	g_signal_connect_after (G_OBJECT (drawing), "unmap",
+				G_CALLBACK (unmapped), NULL);
 }
 
 GtkWidget *
@@ -2363,6 +3957,7 @@ matekbd_keyboard_drawing_class_init (MatekbdKeyboardDrawingClass * klass)
 	gtk_widget_class_set_css_name (widget_class, "matekbd-keyboard-drawing");
 
 	klass->bad_keycode = NULL;
+	klass->key_latency = NULL;
 
 	matekbd_keyboard_drawing_signals[BAD_KEYCODE] =
 	    g_signal_new ("bad-keycode", matekbd_keyboard_drawing_get_type (),
@@ -2371,6 +3966,15 @@ matekbd_keyboard_drawing_class_init (MatekbdKeyboardDrawingClass * klass)
 					   bad_keycode), NULL, NULL,
 			  matekbd_keyboard_drawing_VOID__UINT, G_TYPE_NONE, 1,
 			  G_TYPE_UINT);
+
+	matekbd_keyboard_drawing_signals[KEY_LATENCY] =
+	    g_signal_new ("key-latency", matekbd_keyboard_drawing_get_type (),
+			  G_SIGNAL_RUN_FIRST,
+			  G_STRUCT_OFFSET (MatekbdKeyboardDrawingClass,
+					   key_latency), NULL, NULL,
+			  matekbd_keyboard_drawing_VOID__UINT_INT64_INT64,
+			  G_TYPE_NONE, 3, G_TYPE_UINT, G_TYPE_INT64,
+			  G_TYPE_INT64);
 }
 
 GType
@@ -2402,16 +4006,176 @@ matekbd_keyboard_drawing_get_type (void)
 	return matekbd_keyboard_drawing_type;
 }
 
+static gboolean
+key_labels_differ (MatekbdKeyboardDrawing * drawing, guint keycode,
+		   guint old_mods, guint new_mods)
+{
+	gint glp;
+
+	for (glp = MATEKBD_KEYBOARD_DRAWING_POS_TOPLEFT;
+	     glp < MATEKBD_KEYBOARD_DRAWING_POS_TOTAL; glp++)
+		if (get_key_glp_keysym (drawing->renderContext, drawing->model,
+					keycode, glp, old_mods) !=
+		    get_key_glp_keysym (drawing->renderContext, drawing->model,
+					keycode, glp, new_mods))
+			return TRUE;
+
+	return FALSE;
+}
+
+/* build the label layer for the current mods out of the one for old_mods,
+ * repainting only the keys whose labels change; the keycaps are kept */
+static void
+repaint_keys_for_mods (MatekbdKeyboardDrawing * drawing, guint old_mods)
+{
+	MatekbdKeyboardDrawingRenderContext *context = drawing->renderContext;
+	cairo_surface_t *surface;
+	cairo_region_t *changed;
+	gdouble scale;
+	guint i;
+
+	drawing->mods_repaint_count = 0;
+
+	if (!drawing->model || !drawing->track_modifiers)
+		return;
+
+	/* the pending full redraw will pick the new mods up */
+	if (drawing->surface == NULL || drawing->redraw_tick)
+		return;
+
+	surface = g_hash_table_lookup (drawing->label_surfaces,
+				       GUINT_TO_POINTER (drawing->mods));
+	if (surface != NULL || drawing->label_surface == NULL) {
+		update_label_surface (drawing);
+		gtk_widget_queue_draw (GTK_WIDGET (drawing));
+		return;
+	}
+
+	/* the labels for the new mods are recorded whole, mostly out of
+	 * the label layouts shaped before, and replayed over the changed
+	 * cells, so that the layer holds labels laid out one way only */
+	record_labels_list (drawing, G_MAXINT64, NULL);
+
+	surface = create_layer_surface (drawing, CAIRO_CONTENT_COLOR_ALPHA);
+	if (!create_cairo (drawing, surface)) {
+		cairo_surface_destroy (surface);
+		return;
+	}
+
+	cairo_set_source_surface (context->cr, drawing->label_surface, 0, 0);
+	cairo_set_operator (context->cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint (context->cr);
+	destroy_cairo (drawing);
+
+	scale = (gdouble) context->scale_numerator /
+	    context->scale_denominator;
+	changed = cairo_region_create ();
+	for (i = 0; i < drawing->model->num_items; i++) {
+		MatekbdKeyboardDrawingKey *key = &drawing->model->items[i].key;
+		GdkRectangle clip;
+
+		if (key->type != MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY &&
+		    key->type != MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_KEY_EXTRA)
+			continue;
+
+		if (!key_labels_differ (drawing, key->keycode, old_mods,
+					drawing->mods))
+			continue;
+
+		/* the cell in xkb units, widened to whole pixels */
+		get_key_label_clip (drawing->listContext, drawing->model,
+				    key, &clip);
+		clip.width = ceil ((clip.x + clip.width) * scale) + 1;
+		clip.height = ceil ((clip.y + clip.height) * scale) + 1;
+		clip.x = floor (clip.x * scale) - 1;
+		clip.y = floor (clip.y * scale) - 1;
+		clip.width -= clip.x;
+		clip.height -= clip.y;
+		cairo_region_union_rectangle (changed, &clip);
+		invalidate_key_region (drawing, key);
+		drawing->mods_repaint_count++;
+	}
+
+	replay_labels (drawing, surface, drawing->labels_list, changed,
+		       TRUE);
+	cairo_region_destroy (changed);
+
+	add_label_surface (drawing, surface);
+
+#ifdef KBDRAW_DEBUG
+	printf ("mods %u -> %u: repainted %u keys\n", old_mods,
+		drawing->mods, drawing->mods_repaint_count);
+#endif
+}
+
 void
 matekbd_keyboard_drawing_set_mods (MatekbdKeyboardDrawing * drawing, guint mods)
 {
+	guint old_mods;
+
 #ifdef KBDRAW_DEBUG
 	printf ("set_mods: %d\n", mods);
 #endif
 	if (mods != drawing->mods) {
+		old_mods = drawing->mods;
 		drawing->mods = mods;
-		gtk_widget_queue_draw (GTK_WIDGET (drawing));
+		repaint_keys_for_mods (drawing, old_mods);
+	}
+}
+
+/* fd gets resized for the scale */
+static gboolean
+render_model (MatekbdKeyboardDrawingModel * model,
+	      cairo_t * cr,
+	      PangoLayout * layout,
+	      PangoFontDescription * fd,
+	      const MatekbdKeyboardDrawingPalette * palette,
+	      MatekbdKeyboardDrawingGroupLevel ** groupLevels,
+	      guint mods, gboolean track_modifiers,
+	      const guint8 * pressed_keys,
+	      double x, double y,
+	      double width, double height, double dpi_x, double dpi_y)
+{
+	MatekbdKeyboardDrawingRenderContext context = {
+		cr,
+		0,
+		layout,
+		fd,
+		1, 1,
+		*palette,
+		NULL,
+		groupLevels,
+		mods,
+		track_modifiers,
+		NULL,
+		pressed_keys
+	};
+	gint64 start;
+
+	if (!context_setup_scaling (&context, model, width, height,
+	                            dpi_x, dpi_y))
+		return FALSE;
+
+	start = matekbd_counters_phase_begin ();
+	matekbd_counters_add (MATEKBD_COUNTER_FULL_REDRAWS, 1);
+	context.label_layouts = label_layouts_new ();
+
+	cairo_save (cr);
+	cairo_translate (cr, x, y);
+
+	if (palette->background.alpha > 0) {
+		cairo_rectangle (cr, 0, 0, width, height);
+		gdk_cairo_set_source_rgba (cr, &palette->background);
+		cairo_fill (cr);
 	}
+
+	draw_keyboard_to_context (&context, model);
+
+	cairo_restore (cr);
+	g_hash_table_destroy (context.label_layouts);
+
+	matekbd_counters_phase_end (MATEKBD_PHASE_DRAW_KEYBOARD, start);
+	return TRUE;
 }
 
 /**
@@ -2438,47 +4202,116 @@ matekbd_keyboard_drawing_render (MatekbdKeyboardDrawing * kbdrawing,
 			      double width, double height,
 			      double dpi_x, double dpi_y)
 {
-	GtkStyleContext *style_context =
-	    gtk_widget_get_style_context (GTK_WIDGET (kbdrawing));
-	GdkRGBA dark_color;
+	MatekbdKeyboardDrawingPalette palette;
 	PangoFontDescription *fd;
+	gboolean result;
 
-	gtk_style_context_get_background_color (style_context,
-	                                        gtk_style_context_get_state (style_context),
-	                                        &dark_color);
-	/* make dark background by making regular background darker */
-	dark_color.red *= 0.7;
-	dark_color.green *= 0.7;
-	dark_color.blue *= 0.7;
+	if (!kbdrawing->model)
+		return FALSE;
 
-	gtk_style_context_get (style_context,
-	                       gtk_style_context_get_state (style_context),
-	                       GTK_STYLE_PROPERTY_FONT, &fd,
-	                       NULL);
+	palette = kbdrawing->palette;
+	/* the caller paints the background */
+	palette.background.alpha = 0;
 
-	MatekbdKeyboardDrawingRenderContext context = {
-		cr,
-		kbdrawing->renderContext->angle,
-		layout,
-		fd,
-		1, 1,
-		dark_color
-	};
+	/* gets resized for the scale */
+	fd = pango_font_description_copy (kbdrawing->font_desc);
 
-	if (!context_setup_scaling (&context, kbdrawing, width, height,
-	                            dpi_x, dpi_y))
-	{
-		pango_font_description_free (fd);
-		return FALSE;
-	}
+	result = render_model (kbdrawing->model, cr, layout, fd, &palette,
+			       kbdrawing->groupLevels, kbdrawing->mods,
+			       kbdrawing->track_modifiers,
+			       kbdrawing->pressed_keys, x, y, width, height,
+			       dpi_x, dpi_y);
 
-	cairo_translate (cr, x, y);
+	pango_font_description_free (fd);
+
+	return result;
+}
+
+/**
+ * matekbd_keyboard_drawing_model_render:
+ * @model:       keyboard to render
+ * @cr:          Cairo context to render to
+ * @font_desc:   font of the key labels, its size is ignored
+ * @palette:     colors not coming from the keyboard geometry
+ * @groupLevels: (array fixed-size=4): what the key labels show, by
+ *               #MatekbdKeyboardDrawingGroupLevelPosition
+ * @x:           left coordinate (pixels) of region to render in
+ * @y:           top coordinate (pixels) of region to render in
+ * @width:       width (pixels) of region to render in
+ * @height:      height (pixels) of region to render in
+ *
+ * Renders a keyboard model to any cairo_t context, image, PDF and SVG
+ * surfaces included, without a display or a widget.  Only the items
+ * within the clip of @cr are drawn.  Several threads may render the
+ * same model at once.
+ *
+ * Returns: %TRUE on success, %FALSE on failure
+ */
+gboolean
+matekbd_keyboard_drawing_model_render (MatekbdKeyboardDrawingModel * model,
+				       cairo_t * cr,
+				       const PangoFontDescription * font_desc,
+				       const MatekbdKeyboardDrawingPalette *
+				       palette,
+				       MatekbdKeyboardDrawingGroupLevel *
+				       groupLevels[], double x, double y,
+				       double width, double height,
+				       double dpi_x, double dpi_y)
+{
+	PangoLayout *layout = pango_cairo_create_layout (cr);
+	PangoFontDescription *fd = pango_font_description_copy (font_desc);
+	gboolean result;
 
-	draw_keyboard_to_context (&context, kbdrawing);
+	pango_layout_set_ellipsize (layout, PANGO_ELLIPSIZE_END);
+
+	result = render_model (model, cr, layout, fd, palette, groupLevels,
+			       0, FALSE, NULL, x, y, width, height, dpi_x,
+			       dpi_y);
 
 	pango_font_description_free (fd);
+	g_object_unref (layout);
 
-	return TRUE;
+	return result;
+}
+
+static void
+replace_model (MatekbdKeyboardDrawing * drawing,
+	       MatekbdKeyboardDrawingModel * model, gboolean on_display)
+{
+	set_model (drawing, model);
+	drawing->xkbOnDisplay = on_display;
+
+	relayout (drawing, FALSE);
+	gtk_widget_queue_draw (GTK_WIDGET (drawing));
+}
+
+/* Takes over model, which shares the geometry of the current one.  The
+ * keycap layer stays, only the indicators that changed and the labels are
+ * painted again. */
+static void
+replace_symbols (MatekbdKeyboardDrawing * drawing,
+		 MatekbdKeyboardDrawingModel * model)
+{
+	MatekbdKeyboardDrawingModel *previous =
+	    matekbd_keyboard_drawing_model_ref (drawing->model);
+	guint n;
+
+	set_model (drawing, model);
+	drawing->xkbOnDisplay = TRUE;
+
+	for (n = 0; n < model->num_items; n++) {
+		MatekbdKeyboardDrawingItemSlot *slot = model->items + n;
+
+		if (slot->item.type ==
+		    MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_DOODAD
+		    && slot->doodad.on != previous->items[n].doodad.on)
+			damage_item_region (drawing, &slot->item);
+	}
+	matekbd_keyboard_drawing_model_unref (previous);
+
+	flush_label_surfaces (drawing);
+	update_label_surface (drawing);
+	gtk_widget_queue_draw (GTK_WIDGET (drawing));
 }
 
 /**
@@ -2488,112 +4321,271 @@ gboolean
 matekbd_keyboard_drawing_set_keyboard (MatekbdKeyboardDrawing * drawing,
 				    XkbComponentNamesRec * names)
 {
-	GtkAllocation allocation;
+	MatekbdKeyboardDrawingModel *model;
 
-	free_cdik (drawing);
-	if (drawing->xkb)
-		XkbFreeKeyboard (drawing->xkb, 0, TRUE);	/* free_all = TRUE */
-	drawing->xkb = NULL;
+	/* whatever is still loading is out of date now */
+	drawing->load_task = NULL;
 
-	if (names) {
-		drawing->xkb =
-		    XkbGetKeyboardByName (drawing->display, XkbUseCoreKbd,
-					  names, 0,
-					  XkbGBN_GeometryMask |
-					  XkbGBN_KeyNamesMask |
-					  XkbGBN_OtherNamesMask |
-					  XkbGBN_ClientSymbolsMask |
-					  XkbGBN_IndicatorMapMask, FALSE);
-		drawing->xkbOnDisplay = FALSE;
+	if (names != NULL || drawing->model == NULL
+	    || !drawing->xkbOnDisplay) {
+		replace_model (drawing,
+			       matekbd_keyboard_drawing_model_new
+			       (drawing->display, names), names == NULL);
+		return TRUE;
+	}
+
+	/* the keyboard of the display changed, mostly its symbols only */
+	model = model_reload (drawing->display, drawing->model);
+	if (model != NULL && model->geometry_source != NULL
+	    && drawing->surface != NULL && !drawing->redraw_tick)
+		replace_symbols (drawing, model);
+	else
+		replace_model (drawing, model, TRUE);
+
+	return TRUE;
+}
+
+typedef struct {
+	gchar *display_name;
+	XkbComponentNamesRec names;
+	gboolean has_names;
+} LoadKeyboardData;
+
+static void
+load_keyboard_data_free (LoadKeyboardData * data)
+{
+	g_free (data->display_name);
+	g_free (data->names.keymap);
+	g_free (data->names.keycodes);
+	g_free (data->names.types);
+	g_free (data->names.compat);
+	g_free (data->names.symbols);
+	g_free (data->names.geometry);
+	g_free (data);
+}
+
+static void
+load_keyboard_thread (GTask * task,
+		      gpointer source_object,
+		      LoadKeyboardData * data, GCancellable * cancellable)
+{
+	MatekbdKeyboardDrawingModel *model;
+	Display *display;
+
+	if (g_task_return_error_if_cancelled (task))
+		return;
+
+	/* the GDK connection belongs to the main thread */
+	display = XOpenDisplay (data->display_name);
+	if (display == NULL) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+					 "Cannot open display %s",
+					 data->display_name);
+		return;
+	}
+
+	model = matekbd_keyboard_drawing_model_new (display,
+						    data->has_names ?
+						    &data->names : NULL);
+	/* atoms are the same on every connection to the server, only the
+	 * connection itself goes away */
+	if (model)
+		model->xkb->dpy = NULL;
+	XCloseDisplay (display);
+
+	if (model == NULL)
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+					 "Could not load the keyboard description");
+	else
+		g_task_return_pointer (task, model, (GDestroyNotify)
+				       matekbd_keyboard_drawing_model_unref);
+}
+
+static void
+keyboard_loaded (GObject * source_object,
+		 GAsyncResult * result, gpointer user_data)
+{
+	MatekbdKeyboardDrawing *drawing =
+	    MATEKBD_KEYBOARD_DRAWING (source_object);
+	LoadKeyboardData *data = g_task_get_task_data (G_TASK (result));
+	GTask *task = user_data;
+	MatekbdKeyboardDrawingModel *model;
+	GError *error = NULL;
+	gboolean current = drawing->load_task == task;
+
+	if (current) {
+		drawing->load_task = NULL;
+		/* drop the placeholder whatever happens */
+		gtk_widget_queue_draw (GTK_WIDGET (drawing));
+	}
+
+	model = g_task_propagate_pointer (G_TASK (result), &error);
+	if (model == NULL)
+		g_task_return_error (task, error);
+	else if (g_task_return_error_if_cancelled (task))
+		matekbd_keyboard_drawing_model_unref (model);
+	else if (!current) {
+		matekbd_keyboard_drawing_model_unref (model);
+		g_task_return_new_error (task, G_IO_ERROR,
+					 G_IO_ERROR_CANCELLED,
+					 "Another keyboard was set meanwhile");
 	} else {
-		drawing->xkb = XkbGetKeyboard (drawing->display,
-					       XkbGBN_GeometryMask |
-					       XkbGBN_KeyNamesMask |
-					       XkbGBN_OtherNamesMask |
-					       XkbGBN_SymbolsMask |
-					       XkbGBN_IndicatorMapMask,
-					       XkbUseCoreKbd);
-		XkbGetNames (drawing->display, XkbAllNamesMask,
-			     drawing->xkb);
-		drawing->xkbOnDisplay = TRUE;
-	}
-
-	if (drawing->xkb) {
-		XkbSelectEventDetails (drawing->display, XkbUseCoreKbd,
-				       XkbIndicatorStateNotify,
-				       drawing->xkb->indicators->phys_indicators,
-				       drawing->xkb->indicators->phys_indicators);
+		model->xkb->dpy = drawing->display;
+		replace_model (drawing, model, !data->has_names);
+		g_task_return_boolean (task, TRUE);
+	}
+
+	g_object_unref (task);
+}
+
+/**
+ * matekbd_keyboard_drawing_set_keyboard_async: (skip)
+ * @drawing:     the widget
+ * @names:       keyboard components to show, or %NULL for the keyboard
+ *               currently configured on the server
+ * @cancellable: (nullable): optional #GCancellable
+ * @callback:    (scope async): called when the keyboard is shown
+ * @user_data:   data for @callback
+ *
+ * Like matekbd_keyboard_drawing_set_keyboard (), but the keyboard
+ * description is fetched and laid out on a worker thread with its own
+ * X connection.  The widget shows a placeholder until the new keyboard
+ * replaces the old one.  A later call, synchronous or not, supersedes
+ * a pending one.
+ *
+ * The keyboard is loaded on a connection of its own in a worker thread,
+ * which needs the Xlib thread support: the application should call
+ * XInitThreads() before gtk_init(), libX11 1.8 and later do it by
+ * themselves.  If XInitThreads() fails, the keyboard is loaded on the
+ * main thread and @callback is still called from the main loop.
+ */
+void
+matekbd_keyboard_drawing_set_keyboard_async (MatekbdKeyboardDrawing *
+					     drawing,
+					     XkbComponentNamesRec * names,
+					     GCancellable * cancellable,
+					     GAsyncReadyCallback callback,
+					     gpointer user_data)
+{
+	LoadKeyboardData *data;
+	GTask *task, *load_task;
+
+	/* a no-op once Xlib is thread safe */
+	if (!XInitThreads ()) {
+		task = g_task_new (drawing, cancellable, callback, user_data);
+		g_task_set_source_tag (task,
+				       matekbd_keyboard_drawing_set_keyboard_async);
+		if (!g_task_return_error_if_cancelled (task)) {
+			matekbd_keyboard_drawing_set_keyboard (drawing, names);
+			g_task_return_boolean (task, TRUE);
+		}
+		g_object_unref (task);
+		return;
 	}
 
-	alloc_cdik (drawing);
+	data = g_new0 (LoadKeyboardData, 1);
+	data->display_name = g_strdup (DisplayString (drawing->display));
+	if (names) {
+		data->has_names = TRUE;
+		data->names.keymap = g_strdup (names->keymap);
+		data->names.keycodes = g_strdup (names->keycodes);
+		data->names.types = g_strdup (names->types);
+		data->names.compat = g_strdup (names->compat);
+		data->names.symbols = g_strdup (names->symbols);
+		data->names.geometry = g_strdup (names->geometry);
+	}
 
-	init_keys_and_doodads (drawing);
-	init_colors (drawing);
+	task = g_task_new (drawing, cancellable, callback, user_data);
+	g_task_set_source_tag (task,
+			       matekbd_keyboard_drawing_set_keyboard_async);
 
-	gtk_widget_get_allocation (GTK_WIDGET (drawing), &allocation);
-	size_allocate (GTK_WIDGET (drawing), &allocation, drawing);
+	drawing->load_task = task;
 	gtk_widget_queue_draw (GTK_WIDGET (drawing));
 
-	return TRUE;
+	load_task = g_task_new (drawing, cancellable, keyboard_loaded, task);
+	g_task_set_task_data (load_task, data,
+			      (GDestroyNotify) load_keyboard_data_free);
+	g_task_run_in_thread (load_task,
+			      (GTaskThreadFunc) load_keyboard_thread);
+	g_object_unref (load_task);
+}
+
+/**
+ * matekbd_keyboard_drawing_set_keyboard_finish: (skip)
+ * @drawing: the widget
+ * @result:  the #GAsyncResult passed to the callback
+ * @error:   return location for a #GError
+ *
+ * Returns: %TRUE if the keyboard is now shown
+ */
+gboolean
+matekbd_keyboard_drawing_set_keyboard_finish (MatekbdKeyboardDrawing *
+					      drawing,
+					      GAsyncResult * result,
+					      GError ** error)
+{
+	g_return_val_if_fail (g_task_is_valid (result, drawing), FALSE);
+
+	return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 const gchar* matekbd_keyboard_drawing_get_keycodes(MatekbdKeyboardDrawing* drawing)
 {
-	if (!drawing->xkb || drawing->xkb->names->keycodes <= 0)
+	if (!drawing->model || drawing->model->xkb->names->keycodes <= 0)
 	{
 		return NULL;
 	}
 	else
 	{
-		return XGetAtomName(drawing->display, drawing->xkb->names->keycodes);
+		return XGetAtomName(drawing->display, drawing->model->xkb->names->keycodes);
 	}
 }
 
 const gchar* matekbd_keyboard_drawing_get_geometry(MatekbdKeyboardDrawing* drawing)
 {
-	if (!drawing->xkb || drawing->xkb->names->geometry <= 0)
+	if (!drawing->model || drawing->model->xkb->names->geometry <= 0)
 	{
 		return NULL;
 	}
 	else
 	{
-		return XGetAtomName(drawing->display, drawing->xkb->names->geometry);
+		return XGetAtomName(drawing->display, drawing->model->xkb->names->geometry);
 	}
 }
 
 const gchar* matekbd_keyboard_drawing_get_symbols(MatekbdKeyboardDrawing* drawing)
 {
-	if (!drawing->xkb || drawing->xkb->names->symbols <= 0)
+	if (!drawing->model || drawing->model->xkb->names->symbols <= 0)
 	{
 		return NULL;
 	}
 	else
 	{
-		return XGetAtomName(drawing->display, drawing->xkb->names->symbols);
+		return XGetAtomName(drawing->display, drawing->model->xkb->names->symbols);
 	}
 }
 
 const gchar* matekbd_keyboard_drawing_get_types(MatekbdKeyboardDrawing* drawing)
 {
-	if (!drawing->xkb || drawing->xkb->names->types <= 0)
+	if (!drawing->model || drawing->model->xkb->names->types <= 0)
 	{
 		return NULL;
 	}
 	else
 	{
-		return XGetAtomName(drawing->display, drawing->xkb->names->types);
+		return XGetAtomName(drawing->display, drawing->model->xkb->names->types);
 	}
 }
 
 const gchar* matekbd_keyboard_drawing_get_compat(MatekbdKeyboardDrawing* drawing)
 {
-	if (!drawing->xkb || drawing->xkb->names->compat <= 0)
+	if (!drawing->model || drawing->model->xkb->names->compat <= 0)
 	{
 		return NULL;
 	}
 	else
 	{
-		return XGetAtomName(drawing->display, drawing->xkb->names->compat);
+		return XGetAtomName(drawing->display, drawing->model->xkb->names->compat);
 	}
 }
 
@@ -2601,15 +4593,29 @@ void
 matekbd_keyboard_drawing_set_track_modifiers (MatekbdKeyboardDrawing * drawing,
 					   gboolean enable)
 {
+	/* labels come from a different source when tracking, so none of
+	 * the label layers can be reused when the mode changes */
+	if (!enable != !drawing->track_modifiers) {
+		drop_labels_list (drawing);
+		flush_label_surfaces (drawing);
+	}
+
 	if (enable) {
 		XkbStateRec state;
 		drawing->track_modifiers = 1;
 		memset (&state, 0, sizeof (state));
+		matekbd_counters_add (MATEKBD_COUNTER_X_ROUND_TRIPS, 1);
 		XkbGetState (drawing->display, XkbUseCoreKbd, &state);
 		matekbd_keyboard_drawing_set_mods (drawing,
 						state.compat_state);
 	} else
 		drawing->track_modifiers = 0;
+	update_xkb_listening (drawing);
+
+	if (drawing->label_surface == NULL && !drawing->redraw_tick) {
+		update_label_surface (drawing);
+		gtk_widget_queue_draw (GTK_WIDGET (drawing));
+	}
 }
 
 void
@@ -2620,6 +4626,78 @@ matekbd_keyboard_drawing_set_track_config (MatekbdKeyboardDrawing * drawing,
 		drawing->track_config = 1;
 	else
 		drawing->track_config = 0;
+	update_xkb_listening (drawing);
+}
+
+/**
+ * matekbd_keyboard_drawing_set_progressive:
+ * @kbdrawing: a keyboard drawing
+ * @enable: whether to redraw progressively
+ *
+ * Spreads the full redraws over several frames, painting the keycaps
+ * first and the labels after them, so that large keyboards do not hold
+ * up the main loop.  The final result is the same.
+ */
+void
+matekbd_keyboard_drawing_set_progressive (MatekbdKeyboardDrawing * drawing,
+				       gboolean enable)
+{
+	if (enable)
+		drawing->progressive = 1;
+	else {
+		drawing->progressive = 0;
+		/* the pending redraw paints everything at once */
+		drawing->rendering = 0;
+	}
+}
+
+/**
+ * matekbd_keyboard_drawing_set_trace_latency:
+ * @kbdrawing: a keyboard drawing
+ * @enable: whether to trace key events
+ *
+ * Measures how long the key events take to show up on the screen: from
+ * the event to the frame drawing the key and to the presentation of that
+ * frame.  Every key change is added to the latency histogram and sent
+ * with the #MatekbdKeyboardDrawing::key-latency signal.
+ */
+void
+matekbd_keyboard_drawing_set_trace_latency (MatekbdKeyboardDrawing * drawing,
+					 gboolean enable)
+{
+	if (enable)
+		drawing->trace_latency = 1;
+	else {
+		drawing->trace_latency = 0;
+		g_array_set_size (drawing->latency_traces, 0);
+		disconnect_latency_clock (drawing);
+	}
+}
+
+/**
+ * matekbd_keyboard_drawing_get_latency_histogram:
+ * @kbdrawing: a keyboard drawing
+ * @n_buckets: (out): the number of buckets,
+ * %MATEKBD_KEYBOARD_DRAWING_LATENCY_BUCKETS
+ *
+ * Returns: (array length=n_buckets) (transfer none): the number of traced
+ * key events per presentation latency bucket
+ */
+const guint *
+matekbd_keyboard_drawing_get_latency_histogram (MatekbdKeyboardDrawing *
+					     drawing, guint * n_buckets)
+{
+	if (n_buckets != NULL)
+		*n_buckets = MATEKBD_KEYBOARD_DRAWING_LATENCY_BUCKETS;
+	return drawing->latency_histogram;
+}
+
+void
+matekbd_keyboard_drawing_reset_latency_histogram (MatekbdKeyboardDrawing *
+					       drawing)
+{
+	memset (drawing->latency_histogram, 0,
+		sizeof (drawing->latency_histogram));
 }
 
 void
@@ -2643,6 +4721,12 @@ matekbd_keyboard_drawing_set_groups_levels (MatekbdKeyboardDrawing * drawing,
 #endif
 	drawing->groupLevels = groupLevels;
 
+	/* only the labels depend on the groups and levels shown */
+	drop_labels_list (drawing);
+	flush_label_surfaces (drawing);
+	if (!drawing->redraw_tick)
+		update_label_surface (drawing);
+
 	gtk_widget_queue_draw (GTK_WIDGET (drawing));
 }
 
@@ -2812,6 +4896,9 @@ matekbd_keyboard_drawing_new_dialog (gint group, gchar * group_name)
 			(builder, "gswitchit_layout_view"));
 	kbdraw = matekbd_keyboard_drawing_new ();
 	gtk_widget_set_vexpand (kbdraw, TRUE);
+	/* keeps the dialog responsive while large previews are painted */
+	matekbd_keyboard_drawing_set_progressive (MATEKBD_KEYBOARD_DRAWING
+					       (kbdraw), TRUE);
 
 	snprintf (title, sizeof (title), _("Keyboard Layout \"%s\""),
 		  group_name);
@@ -2855,9 +4942,9 @@ matekbd_keyboard_drawing_new_dialog (gint group, gchar * group_name)
 
 		if (xkl_xkb_config_native_prepare(engine, xkl_data, &component_names))
 		{
-			matekbd_keyboard_drawing_set_keyboard
+			matekbd_keyboard_drawing_set_keyboard_async
 			    (MATEKBD_KEYBOARD_DRAWING (kbdraw),
-			     &component_names);
+			     &component_names, NULL, NULL, NULL);
 			xkl_xkb_config_native_cleanup (engine,
 						       &component_names);
 		}
@@ -42,6 +42,8 @@ typedef struct _MatekbdKeyboardDrawingGroupLevel
  MatekbdKeyboardDrawingGroupLevel;
 typedef struct _MatekbdKeyboardDrawingRenderContext
  MatekbdKeyboardDrawingRenderContext;
+typedef struct _MatekbdKeyboardDrawingModel MatekbdKeyboardDrawingModel;
+typedef struct _MatekbdKeyboardDrawingPalette MatekbdKeyboardDrawingPalette;
 
 typedef enum {
 	MATEKBD_KEYBOARD_DRAWING_ITEM_TYPE_INVALID = 0,
@@ -84,7 +86,6 @@ struct _MatekbdKeyboardDrawingKey {
 	guint priority;
 
 	XkbKeyRec *xkbkey;
-	gboolean pressed;
 	guint keycode;
 };
 
@@ -102,11 +103,25 @@ struct _MatekbdKeyboardDrawingDoodad {
 	gboolean on;		/* for indicator doodads */
 };
 
+/* an item of any type, the unit of the item array */
+typedef union {
+	MatekbdKeyboardDrawingItem item;
+	MatekbdKeyboardDrawingKey key;
+	MatekbdKeyboardDrawingDoodad doodad;
+} MatekbdKeyboardDrawingItemSlot;
+
 struct _MatekbdKeyboardDrawingGroupLevel {
 	gint group;
 	gint level;
 };
 
+/* the colors not coming from the keyboard geometry */
+struct _MatekbdKeyboardDrawingPalette {
+	GdkRGBA background;	/* not painted when fully transparent */
+	GdkRGBA outline;
+	GdkRGBA pressed;
+};
+
 struct _MatekbdKeyboardDrawingRenderContext {
 	cairo_t *cr;
 
@@ -117,46 +132,153 @@ struct _MatekbdKeyboardDrawingRenderContext {
 	gint scale_numerator;
 	gint scale_denominator;
 
-	GdkRGBA dark_color;
+	MatekbdKeyboardDrawingPalette palette;
+
+	/* shaped key labels, see get_label_layout () */
+	GHashTable *label_layouts;
+
+	/* what the key labels show */
+	MatekbdKeyboardDrawingGroupLevel **groupLevels;
+	guint mods;
+	gboolean track_modifiers;
+
+	/* keycaps rasterized at the current scale, see draw_keycap () */
+	GHashTable *keycaps;
+
+	/* nonzero for the keycodes drawn pressed; NULL when none are */
+	const guint8 *pressed_keys;
 };
 
-struct _MatekbdKeyboardDrawing {
+/* A keyboard description laid out for drawing.  It does not change once
+ * created, except for the indicator states of the widget's own model,
+ * which the widget updates on the main thread: that model must not be
+ * rendered from other threads.  Pressed keys are kept by the widget. */
+struct _MatekbdKeyboardDrawingModel {
 	/*< private > */
 
-	GtkDrawingArea parent;
+	gint ref_count;
 
-	cairo_surface_t *surface;
 	XkbDescRec *xkb;
-	gboolean xkbOnDisplay;
 	guint l3mod;
 
-	MatekbdKeyboardDrawingRenderContext *renderContext;
+	/* Indexed by keycode, points into items; NULL for keys not drawn */
+	MatekbdKeyboardDrawingKey **keys;
+
+	/* key name (packed in 32 bits) -> keycode, aliases included */
+	GHashTable *keycode_index;
 
-	/* Indexed by keycode */
-	MatekbdKeyboardDrawingKey *keys;
+	/* XkbOutlineRec -> cairo_path_t in xkb units */
+	GHashTable *outline_paths;
 
-	/* list of stuff to draw in priority order */
-	GList *keyboard_items;
+	/* stuff to draw in priority order, allocated as one block */
+	MatekbdKeyboardDrawingItemSlot *items;
+	guint num_items;
+
+	/* bounds of the items in xkb units, parallel to items */
+	GdkRectangle *item_bounds;
+	/* uniform grid over the item bounds, see init_item_index () */
+	GdkRectangle grid_area;
+	gint grid_cell_size;
+	gint grid_cols;
+	gint grid_rows;
+	guint *grid_cells;
+	guint *grid_items;
 
 	GdkRGBA *colors;
 
+	MatekbdKeyboardDrawingDoodad **physical_indicators;
+	gint physical_indicators_size;
+
+	/* model whose geometry, outline paths, item bounds, index and
+	 * colors this one shares; NULL when it owns them */
+	MatekbdKeyboardDrawingModel *geometry_source;
+};
+
+/* buckets of the key latency histogram: the first counts latencies below
+ * 1 ms, bucket n those from 2^(n-1) up to 2^n ms and the last one all the
+ * longer ones */
+#define MATEKBD_KEYBOARD_DRAWING_LATENCY_BUCKETS 12
+
+struct _MatekbdKeyboardDrawing {
+	/*< private > */
+
+	GtkDrawingArea parent;
+
+	/* keycaps and doodads */
+	cairo_surface_t *surface;
+	/* draws on surface, kept across repaints */
+	cairo_t *surface_cr;
+	/* allocation and scale the layer surfaces were made for */
+	gint surface_width;
+	gint surface_height;
+	gint surface_scale;
+	/* flushed label layers of that size, kept for reuse */
+	GSList *spare_surfaces;
+	/* parts of surface to repaint before it is shown */
+	cairo_region_t *damage;
+	/* key labels for the current mods, composited over the keycaps */
+	cairo_surface_t *label_surface;
+	/* mods -> label layer, owns label_surface */
+	GHashTable *label_surfaces;
+	MatekbdKeyboardDrawingModel *model;
+	gboolean xkbOnDisplay;
+	/* the pending set_keyboard_async (), not owned */
+	GTask *load_task;
+
+	MatekbdKeyboardDrawingRenderContext *renderContext;
+	/* the label layer recorded in xkb units for labels_list_mods, up to
+	 * item labels_list_items, and replayed at every size */
+	cairo_surface_t *labels_list;
+	guint labels_list_mods;
+	guint labels_list_items;
+	/* records labels_list, at the scale of xkb units */
+	MatekbdKeyboardDrawingRenderContext *listContext;
+	/* theme colors and label font, resolved when the style changes */
+	MatekbdKeyboardDrawingPalette palette;
+	PangoFontDescription *font_desc;
+
 	guint timeout;
-	guint idle_redraw;
+	/* nonzero for the keycodes held down, painted over the keycaps */
+	guint8 pressed_keys[XkbMaxLegalKeyCode + 1];
+	/* tick callback of the pending full redraw */
+	guint redraw_tick;
+	/* when the size last changed, the redraw waits for it to settle */
+	gint64 resize_time;
+	/* keyboard scale the layers were painted at, 0 when they are not
+	 * to be shown anymore */
+	gdouble layers_scale;
+	/* time sliced redraw: the layer being painted, the next keycap
+	 * item and the mods of the labels */
+	guint render_layer;
+	guint render_item;
+	guint render_mods;
 
 	MatekbdKeyboardDrawingGroupLevel **groupLevels;
 
 	guint mods;
+	/* keys repainted by the last modifier change */
+	guint mods_repaint_count;
 
 	Display *display;
 	gint screen_num;
 
 	gint xkb_event_type;
+	/* XKB events dispatched to the widget, as a mask of their types */
+	guint xkb_events;
 
-	MatekbdKeyboardDrawingDoodad **physical_indicators;
-	gint physical_indicators_size;
+	/* key events not presented yet, see set_trace_latency () */
+	GArray *latency_traces;
+	/* the frame clock watched for the presentation, owned */
+	GdkFrameClock *latency_clock;
+	gulong latency_handler;
+	guint latency_histogram[MATEKBD_KEYBOARD_DRAWING_LATENCY_BUCKETS];
 
 	guint track_config:1;
 	guint track_modifiers:1;
+	guint trace_latency:1;
+	guint progressive:1;
+	/* a time sliced redraw is under way */
+	guint rendering:1;
 };
 
 struct _MatekbdKeyboardDrawingClass {
@@ -166,8 +288,34 @@ struct _MatekbdKeyboardDrawingClass {
 	 * according to the keyboard geometry; it probably means their xkb
 	 * configuration is incorrect */
 	void (*bad_keycode) (MatekbdKeyboardDrawing * drawing, guint keycode);
+
+	/* with latency tracing, sent when a key change has been presented;
+	 * the latencies from the key event are in microseconds */
+	void (*key_latency) (MatekbdKeyboardDrawing * drawing, guint keycode,
+			     gint64 draw_latency, gint64 present_latency);
 };
 
+GType matekbd_keyboard_drawing_model_get_type (void);
+MatekbdKeyboardDrawingModel
+    * matekbd_keyboard_drawing_model_new (Display * display,
+					  XkbComponentNamesRec * names);
+MatekbdKeyboardDrawingModel
+    * matekbd_keyboard_drawing_model_ref (MatekbdKeyboardDrawingModel * model);
+void matekbd_keyboard_drawing_model_unref (MatekbdKeyboardDrawingModel *
+					   model);
+gboolean matekbd_keyboard_drawing_model_render (MatekbdKeyboardDrawingModel *
+						model, cairo_t * cr,
+						const PangoFontDescription *
+						font_desc,
+						const
+						MatekbdKeyboardDrawingPalette
+						* palette,
+						MatekbdKeyboardDrawingGroupLevel
+						* groupLevels[], double x,
+						double y, double width,
+						double height, double dpi_x,
+						double dpi_y);
+
 GType matekbd_keyboard_drawing_get_type (void);
 GtkWidget *matekbd_keyboard_drawing_new (void);
 
@@ -180,6 +328,17 @@ gboolean matekbd_keyboard_drawing_render (MatekbdKeyboardDrawing * kbdrawing,
 gboolean matekbd_keyboard_drawing_set_keyboard (MatekbdKeyboardDrawing *
 					     kbdrawing,
 					     XkbComponentNamesRec * names);
+void matekbd_keyboard_drawing_set_keyboard_async (MatekbdKeyboardDrawing *
+						  kbdrawing,
+						  XkbComponentNamesRec *
+						  names,
+						  GCancellable * cancellable,
+						  GAsyncReadyCallback callback,
+						  gpointer user_data);
+gboolean matekbd_keyboard_drawing_set_keyboard_finish (MatekbdKeyboardDrawing
+						       * kbdrawing,
+						       GAsyncResult * result,
+						       GError ** error);
 
 const gchar* matekbd_keyboard_drawing_get_keycodes(MatekbdKeyboardDrawing* kbdrawing);
 const gchar* matekbd_keyboard_drawing_get_geometry(MatekbdKeyboardDrawing* kbdrawing);
@@ -193,6 +352,16 @@ void matekbd_keyboard_drawing_set_track_modifiers (MatekbdKeyboardDrawing *
 void matekbd_keyboard_drawing_set_track_config (MatekbdKeyboardDrawing *
 					     kbdrawing, gboolean enable);
 
+void matekbd_keyboard_drawing_set_progressive (MatekbdKeyboardDrawing *
+					    kbdrawing, gboolean enable);
+
+void matekbd_keyboard_drawing_set_trace_latency (MatekbdKeyboardDrawing *
+					      kbdrawing, gboolean enable);
+const guint *matekbd_keyboard_drawing_get_latency_histogram
+    (MatekbdKeyboardDrawing * kbdrawing, guint * n_buckets);
+void matekbd_keyboard_drawing_reset_latency_histogram (MatekbdKeyboardDrawing
+						    * kbdrawing);
+
 void matekbd_keyboard_drawing_set_groups_levels (MatekbdKeyboardDrawing *
 					      kbdrawing,
 					      MatekbdKeyboardDrawingGroupLevel
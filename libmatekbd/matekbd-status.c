@@ -31,6 +31,7 @@
 
 #include <matekbd-desktop-config.h>
 #include <matekbd-indicator-config.h>
+#include <matekbd-counters.h>
 
 typedef struct _gki_globals {
 	XklEngine *engine;
@@ -123,7 +124,11 @@ matekbd_status_global_fill (MatekbdStatus * gki)
 	int total_groups = xkl_engine_get_num_groups (globals.engine);
 
 	for (grp = 0; grp < total_groups; grp++) {
+		gint64 start = matekbd_counters_phase_begin ();
 		GdkPixbuf *page = matekbd_status_prepare_drawing (gki, grp);
+
+		matekbd_counters_phase_end (MATEKBD_PHASE_STATUS_RENDERING,
+					    start);
 		globals.icons = g_slist_append (globals.icons, page);
 	}
 }
@@ -305,6 +310,7 @@ matekbd_status_prepare_drawing (MatekbdStatus * gki, int group)
 							  globals.current_width,
 							  globals.current_height,
 							  &gerror);
+		matekbd_counters_add (MATEKBD_COUNTER_PIXBUFS_LOADED, 1);
 
 		if (image == NULL) {
 			GtkWidget *dialog = gtk_message_dialog_new (NULL,
@@ -346,6 +352,8 @@ matekbd_status_prepare_drawing (MatekbdStatus * gki, int group)
 						globals.current_height);
 		unsigned char *cairo_data;
 		guchar *pixbuf_data;
+
+		matekbd_counters_add (MATEKBD_COUNTER_SURFACES_ALLOCATED, 1);
 		matekbd_status_render_cairo (cairo_create (cs), group);
 		cairo_data = cairo_image_surface_get_data (cs);
 #if 0
@@ -404,6 +412,8 @@ matekbd_status_update_tooltips (MatekbdStatus * gki)
 void
 matekbd_status_reinit_ui (MatekbdStatus * gki)
 {
+	matekbd_counters_add (MATEKBD_COUNTER_REINIT_UI, 1);
+
 	matekbd_status_global_cleanup (gki);
 	matekbd_status_global_fill (gki);
 
@@ -0,0 +1,517 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Times the hot paths of the keyboard drawing, the indicator and the
+ * status icon against the X server in $DISPLAY, Xvfb being enough, and
+ * prints the results as JSON.  Benchmarks which need something that is
+ * not there, like the GSettings schemas, are listed as skipped.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gtk/gtk.h>
+#include <gdk/gdkx.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <X11/XKBlib.h>
+#include "libmatekbd/matekbd-keyboard-drawing.h"
+#include "libmatekbd/matekbd-keyboard-config.h"
+#include "libmatekbd/matekbd-indicator.h"
+#include "libmatekbd/matekbd-status.h"
+
+#define WARMUP_ITERATIONS 3
+
+#define DRAWING_WIDTH 1200
+#define DRAWING_HEIGHT 400
+
+static gint iterations = 50;
+static gchar *output = NULL;
+static gboolean program_version = FALSE;
+
+static const GOptionEntry options[] = {
+	{"iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+	 "Timed runs of every benchmark, 50 by default", "N"},
+	{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+	 "Write the JSON results to FILE instead of stdout", "FILE"},
+	{"version", '\0', 0, G_OPTION_ARG_NONE, &program_version,
+	 "Show current version", NULL},
+	{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL},
+};
+
+/* keycodes, symbols and geometries of the drawing benchmarks */
+static const gchar *geometries[] = {
+	"pc(pc104)",
+	"pc(pc105)",
+	"kinesis",
+	"microsoft(natural)",
+	"thinkpad(intl)",
+};
+
+/*
+ * Allocation counting.  With glibc the allocator can be wrapped from
+ * the executable, which counts the allocations of every library in the
+ * process; elsewhere the counts are reported as null.
+ */
+#ifdef __GLIBC__
+#define HAVE_ALLOCATION_COUNT 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gint allocations = 0;
+
+void *
+malloc (size_t size)
+{
+	g_atomic_int_inc (&allocations);
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+	g_atomic_int_inc (&allocations);
+	return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+	g_atomic_int_inc (&allocations);
+	return __libc_realloc (ptr, size);
+}
+
+static gint
+get_allocations (void)
+{
+	return g_atomic_int_get (&allocations);
+}
+#else
+static gint
+get_allocations (void)
+{
+	return 0;
+}
+#endif
+
+typedef void (*BenchmarkFunc) (gpointer data);
+
+typedef struct {
+	GString *results;
+	GString *skipped;
+} Report;
+
+static gint
+compare_times (gconstpointer a, gconstpointer b)
+{
+	gint64 ta = *(const gint64 *) a;
+	gint64 tb = *(const gint64 *) b;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+static void
+report_skipped (Report * report, const gchar * name, const gchar * reason)
+{
+	g_string_append_printf (report->skipped,
+				"%s\n    {\"name\": \"%s\", \"reason\": \"%s\"}",
+				report->skipped->len ? "," : "", name,
+				reason);
+}
+
+/* divisor turns the time of a run into the time of a unit of work */
+static void
+run_benchmark (Report * report, const gchar * name, BenchmarkFunc func,
+	       gpointer data, gint divisor)
+{
+	gint64 *times = g_new (gint64, iterations);
+	gint64 total = 0;
+	gint allocs;
+	gint i;
+
+	for (i = 0; i < WARMUP_ITERATIONS; i++)
+		func (data);
+
+	allocs = get_allocations ();
+	for (i = 0; i < iterations; i++) {
+		gint64 start = g_get_monotonic_time ();
+
+		func (data);
+		times[i] = (g_get_monotonic_time () - start) / divisor;
+		total += times[i];
+	}
+	allocs = get_allocations () - allocs;
+
+	qsort (times, iterations, sizeof (gint64), compare_times);
+
+	g_string_append_printf (report->results,
+				"%s\n    {\"name\": \"%s\", \"iterations\": %d, "
+				"\"median_us\": %" G_GINT64_FORMAT
+				", \"min_us\": %" G_GINT64_FORMAT
+				", \"max_us\": %" G_GINT64_FORMAT
+				", \"mean_us\": %.1f, ",
+				report->results->len ? "," : "", name,
+				iterations, times[iterations / 2], times[0],
+				times[iterations - 1],
+				(gdouble) total / iterations);
+#ifdef HAVE_ALLOCATION_COUNT
+	g_string_append_printf (report->results, "\"allocations\": %.1f}",
+				(gdouble) allocs / iterations / divisor);
+#else
+	g_string_append (report->results, "\"allocations\": null}");
+#endif
+
+	g_free (times);
+}
+
+static void
+process_events (void)
+{
+	while (gtk_events_pending ())
+		gtk_main_iteration ();
+}
+
+/* keyboard drawing */
+
+typedef struct {
+	GtkWidget *window;
+	MatekbdKeyboardDrawing *drawing;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	PangoLayout *layout;
+	gint size_toggle;
+	guint keycode;
+	guint mods;
+} DrawingBenchmark;
+
+static void
+bench_render (DrawingBenchmark * b)
+{
+	matekbd_keyboard_drawing_render (b->drawing, b->cr, b->layout, 0, 0,
+				      DRAWING_WIDTH, DRAWING_HEIGHT, 96, 96);
+}
+
+static gboolean
+timeout_flag (gpointer user_data)
+{
+	*(gboolean *) user_data = TRUE;
+	return FALSE;
+}
+
+/* the layers are painted again from a frame clock tick, once a resize
+ * has settled, so the frames are run until the widget is done */
+static void
+wait_for_redraw (DrawingBenchmark * b)
+{
+	gboolean timed_out = FALSE;
+	guint timeout;
+
+	timeout = g_timeout_add (5000, timeout_flag, &timed_out);
+	while (b->drawing->redraw_tick && !timed_out)
+		g_main_context_iteration (NULL, TRUE);
+	if (!timed_out)
+		g_source_remove (timeout);
+}
+
+/* a new size throws away every layer, this is the full widget redraw up
+ * to the frame that paints them again; the time includes the wait for
+ * the resize to settle, about 150 ms */
+static void
+bench_relayout (DrawingBenchmark * b)
+{
+	gtk_widget_set_size_request (GTK_WIDGET (b->drawing),
+				     DRAWING_WIDTH - (b->size_toggle ^= 1),
+				     DRAWING_HEIGHT);
+	process_events ();
+	wait_for_redraw (b);
+	gtk_widget_draw (GTK_WIDGET (b->drawing), b->cr);
+}
+
+static void
+send_key (DrawingBenchmark * b, GdkEventType type)
+{
+	GdkEvent *event = gdk_event_new (type);
+	GdkSeat *seat =
+	    gdk_display_get_default_seat (gdk_display_get_default ());
+
+	event->key.window =
+	    g_object_ref (gtk_widget_get_window (GTK_WIDGET (b->drawing)));
+	event->key.send_event = TRUE;
+	event->key.time = GDK_CURRENT_TIME;
+	event->key.hardware_keycode = b->keycode;
+	gdk_event_set_device (event, gdk_seat_get_keyboard (seat));
+
+	gtk_widget_event (GTK_WIDGET (b->drawing), event);
+	gdk_event_free (event);
+}
+
+/* the event handling and the repaint it causes, over the letter keys */
+static void
+bench_key_press_release (DrawingBenchmark * b)
+{
+	b->keycode = b->keycode < 24 || b->keycode >= 58 ? 24 : b->keycode + 1;
+
+	send_key (b, GDK_KEY_PRESS);
+	gtk_widget_draw (GTK_WIDGET (b->drawing), b->cr);
+	send_key (b, GDK_KEY_RELEASE);
+	gtk_widget_draw (GTK_WIDGET (b->drawing), b->cr);
+}
+
+/* toggles Shift Lock on the server and waits for the widget to follow,
+ * so the round trip is part of the time */
+static void
+bench_modifiers (DrawingBenchmark * b)
+{
+	Display *display = b->drawing->display;
+	gboolean timed_out = FALSE;
+	guint timeout;
+
+	b->mods ^= ShiftMask;
+	XkbLockModifiers (display, XkbUseCoreKbd, ShiftMask, b->mods);
+	XFlush (display);
+
+	timeout = g_timeout_add (1000, timeout_flag, &timed_out);
+	while ((b->drawing->mods & ShiftMask) != b->mods && !timed_out)
+		g_main_context_iteration (NULL, TRUE);
+	if (!timed_out)
+		g_source_remove (timeout);
+
+	gtk_widget_draw (GTK_WIDGET (b->drawing), b->cr);
+}
+
+static void
+run_drawing_benchmarks (Report * report)
+{
+	DrawingBenchmark b;
+	XkbComponentNamesRec names;
+	GtkWidget *widget;
+	guint i;
+
+	memset (&b, 0, sizeof (b));
+
+	b.window = gtk_offscreen_window_new ();
+	widget = matekbd_keyboard_drawing_new ();
+	b.drawing = MATEKBD_KEYBOARD_DRAWING (widget);
+	gtk_widget_set_size_request (widget, DRAWING_WIDTH, DRAWING_HEIGHT);
+	gtk_container_add (GTK_CONTAINER (b.window), widget);
+	gtk_widget_show_all (b.window);
+	process_events ();
+
+	b.surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+						DRAWING_WIDTH,
+						DRAWING_HEIGHT);
+	b.cr = cairo_create (b.surface);
+	b.layout = pango_cairo_create_layout (b.cr);
+
+	memset (&names, 0, sizeof (names));
+	names.keycodes = (gchar *) "evdev+aliases(qwerty)";
+	names.symbols = (gchar *) "pc+us+inet(evdev)";
+
+	for (i = 0; i < G_N_ELEMENTS (geometries); i++) {
+		gchar *name;
+
+		names.geometry = (gchar *) geometries[i];
+		matekbd_keyboard_drawing_set_keyboard (b.drawing, &names);
+		process_events ();
+		wait_for_redraw (&b);
+
+		name = g_strdup_printf ("drawing/render/%s", geometries[i]);
+		if (b.drawing->model == NULL) {
+			report_skipped (report, name,
+					"geometry not available");
+			g_free (name);
+			continue;
+		}
+		run_benchmark (report, name, (BenchmarkFunc) bench_render,
+			       &b, 1);
+		g_free (name);
+
+		name = g_strdup_printf ("drawing/relayout/%s",
+					geometries[i]);
+		run_benchmark (report, name, (BenchmarkFunc) bench_relayout,
+			       &b, 1);
+		g_free (name);
+	}
+
+	/* the server's own keyboard for the interactive paths */
+	matekbd_keyboard_drawing_set_keyboard (b.drawing, NULL);
+	process_events ();
+	wait_for_redraw (&b);
+	if (b.drawing->model != NULL) {
+		run_benchmark (report, "drawing/key-press-release",
+			       (BenchmarkFunc) bench_key_press_release, &b,
+			       1);
+
+		matekbd_keyboard_drawing_set_track_modifiers (b.drawing,
+							   TRUE);
+		process_events ();
+		wait_for_redraw (&b);
+		run_benchmark (report, "drawing/modifier-change",
+			       (BenchmarkFunc) bench_modifiers, &b, 1);
+		if (b.mods != 0)
+			bench_modifiers (&b);
+	} else {
+		report_skipped (report, "drawing/key-press-release",
+				"no keyboard description");
+		report_skipped (report, "drawing/modifier-change",
+				"no keyboard description");
+	}
+
+	g_object_unref (b.layout);
+	cairo_destroy (b.cr);
+	cairo_surface_destroy (b.surface);
+	gtk_widget_destroy (b.window);
+}
+
+/* indicator, status and configuration */
+
+static void
+bench_indicator_reinit_ui (MatekbdIndicator * indicator)
+{
+	matekbd_indicator_reinit_ui (indicator);
+}
+
+static void
+bench_status_reinit_ui (MatekbdStatus * status)
+{
+	matekbd_status_reinit_ui (status);
+}
+
+static void
+bench_config_load_activate (MatekbdKeyboardConfig * config)
+{
+	matekbd_keyboard_config_load_from_x_current (config, NULL);
+	matekbd_keyboard_config_activate (config);
+}
+
+static void
+run_config_benchmarks (Report * report)
+{
+	GSettingsSchema *schema =
+	    g_settings_schema_source_lookup
+	    (g_settings_schema_source_get_default (),
+	     "org.mate.peripherals-keyboard-xkb.kbd", TRUE);
+	GtkWidget *window, *indicator;
+	GtkStatusIcon *status;
+	MatekbdKeyboardConfig config;
+	XklEngine *engine;
+	gint num_groups;
+
+	if (schema == NULL) {
+		const gchar *reason = "GSettings schemas not installed";
+
+		report_skipped (report, "indicator/reinit-ui", reason);
+		report_skipped (report, "status/prepare-drawing", reason);
+		report_skipped (report, "config/load-activate", reason);
+		return;
+	}
+	g_settings_schema_unref (schema);
+
+	window = gtk_offscreen_window_new ();
+	indicator = matekbd_indicator_new ();
+	gtk_container_add (GTK_CONTAINER (window), indicator);
+	gtk_widget_show_all (window);
+	process_events ();
+	run_benchmark (report, "indicator/reinit-ui",
+		       (BenchmarkFunc) bench_indicator_reinit_ui,
+		       MATEKBD_INDICATOR (indicator), 1);
+	gtk_widget_destroy (window);
+
+	/* reinit_ui () prepares the drawing of every group */
+	status = matekbd_status_new ();
+	engine = matekbd_status_get_xkl_engine ();
+	num_groups = MAX (xkl_engine_get_num_groups (engine), 1);
+	run_benchmark (report, "status/prepare-drawing",
+		       (BenchmarkFunc) bench_status_reinit_ui,
+		       MATEKBD_STATUS (status), num_groups);
+	g_object_unref (status);
+
+	matekbd_keyboard_config_init (&config, engine);
+	run_benchmark (report, "config/load-activate",
+		       (BenchmarkFunc) bench_config_load_activate, &config,
+		       1);
+	matekbd_keyboard_config_term (&config);
+}
+
+gint
+main (gint argc, gchar ** argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	Report report;
+	gchar *json;
+
+	context = g_option_context_new ("- benchmark libmatekbd");
+	g_option_context_add_main_entries (context, options, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_message ("option parsing failed: %s", error->message);
+		g_option_context_free (context);
+		exit (EXIT_FAILURE);
+	}
+	g_option_context_free (context);
+
+	if (program_version) {
+		g_print ("matekbd-benchmark %s\n", VERSION);
+		exit (0);
+	}
+
+	if (iterations <= 0) {
+		g_printerr ("--iterations must be positive\n");
+		exit (1);
+	}
+
+	/* 77 tells meson the benchmark was skipped */
+	if (!gtk_init_check (&argc, &argv)) {
+		g_printerr ("cannot open display, run under xvfb-run\n");
+		exit (77);
+	}
+	if (!GDK_IS_X11_DISPLAY (gdk_display_get_default ())) {
+		g_printerr ("an X11 display is needed\n");
+		exit (77);
+	}
+
+	report.results = g_string_new (NULL);
+	report.skipped = g_string_new (NULL);
+
+	run_drawing_benchmarks (&report);
+	run_config_benchmarks (&report);
+
+	json = g_strdup_printf ("{\n  \"version\": \"%s\",\n"
+				"  \"benchmarks\": [%s\n  ],\n"
+				"  \"skipped\": [%s\n  ]\n}\n", VERSION,
+				report.results->str, report.skipped->str);
+
+	if (output != NULL) {
+		if (!g_file_set_contents (output, json, -1, &error)) {
+			g_printerr ("%s\n", error->message);
+			g_error_free (error);
+			exit (1);
+		}
+	} else
+		g_print ("%s", json);
+
+	g_free (json);
+	g_string_free (report.results, TRUE);
+	g_string_free (report.skipped, TRUE);
+
+	return 0;
+}
@@ -0,0 +1,503 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Renders a batch of keyboard layouts to image files on a thread pool.
+ *
+ * Every line of the job list describes one image:
+ *
+ *   output keycodes geometry symbols [groups [levels]]
+ *
+ * separated by blanks; empty lines and lines starting with '#' are
+ * skipped.  The format of the output is chosen by its extension: .png,
+ * .svg or .pdf.  groups and levels take the same form as the --groups
+ * and --levels options of matekbd-keyboard-drawing-test.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gtk/gtk.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <cairo-pdf.h>
+#include <cairo-svg.h>
+#include "libmatekbd/matekbd-keyboard-drawing.h"
+
+static gint jobs = 0;
+static gint width = 1200;
+static gint height = 400;
+static gdouble dpi = 96;
+static gchar *font = NULL;
+static gboolean program_version = FALSE;
+
+static const GOptionEntry options[] = {
+	{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+	 "Number of worker threads, the number of processors by default",
+	 "N"},
+	{"width", '\0', 0, G_OPTION_ARG_INT, &width,
+	 "Width of the images in pixels (points for PDF)", "WIDTH"},
+	{"height", '\0', 0, G_OPTION_ARG_INT, &height,
+	 "Height of the images in pixels (points for PDF)", "HEIGHT"},
+	{"dpi", '\0', 0, G_OPTION_ARG_DOUBLE, &dpi,
+	 "Resolution the key labels are sized for", "DPI"},
+	{"font", '\0', 0, G_OPTION_ARG_STRING, &font,
+	 "Font of the key labels, its size is ignored. Example: --font=Sans",
+	 "FONT"},
+	{"version", '\0', 0, G_OPTION_ARG_NONE, &program_version,
+	 "Show current version", NULL},
+	{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL},
+};
+
+typedef enum {
+	OUTPUT_PNG,
+	OUTPUT_SVG,
+	OUTPUT_PDF
+} OutputFormat;
+
+typedef struct {
+	gchar *output;
+	OutputFormat format;
+	XkbComponentNamesRec names;
+	MatekbdKeyboardDrawingGroupLevel groupLevels[4];
+
+	/* filled in by the worker, in microseconds */
+	gboolean success;
+	gint64 load_time;
+	gint64 render_time;
+	gint64 write_time;
+} RenderJob;
+
+/* what every worker thread keeps between jobs */
+typedef struct {
+	Display *display;
+	cairo_surface_t *image;	/* reused for all the PNG jobs */
+} Worker;
+
+static GPrivate current_worker;
+static GPtrArray *workers = NULL;
+G_LOCK_DEFINE_STATIC (workers);
+
+static PangoFontDescription *font_desc = NULL;
+static MatekbdKeyboardDrawingPalette palette = {
+	{1.0, 1.0, 1.0, 1.0},	/* background */
+	{0.3, 0.3, 0.3, 1.0},	/* outline */
+	{0.6, 0.6, 0.6, 1.0}	/* pressed, unused */
+};
+
+static gboolean
+set_groups (gchar * groups_option,
+	    MatekbdKeyboardDrawingGroupLevel * groupLevels)
+{
+	MatekbdKeyboardDrawingGroupLevel *pgl = groupLevels;
+	gint cntr, g;
+
+	groupLevels[0].group =
+	    groupLevels[1].group =
+	    groupLevels[2].group = groupLevels[3].group = -1;
+
+	if (groups_option == NULL)
+		return TRUE;
+
+	for (cntr = 4; --cntr >= 0;) {
+		if (*groups_option == '\0')
+			return FALSE;
+
+		g = *groups_option - '1';
+		if (g < 0 || g >= 4)
+			return FALSE;
+
+		pgl->group = g;
+
+		groups_option++;
+		if (*groups_option == '\0')
+			return TRUE;
+		if (*groups_option != ',')
+			return FALSE;
+
+		groups_option++;
+		pgl++;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+set_levels (gchar * levels_option,
+	    MatekbdKeyboardDrawingGroupLevel * groupLevels)
+{
+	MatekbdKeyboardDrawingGroupLevel *pgl = groupLevels;
+	gint cntr, l;
+	gchar *p;
+
+	groupLevels[0].level =
+	    groupLevels[1].level =
+	    groupLevels[2].level = groupLevels[3].level = -1;
+
+	if (levels_option == NULL)
+		return TRUE;
+
+	for (cntr = 4; --cntr >= 0;) {
+		if (*levels_option == '\0')
+			return FALSE;
+
+		l = (gint) strtol (levels_option, &p, 10) - 1;
+		if (l < 0 || l >= 64)
+			return FALSE;
+
+		pgl->level = l;
+
+		levels_option = p;
+		if (*levels_option == '\0')
+			return TRUE;
+		if (*levels_option != ',')
+			return FALSE;
+
+		levels_option++;
+		pgl++;
+	}
+
+	return TRUE;
+}
+
+static void
+render_job_free (RenderJob * job)
+{
+	g_free (job->output);
+	g_free (job->names.keycodes);
+	g_free (job->names.geometry);
+	g_free (job->names.symbols);
+	g_free (job);
+}
+
+static RenderJob *
+parse_job (const gchar * line, gint line_number)
+{
+	RenderJob *job;
+	gchar **fields;
+	guint num_fields;
+
+	/* the line comes stripped, so there are no empty fields */
+	fields = g_regex_split_simple ("\\s+", line, 0, 0);
+	num_fields = g_strv_length (fields);
+
+	if (num_fields < 4 || num_fields > 6) {
+		g_printerr ("line %d: expected 4 to 6 fields, got %u\n",
+			    line_number, num_fields);
+		g_strfreev (fields);
+		return NULL;
+	}
+
+	job = g_new0 (RenderJob, 1);
+
+	if (g_str_has_suffix (fields[0], ".png"))
+		job->format = OUTPUT_PNG;
+	else if (g_str_has_suffix (fields[0], ".svg"))
+		job->format = OUTPUT_SVG;
+	else if (g_str_has_suffix (fields[0], ".pdf"))
+		job->format = OUTPUT_PDF;
+	else {
+		g_printerr ("line %d: unknown output format of %s\n",
+			    line_number, fields[0]);
+		g_strfreev (fields);
+		g_free (job);
+		return NULL;
+	}
+
+	if (!set_groups (num_fields > 4 ? fields[4] : NULL,
+			 job->groupLevels)
+	    || !set_levels (num_fields > 5 ? fields[5] : NULL,
+			    job->groupLevels)) {
+		g_printerr ("line %d: invalid groups or levels\n",
+			    line_number);
+		g_strfreev (fields);
+		g_free (job);
+		return NULL;
+	}
+	/* same defaults as the widget */
+	if (num_fields <= 4) {
+		job->groupLevels[0].group = job->groupLevels[2].group = 0;
+		job->groupLevels[1].group = job->groupLevels[3].group = 1;
+	}
+	if (num_fields <= 5) {
+		job->groupLevels[0].level = job->groupLevels[1].level = 0;
+		job->groupLevels[2].level = job->groupLevels[3].level = 1;
+	}
+
+	job->output = g_strdup (fields[0]);
+	job->names.keycodes = g_strdup (fields[1]);
+	job->names.geometry = g_strdup (fields[2]);
+	job->names.symbols = g_strdup (fields[3]);
+
+	g_strfreev (fields);
+	return job;
+}
+
+static GPtrArray *
+read_jobs (const gchar * filename)
+{
+	GPtrArray *list;
+	gchar *contents;
+	gchar **lines;
+	gsize length;
+	GError *error = NULL;
+	gint i;
+
+	if (strcmp (filename, "-") == 0) {
+		GIOChannel *in = g_io_channel_unix_new (0);
+		GIOStatus status =
+		    g_io_channel_read_to_end (in, &contents, &length,
+					      &error);
+		g_io_channel_unref (in);
+		if (status != G_IO_STATUS_NORMAL)
+			contents = NULL;
+	} else if (!g_file_get_contents (filename, &contents, &length,
+					 &error))
+		contents = NULL;
+
+	if (contents == NULL) {
+		g_printerr ("%s: %s\n", filename, error->message);
+		g_error_free (error);
+		return NULL;
+	}
+
+	list = g_ptr_array_new_with_free_func ((GDestroyNotify)
+					       render_job_free);
+	lines = g_strsplit (contents, "\n", -1);
+	g_free (contents);
+
+	for (i = 0; lines[i] != NULL; i++) {
+		gchar *line = g_strstrip (lines[i]);
+		RenderJob *job;
+
+		if (*line == '\0' || *line == '#')
+			continue;
+
+		job = parse_job (line, i + 1);
+		if (job == NULL) {
+			g_strfreev (lines);
+			g_ptr_array_free (list, TRUE);
+			return NULL;
+		}
+		g_ptr_array_add (list, job);
+	}
+
+	g_strfreev (lines);
+	return list;
+}
+
+static void
+worker_free (Worker * worker)
+{
+	if (worker->image)
+		cairo_surface_destroy (worker->image);
+	if (worker->display)
+		XCloseDisplay (worker->display);
+	g_free (worker);
+}
+
+/* Xlib connections are not shared between the threads, so that loading
+ * the keyboard descriptions runs in parallel too */
+static Worker *
+get_worker (void)
+{
+	Worker *worker = g_private_get (&current_worker);
+
+	if (worker != NULL)
+		return worker;
+
+	worker = g_new0 (Worker, 1);
+	worker->display = XOpenDisplay (NULL);
+	g_private_set (&current_worker, worker);
+
+	G_LOCK (workers);
+	g_ptr_array_add (workers, worker);
+	G_UNLOCK (workers);
+
+	return worker;
+}
+
+static cairo_surface_t *
+create_surface (Worker * worker, RenderJob * job)
+{
+	switch (job->format) {
+	case OUTPUT_SVG:
+		return cairo_svg_surface_create (job->output, width, height);
+	case OUTPUT_PDF:
+		return cairo_pdf_surface_create (job->output, width, height);
+	default:
+		if (worker->image == NULL)
+			worker->image =
+			    cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+							width, height);
+		return cairo_surface_reference (worker->image);
+	}
+}
+
+static void
+render_job (RenderJob * job, gpointer user_data)
+{
+	Worker *worker = get_worker ();
+	MatekbdKeyboardDrawingModel *model;
+	MatekbdKeyboardDrawingGroupLevel *pgroupLevels[4] = {
+		&job->groupLevels[0], &job->groupLevels[1],
+		&job->groupLevels[2], &job->groupLevels[3]
+	};
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	gint64 start;
+
+	if (worker->display == NULL) {
+		g_printerr ("%s: cannot open display\n", job->output);
+		return;
+	}
+
+	start = g_get_monotonic_time ();
+	model = matekbd_keyboard_drawing_model_new (worker->display,
+						    &job->names);
+	job->load_time = g_get_monotonic_time () - start;
+	if (model == NULL) {
+		g_printerr ("%s: error loading keyboard description "
+			    "(keycodes %s, geometry %s, symbols %s)\n",
+			    job->output, job->names.keycodes,
+			    job->names.geometry, job->names.symbols);
+		return;
+	}
+
+	start = g_get_monotonic_time ();
+	surface = create_surface (worker, job);
+	cr = cairo_create (surface);
+	if (job->format == OUTPUT_PNG) {
+		cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+		cairo_paint (cr);
+		cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+	}
+	job->success =
+	    matekbd_keyboard_drawing_model_render (model, cr, font_desc,
+						   &palette, pgroupLevels,
+						   0, 0, width, height, dpi,
+						   dpi);
+	cairo_destroy (cr);
+	job->render_time = g_get_monotonic_time () - start;
+
+	/* the vector surfaces are written out as they are finished */
+	start = g_get_monotonic_time ();
+	if (job->format == OUTPUT_PNG) {
+		if (job->success &&
+		    cairo_surface_write_to_png (surface, job->output) !=
+		    CAIRO_STATUS_SUCCESS)
+			job->success = FALSE;
+	} else {
+		cairo_surface_finish (surface);
+		if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS)
+			job->success = FALSE;
+	}
+	cairo_surface_destroy (surface);
+	job->write_time = g_get_monotonic_time () - start;
+
+	if (!job->success)
+		g_printerr ("%s: rendering failed\n", job->output);
+
+	matekbd_keyboard_drawing_model_unref (model);
+}
+
+gint
+main (gint argc, gchar ** argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	GThreadPool *pool;
+	GPtrArray *list;
+	gint64 start, elapsed, busy = 0;
+	guint i, failed = 0;
+
+	context = g_option_context_new ("JOBLIST - render keyboard layouts");
+	g_option_context_add_main_entries (context, options, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_message ("option parsing failed: %s", error->message);
+		g_option_context_free (context);
+		exit (EXIT_FAILURE);
+	}
+	g_option_context_free (context);
+
+	if (program_version) {
+		g_print ("kbdraw-render %s\n", VERSION);
+		exit (0);
+	}
+
+	if (argc != 2) {
+		g_printerr ("usage: %s [OPTION...] JOBLIST, "
+			    "\"-\" reads the list from stdin\n", argv[0]);
+		exit (1);
+	}
+
+	if (width <= 0 || height <= 0) {
+		g_printerr ("--width and --height must be positive\n");
+		exit (1);
+	}
+
+	if (jobs <= 0)
+		jobs = g_get_num_processors ();
+
+	list = read_jobs (argv[1]);
+	if (list == NULL)
+		exit (1);
+
+	/* each worker opens its own display */
+	XInitThreads ();
+
+	font_desc = pango_font_description_from_string (font ? font : "Sans");
+	workers = g_ptr_array_new_with_free_func ((GDestroyNotify)
+						  worker_free);
+
+	start = g_get_monotonic_time ();
+
+	pool = g_thread_pool_new ((GFunc) render_job, NULL, jobs, TRUE,
+				  NULL);
+	for (i = 0; i < list->len; i++)
+		g_thread_pool_push (pool, g_ptr_array_index (list, i), NULL);
+	g_thread_pool_free (pool, FALSE, TRUE);
+
+	elapsed = g_get_monotonic_time () - start;
+
+	g_print ("%-40s %10s %10s %10s\n", "output", "load ms", "render ms",
+		 "write ms");
+	for (i = 0; i < list->len; i++) {
+		RenderJob *job = g_ptr_array_index (list, i);
+
+		if (!job->success) {
+			failed++;
+			continue;
+		}
+		busy += job->load_time + job->render_time + job->write_time;
+		g_print ("%-40s %10.2f %10.2f %10.2f\n", job->output,
+			 job->load_time / 1000.0, job->render_time / 1000.0,
+			 job->write_time / 1000.0);
+	}
+	g_print ("\n%u rendered, %u failed on %d threads in %.2f s "
+		 "(%.2f s of work, %.1fx)\n", list->len - failed, failed,
+		 jobs, elapsed / 1e6, busy / 1e6,
+		 elapsed > 0 ? (gdouble) busy / elapsed : 0.0);
+
+	g_ptr_array_free (workers, TRUE);
+	g_ptr_array_free (list, TRUE);
+	pango_font_description_free (font_desc);
+
+	return failed == 0 ? 0 : 1;
+}